@@ -0,0 +1,396 @@
+/*
+ * Decoder throughput benchmark
+ *
+ * Copyright 2017-2020 Zebediah Figura
+ *
+ * This file is part of Semblance.
+ *
+ * Semblance is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Semblance is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Semblance; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "semblance.h"
+#include "x86_instr.h"
+
+/* Times the three stages of disassembly separately: decoding with
+ * get_instr(), formatting the arguments with format_instr(), and printing
+ * with write_instr(). Each stream is swept linearly, the same way -D does.
+ *
+ * The synthetic streams are built from a fixed seed, so numbers are
+ * comparable between runs and between builds. Files given on the command
+ * line are treated as raw code. */
+
+word mode;
+word opts;
+enum asm_syntax asm_syntax;
+
+struct template {
+    byte len;
+    byte bytes[MAX_INSTR];
+};
+
+#define T(...) {sizeof((byte[]){__VA_ARGS__}), {__VA_ARGS__}}
+
+static const struct template base16[] = {
+    T(0x55),                                /* push bp */
+    T(0x8b, 0xec),                          /* mov bp, sp */
+    T(0x83, 0xec, 0x10),                    /* sub sp, 10h */
+    T(0x8b, 0x46, 0x06),                    /* mov ax, [bp+6] */
+    T(0x89, 0x46, 0xfe),                    /* mov [bp-2], ax */
+    T(0x26, 0x8b, 0x07),                    /* mov ax, es:[bx] */
+    T(0xb8, 0x34, 0x12),                    /* mov ax, 1234h */
+    T(0xe8, 0x10, 0x00),                    /* call */
+    T(0x9a, 0x00, 0x00, 0x00, 0x00),        /* call far */
+    T(0x74, 0x05),                          /* jz */
+    T(0xcd, 0x21),                          /* int 21h */
+    T(0xf3, 0xa4),                          /* rep movsb */
+    T(0x5d),                                /* pop bp */
+    T(0xcb),                                /* retf */
+};
+
+static const struct template base32[] = {
+    T(0x55),                                /* push ebp */
+    T(0x8b, 0xec),                          /* mov ebp, esp */
+    T(0x83, 0xec, 0x10),                    /* sub esp, 10h */
+    T(0x8b, 0x45, 0x08),                    /* mov eax, [ebp+8] */
+    T(0x89, 0x44, 0x24, 0x04),              /* mov [esp+4], eax */
+    T(0x8d, 0x4c, 0x24, 0x10),              /* lea ecx, [esp+10h] */
+    T(0xe8, 0x10, 0x00, 0x00, 0x00),        /* call */
+    T(0xff, 0x15, 0x00, 0x20, 0x40, 0x00),  /* call [402000h] */
+    T(0x0f, 0xb6, 0xc0),                    /* movzx eax, al */
+    T(0x0f, 0x84, 0x10, 0x00, 0x00, 0x00),  /* jz */
+    T(0x85, 0xc0),                          /* test eax, eax */
+    T(0xc7, 0x45, 0xfc, 0x01, 0x00, 0x00, 0x00),    /* mov dword [ebp-4], 1 */
+    T(0xf3, 0xa5),                          /* rep movsd */
+    T(0xc3),                                /* ret */
+};
+
+static const struct template base64[] = {
+    T(0x48, 0x89, 0x5c, 0x24, 0x08),        /* mov [rsp+8], rbx */
+    T(0x48, 0x83, 0xec, 0x28),              /* sub rsp, 28h */
+    T(0x48, 0x8b, 0x05, 0x10, 0x00, 0x00, 0x00),    /* mov rax, [rip+10h] */
+    T(0x4c, 0x8d, 0x05, 0x10, 0x00, 0x00, 0x00),    /* lea r8, [rip+10h] */
+    T(0xe8, 0x10, 0x00, 0x00, 0x00),        /* call */
+    T(0xff, 0x15, 0x10, 0x00, 0x00, 0x00),  /* call [rip+10h] */
+    T(0x41, 0x57),                          /* push r15 */
+    T(0x48, 0x85, 0xc0),                    /* test rax, rax */
+    T(0x0f, 0x1f, 0x44, 0x00, 0x00),        /* nop */
+    T(0x74, 0x05),                          /* jz */
+    T(0x48, 0xb8, 1, 2, 3, 4, 5, 6, 7, 8),  /* mov rax, imm64 */
+    T(0xc3),                                /* ret */
+};
+
+static const struct template sse[] = {
+    T(0x0f, 0x28, 0xc1),                    /* movaps xmm0, xmm1 */
+    T(0x0f, 0x58, 0xc8),                    /* addps xmm1, xmm0 */
+    T(0x66, 0x0f, 0x6f, 0x04, 0x24),        /* movdqa xmm0, [esp] */
+    T(0x66, 0x0f, 0xef, 0xc0),              /* pxor xmm0, xmm0 */
+    T(0xf2, 0x0f, 0x10, 0x45, 0xf8),        /* movsd xmm0, [ebp-8] */
+    T(0xf3, 0x0f, 0x59, 0xc1),              /* mulss xmm0, xmm1 */
+    T(0x66, 0x0f, 0x38, 0x00, 0xc1),        /* pshufb xmm0, xmm1 */
+    T(0x66, 0x0f, 0x3a, 0x0f, 0xc1, 0x08),  /* palignr xmm0, xmm1, 8 */
+};
+
+static const struct template vex[] = {
+    T(0xc5, 0xfc, 0x28, 0xc1),              /* vmovaps ymm0, ymm1 */
+    T(0xc5, 0xf9, 0xef, 0xc0),              /* vpxor xmm0, xmm0, xmm0 */
+    T(0xc4, 0xe2, 0x79, 0x00, 0xc1),        /* vpshufb xmm0, xmm0, xmm1 */
+};
+
+#undef T
+
+struct template_set {
+    const struct template *templates;
+    unsigned count;
+};
+
+#define SET(t) {t, sizeof(t)/sizeof(t[0])}
+
+struct stream {
+    const char *name;
+    int bits;
+    struct template_set sets[3];
+    byte *code;
+    size_t size;
+};
+
+static struct stream synthetic[] = {
+    {"16-bit",          16, {SET(base16)}},
+    {"32-bit",          32, {SET(base32)}},
+    {"32-bit+SSE",      32, {SET(base32), SET(sse)}},
+    {"64-bit",          64, {SET(base64)}},
+    {"64-bit+SSE+VEX",  64, {SET(base64), SET(sse), SET(vex)}},
+};
+
+#undef SET
+
+/* Size of each synthetic stream. */
+#define STREAM_SIZE     (256 * 1024)
+
+static unsigned long rand_state = 0x2545f491;
+
+static unsigned long next_rand(void)
+{
+    /* xorshift, so that every libc gives the same streams */
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 7;
+    rand_state ^= rand_state << 17;
+    return rand_state;
+}
+
+static int build_stream(struct stream *stream)
+{
+    unsigned total = 0, i;
+
+    for (i = 0; i < 3; i++)
+        total += stream->sets[i].count;
+
+    /* the last template can start just short of STREAM_SIZE, and is followed
+     * by MAX_INSTR bytes of zero padding */
+    if (!(stream->code = malloc(STREAM_SIZE + 2 * MAX_INSTR))) {
+        perror(stream->name);
+        return -1;
+    }
+    stream->size = 0;
+    while (stream->size < STREAM_SIZE) {
+        unsigned n = next_rand() % total;
+        const struct template *t;
+
+        for (i = 0; n >= stream->sets[i].count; i++)
+            n -= stream->sets[i].count;
+        t = &stream->sets[i].templates[n];
+
+        memcpy(stream->code + stream->size, t->bytes, t->len);
+        stream->size += t->len;
+    }
+    memset(stream->code + stream->size, 0, MAX_INSTR);
+    return 0;
+}
+
+static int read_stream(struct stream *stream, const char *file, int bits)
+{
+    FILE *f = fopen(file, "rb");
+    long size;
+
+    if (!f) {
+        perror(file);
+        return -1;
+    }
+    if (fseek(f, 0, SEEK_END) < 0 || (size = ftell(f)) < 0 || fseek(f, 0, SEEK_SET) < 0) {
+        perror(file);
+        fclose(f);
+        return -1;
+    }
+
+    stream->name = file;
+    stream->bits = bits;
+    if (!(stream->code = calloc(size + MAX_INSTR, 1))) {
+        perror(file);
+        fclose(f);
+        return -1;
+    }
+    stream->size = fread(stream->code, 1, size, f);
+    fclose(f);
+    return 0;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void report(const char *name, const char *stage, unsigned long count, unsigned long bytes, double secs)
+{
+    printf("%-24s %-8s %10.0f %10.2f %8.1f\n", name, stage,
+        count / secs, bytes / secs / (1024 * 1024), secs * 1e9 / count);
+}
+
+/* Instructions are decoded, formatted and printed this many at a time, so that
+ * memory use doesn't depend on the size of the stream. */
+#define BLOCK_INSTRS    4096
+
+static void run_stream(const struct stream *stream, unsigned iterations, struct output *sink)
+{
+    struct instr *instrs;
+    struct instr_text *texts;
+    byte *lens;
+    double decode = 0, format = 0, output = 0, start;
+    unsigned long count = 0, bytes = 0;
+    char ip_string[17];
+    unsigned iter;
+    size_t n, i;
+    dword block, ip;
+
+    instrs = malloc(BLOCK_INSTRS * sizeof(*instrs));
+    texts = malloc(BLOCK_INSTRS * sizeof(*texts));
+    lens = malloc(BLOCK_INSTRS);
+    if (!instrs || !texts || !lens) {
+        perror(stream->name);
+        goto out;
+    }
+
+    for (iter = 0; iter < iterations; iter++) {
+        for (block = 0; block < stream->size; block = ip) {
+            start = now();
+            for (n = 0, ip = block; n < BLOCK_INSTRS && ip < stream->size; n++)
+                ip += (lens[n] = get_instr(ip, stream->code + ip, &instrs[n], stream->bits));
+            decode += now() - start;
+
+            start = now();
+            memset(texts, 0, n * sizeof(*texts));
+            for (i = 0, ip = block; i < n; ip += lens[i++]) {
+                sprintf(ip_string, "%8x", ip);
+                format_instr(ip_string, &instrs[i], &texts[i], stream->bits);
+            }
+            format += now() - start;
+
+            start = now();
+            for (i = 0, ip = block; i < n; ip += lens[i++]) {
+                sprintf(ip_string, "%8x", ip);
+                write_instr(sink, ip_string, stream->code + ip, lens[i], 0, &instrs[i], &texts[i], NULL);
+            }
+            output += now() - start;
+
+            count += n;
+        }
+
+        start = now();
+        output_flush(sink);
+        output += now() - start;
+
+        bytes += stream->size;
+    }
+
+    if (count) {
+        report(stream->name, "decode", count, bytes, decode);
+        report(stream->name, "format", count, bytes, format);
+        report(stream->name, "output", count, bytes, output);
+    }
+
+out:
+    free(lens);
+    free(texts);
+    free(instrs);
+}
+
+static const char help_message[] =
+"bench: measure disassembler throughput.\n"
+"Usage: bench [options] [file(s)]\n"
+"Files are disassembled as raw code, in addition to the built-in streams.\n"
+"Available options:\n"
+"\t-b, --bits=16|32|64                  Bitness of code in files (default 32).\n"
+"\t-h, --help                           Display this help message.\n"
+"\t-M, --disassembler-options=[...]     Syntax to format with, as for dump.\n"
+"\t-n, --iterations=N                   Number of passes over each stream (default 20).\n"
+"\t-o, --output=FILE                    Where to write the disassembly (default /dev/null).\n"
+;
+
+static const struct option long_options[] = {
+    {"bits",                    required_argument,  NULL, 'b'},
+    {"help",                    no_argument,        NULL, 'h'},
+    {"disassembler-options",    required_argument,  NULL, 'M'},
+    {"iterations",              required_argument,  NULL, 'n'},
+    {"output",                  required_argument,  NULL, 'o'},
+    {0}
+};
+
+int main(int argc, char *argv[])
+{
+    const char *output = "/dev/null";
+    unsigned iterations = 20;
+    int bits = 32;
+    static char buffer[65536];
+    struct output sink;
+    int fd;
+    int opt;
+    unsigned i;
+
+    asm_syntax = NASM;
+
+    while ((opt = getopt_long(argc, argv, "b:hM:n:o:", long_options, NULL)) >= 0) {
+        switch (opt) {
+        case 'b':
+            bits = atoi(optarg);
+            if (bits != 16 && bits != 32 && bits != 64) {
+                fprintf(stderr, "Invalid bitness `%s'.\n", optarg);
+                return 1;
+            }
+            break;
+        case 'h':
+            printf(help_message);
+            return 0;
+        case 'M':
+            if (!strcmp(optarg, "att") || !strcmp(optarg, "gas"))
+                asm_syntax = GAS;
+            else if (!strcmp(optarg, "intel") || !strcmp(optarg, "masm"))
+                asm_syntax = MASM;
+            else if (!strcmp(optarg, "nasm"))
+                asm_syntax = NASM;
+            else {
+                fprintf(stderr, "Unrecognized disassembly option `%s'.\n", optarg);
+                return 1;
+            }
+            break;
+        case 'n':
+            if ((int)(iterations = atoi(optarg)) < 1) {
+                fprintf(stderr, "Invalid number of iterations `%s'.\n", optarg);
+                return 1;
+            }
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: bench [options] [file(s)]\n");
+            return 1;
+        }
+    }
+
+    if ((fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0) {
+        perror(output);
+        return 1;
+    }
+    output_init(&sink, buffer, sizeof(buffer), fd);
+
+    printf("%-24s %-8s %10s %10s %8s\n", "stream", "stage", "instr/s", "MiB/s", "ns/instr");
+
+    for (i = 0; i < sizeof(synthetic)/sizeof(synthetic[0]); i++) {
+        if (build_stream(&synthetic[i]) < 0)
+            continue;
+        run_stream(&synthetic[i], iterations, &sink);
+        free(synthetic[i].code);
+    }
+
+    for (; optind < argc; optind++) {
+        struct stream stream;
+
+        if (read_stream(&stream, argv[optind], bits) < 0)
+            continue;
+        run_stream(&stream, iterations, &sink);
+        free(stream.code);
+    }
+
+    close(fd);
+    return 0;
+}
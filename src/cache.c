@@ -0,0 +1,197 @@
+/*
+ * Caching code analysis between runs
+ *
+ * Copyright 2017-2020 Zebediah Figura
+ *
+ * This file is part of Semblance.
+ *
+ * Semblance is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Semblance is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Semblance; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "semblance.h"
+#include "cache.h"
+
+/* With --cache, the flags found by scanning a file are saved under the hash of
+ * its contents, and a later run over the same file loads them instead of
+ * scanning again. Besides the contents, scanning depends only on the assembler
+ * syntax (it compares mnemonics, which differ in GAS), so that goes into the
+ * hash as well. Each cache file is:
+ *
+ *     struct cache_header
+ *     dword lengths[count]
+ *     the flag bitmaps (see scan.h), one after another
+ *
+ * Warnings printed while scanning are not saved, so they only show up on the
+ * run that fills the cache. */
+
+const char *cache_dir;
+
+/* Change this whenever scanning changes what it finds. */
+#define CACHE_VERSION   2
+
+struct cache_header {
+    char magic[8];
+    dword version;
+    dword count;
+    qword size;         /* of the file */
+    qword hash;
+};
+
+static const char cache_magic[8] = "SMBLFLGS";
+
+/* 64-bit FNV-1a, of the contents followed by the syntax */
+static qword hash_image(const struct image *image)
+{
+    qword hash = 0xcbf29ce484222325ull;
+    off_t offset = 0;
+
+    while (offset < image->size) {
+        size_t len = min(image->size - offset, 65536), i;
+        const byte *p = read_bytes(image, offset, len);
+
+        for (i = 0; i < len; i++)
+            hash = (hash ^ p[i]) * 0x100000001b3ull;
+        offset += len;
+    }
+    return (hash ^ asm_syntax) * 0x100000001b3ull;
+}
+
+static void get_cache_path(char *path, size_t size, qword hash)
+{
+    snprintf(path, size, "%s/%016llx", cache_dir, (unsigned long long)hash);
+}
+
+void flag_cache_init(struct flag_cache *cache, unsigned count)
+{
+    cache->count = count;
+    cache->flags = calloc(count, sizeof(*cache->flags));
+    cache->lengths = calloc(count, sizeof(*cache->lengths));
+    cache->hash = 0;
+}
+
+void flag_cache_free(struct flag_cache *cache)
+{
+    free(cache->flags);
+    free(cache->lengths);
+}
+
+/* Fill in the flags from the cache. Returns nonzero on success; if the file
+ * isn't cached (or the cache doesn't match), the flags are left alone. */
+int flag_cache_load(const struct image *image, struct flag_cache *cache)
+{
+    const struct cache_header *header;
+    const dword *lengths;
+    const byte *map, *p;
+    char path[4096];
+    struct stat st;
+    qword expect;
+    unsigned i;
+    int fd;
+
+    cache->hash = hash_image(image);
+    get_cache_path(path, sizeof(path), cache->hash);
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return 0;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(*header)
+            || (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        close(fd);
+        return 0;
+    }
+    close(fd);
+
+    header = (const struct cache_header *)map;
+    lengths = (const dword *)(header + 1);
+    expect = sizeof(*header) + (qword)cache->count * sizeof(dword);
+    if (memcmp(header->magic, cache_magic, sizeof(cache_magic))
+            || header->version != CACHE_VERSION
+            || header->count != cache->count
+            || header->size != (qword)image->size
+            || header->hash != cache->hash
+            || (qword)st.st_size < expect)
+        goto fail;
+    for (i = 0; i < cache->count; i++) {
+        if (lengths[i] != cache->lengths[i])
+            goto fail;
+        expect += lengths[i];
+    }
+    if ((qword)st.st_size != expect)
+        goto fail;
+
+    p = (const byte *)(lengths + cache->count);
+    for (i = 0; i < cache->count; i++) {
+        if (cache->flags[i])
+            memcpy(cache->flags[i], p, cache->lengths[i]);
+        p += cache->lengths[i];
+    }
+
+    munmap((void *)map, st.st_size);
+    return 1;
+
+fail:
+    munmap((void *)map, st.st_size);
+    return 0;
+}
+
+/* Save the flags for next time. The file is written under a temporary name
+ * and then renamed, so that others reading the cache (perhaps other threads
+ * or processes dumping the same file) never see it half-written. */
+void flag_cache_store(const struct image *image, const struct flag_cache *cache)
+{
+    struct cache_header header;
+    char path[4096], tmp[4096 + 8];
+    unsigned i;
+    FILE *f;
+    int fd;
+
+    get_cache_path(path, sizeof(path), cache->hash);
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+
+    if (mkdir(cache_dir, 0777) < 0 && errno != EEXIST) {
+        fprintf(stderr, "Cannot create cache directory %s: %s\n", cache_dir, strerror(errno));
+        return;
+    }
+    if ((fd = mkstemp(tmp)) < 0 || !(f = fdopen(fd, "wb"))) {
+        fprintf(stderr, "Cannot write cache file %s: %s\n", tmp, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+
+    memcpy(header.magic, cache_magic, sizeof(cache_magic));
+    header.version = CACHE_VERSION;
+    header.count = cache->count;
+    header.size = image->size;
+    header.hash = cache->hash;
+    fwrite(&header, sizeof(header), 1, f);
+    fwrite(cache->lengths, sizeof(dword), cache->count, f);
+    for (i = 0; i < cache->count; i++) {
+        if (cache->flags[i])
+            fwrite(cache->flags[i], 1, cache->lengths[i], f);
+    }
+
+    if (ferror(f) | fclose(f) || rename(tmp, path) < 0) {
+        fprintf(stderr, "Cannot write cache file %s: %s\n", path, strerror(errno));
+        unlink(tmp);
+    }
+}
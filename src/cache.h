@@ -0,0 +1,24 @@
+#ifndef __CACHE_H
+#define __CACHE_H
+
+#include "semblance.h"
+
+/* The results of code discovery for one file: the instr_flags array of each
+ * segment or section, in order. Arrays may be NULL (with length 0) for those
+ * that aren't scanned. */
+struct flag_cache {
+    unsigned count;
+    byte **flags;
+    dword *lengths;
+    qword hash;         /* of the file contents; filled in by flag_cache_load() */
+};
+
+/* directory to keep analysis in, or NULL */
+extern const char *cache_dir;
+
+extern void flag_cache_init(struct flag_cache *cache, unsigned count);
+extern int flag_cache_load(const struct image *image, struct flag_cache *cache);
+extern void flag_cache_store(const struct image *image, const struct flag_cache *cache);
+extern void flag_cache_free(struct flag_cache *cache);
+
+#endif /* __CACHE_H */
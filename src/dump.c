@@ -20,18 +20,17 @@
  * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
  */
 
-#include <fcntl.h>
+#include <errno.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/mman.h>
-#include <sys/stat.h>
-#include <sys/types.h>
 #include <unistd.h>
 
 #include "semblance.h"
-
-byte *map;
+#include "cache.h"
+#include "scan.h"
+#include "sweep.h"
 
 word mode;
 word opts;
@@ -39,51 +38,149 @@ char **resource_filters;
 unsigned resource_filters_count;
 enum asm_syntax asm_syntax;
 
-static void dump_file(char *file){
-    struct stat st;
+static void dump_file(char *file, struct output *out){
+    struct image image;
     word magic;
     off_t offset = 0;
-    int fd;
-
-    if ((fd = open(file, O_RDONLY)) < 0) {
-        perror("Cannot open %s");
-        return;
-    }
-
-    if (fstat(fd, &st) < 0)
-    {
-        perror("Cannot stat %s");
-        return;
-    }
 
-    if ((map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
-    {
-        perror("Cannot map %s");
+    if (image_open(&image, file, out) < 0)
         return;
-    }
 
-    magic = read_word(0);
+    magic = read_word(&image, 0);
 
-    printf("File: %s\n", file);
+    out_puts(out, "File: ");
+    out_puts(out, file);
+    out_putc(out, '\n');
     if (magic == 0x5a4d){ /* MZ */
-        offset = read_dword(0x3c);
-        magic = read_word(offset);
+        offset = read_dword(&image, 0x3c);
+        magic = read_word(&image, offset);
 
         if (magic == 0x4550)
-            dumppe(offset);
+            dumppe(&image, offset);
         else if (magic == 0x454e)
-            dumpne(offset);
+            dumpne(&image, offset);
         else
-            dumpmz();
+            dumpmz(&image);
     } else
-        fprintf(stderr, "File format not recognized\n");
+        warn_printf("File format not recognized\n");
+
+    if (image_error(&image))
+        warn_printf("%s: file is truncated or corrupt; some data was read as zeroes\n", file);
+
+    image_close(&image);
+}
+
+/* With -j, files are dumped on a pool of threads. Each file's output and
+ * warnings are collected in memory and written out in the order the files were
+ * given.
+ * Workers may only run a limited distance ahead of the file being written,
+ * so that we don't end up holding the output of every file at once. */
+
+struct job {
+    char *file;
+    struct output output, warnings;
+    int done;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct job *jobs;
+    int count;
+    int next;       /* next job to hand out */
+    int written;    /* number of jobs whose output has been written */
+    int window;     /* how far ahead of written a job may be started */
+} pool = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+static void *dump_thread(void *arg)
+{
+    struct job *job;
+
+    for (;;) {
+        pthread_mutex_lock(&pool.lock);
+        while (pool.next < pool.count && pool.next >= pool.written + pool.window)
+            pthread_cond_wait(&pool.cond, &pool.lock);
+        if (pool.next == pool.count) {
+            pthread_mutex_unlock(&pool.lock);
+            return NULL;
+        }
+        job = &pool.jobs[pool.next++];
+        pthread_mutex_unlock(&pool.lock);
+
+        output_init(&job->output, NULL, 0, -1);
+        output_init(&job->warnings, NULL, 0, -1);
+        warn_output = &job->warnings;
+        dump_file(job->file, &job->output);
+        warn_output = NULL;
+
+        pthread_mutex_lock(&pool.lock);
+        job->done = 1;
+        pthread_cond_broadcast(&pool.cond);
+        pthread_mutex_unlock(&pool.lock);
+    }
+}
+
+static void dump_files(char **files, int count, int nthreads, struct output *out)
+{
+    pthread_t *threads;
+    int started, i;
 
-    return;
+    if (nthreads > count)
+        nthreads = count;
+
+    pool.jobs = calloc(count, sizeof(*pool.jobs));
+    for (i = 0; i < count; i++)
+        pool.jobs[i].file = files[i];
+    pool.count = count;
+    pool.window = nthreads * 4;
+
+    threads = malloc(nthreads * sizeof(*threads));
+    for (started = 0; started < nthreads; started++) {
+        if ((errno = pthread_create(&threads[started], NULL, dump_thread, NULL))) {
+            perror("Cannot create thread");
+            break;
+        }
+    }
+
+    for (i = 0; i < count; i++) {
+        struct job *job = &pool.jobs[i];
+
+        pthread_mutex_lock(&pool.lock);
+        if (!started && pool.next == i) {
+            /* no threads, so do it ourselves */
+            pool.next++;
+            pthread_mutex_unlock(&pool.lock);
+            dump_file(job->file, out);
+        } else {
+            while (!job->done)
+                pthread_cond_wait(&pool.cond, &pool.lock);
+            pthread_mutex_unlock(&pool.lock);
+            out_write(out, job->output.buf, job->output.len);
+            warn_write(job->warnings.buf, job->warnings.len);
+            free(job->output.buf);
+            free(job->warnings.buf);
+        }
+
+        if (i + 1 < count)
+            out_puts(out, "\n\n");
+        output_flush(out);
+
+        pthread_mutex_lock(&pool.lock);
+        pool.written = i + 1;
+        pthread_cond_broadcast(&pool.cond);
+        pthread_mutex_unlock(&pool.lock);
+    }
+
+    for (i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    free(pool.jobs);
 }
 
 static const char help_message[] =
 "dump: tool to disassemble and print information from executable files.\n"
 "Usage: dump [options] <file(s)>\n"
+"A file name of `-' reads from standard input.\n"
 "Available options:\n"
 "\t-a, --resource[=filter]              Print embedded resources.\n"
 "\t-c, --compilable                     Produce output that can be compiled.\n"
@@ -93,6 +190,9 @@ static const char help_message[] =
 "\t-f, --file-headers                   Print contents of the file header.\n"
 "\t-h, --help                           Display this help message.\n"
 "\t-i, --imports                        Print imported modules.\n"
+"\t-j, --jobs=N                         Dump N files at a time, or use N threads\n"
+"\t                                     to print the sections or segments of one\n"
+"\t                                     file and to sweep large ones with -D.\n"
 "\t-M, --disassembler-options=[...]     Extended options for disassembly.\n"
 "\t\tatt        Alias for `gas'.\n"
 "\t\tgas        Use GAS syntax for disassembly.\n"
@@ -106,6 +206,13 @@ static const char help_message[] =
 "\t--no-show-addresses                  Don't print instruction addresses.\n"
 "\t--no-show-raw-insn                   Don't print raw instruction hex code.\n"
 "\t--pe-rel-addr=[y/n]                  Use relative addresses for PE files.\n"
+"\t--cache=DIR                          Keep code analysis in DIR, to reuse when\n"
+"\t                                     dumping the same file again.\n"
+"\t--map-sections                       Lay out PE sections by address, as the\n"
+"\t                                     loader would, for faster lookups.\n"
+"\t--parallel-scan                      With -j and one file, also find code on\n"
+"\t                                     several threads. Overlapping instructions\n"
+"\t                                     may then be listed differently between runs.\n"
 ;
 
 static const struct option long_options[] = {
@@ -119,6 +226,7 @@ static const struct option long_options[] = {
 //  {"gas",                     no_argument,        NULL, 'G'},
     {"help",                    no_argument,        NULL, 'h'},
     {"imports",                 no_argument,        NULL, 'i'},
+    {"jobs",                    required_argument,  NULL, 'j'},
 //  {"masm",                    no_argument,        NULL, 'I'}, /* for "Intel" */
     {"disassembler-options",    required_argument,  NULL, 'M'},
 //  {"nasm",                    no_argument,        NULL, 'N'},
@@ -129,17 +237,24 @@ static const struct option long_options[] = {
     {"no-show-raw-insn",        no_argument,        NULL, NO_SHOW_RAW_INSN},
     {"no-prefix-addresses",     no_argument,        NULL, NO_SHOW_ADDRESSES},
     {"pe-rel-addr",             required_argument,  NULL, 0x80},
+    {"cache",                   required_argument,  NULL, 0x81},
+    {"parallel-scan",           no_argument,        NULL, 0x82},
+    {"map-sections",            no_argument,        NULL, 0x83},
     {0}
 };
 
 int main(int argc, char *argv[]){
+    static char buffer[65536];
+    static struct output out;   /* warn_stdout points here */
+    int nthreads = 1;
+    int parallel_scan = 0;
     int opt;
 
     mode = 0;
     opts = 0;
     asm_syntax = NASM;
 
-    while ((opt = getopt_long(argc, argv, "a::cCdDefhiM:osvx", long_options, NULL)) >= 0){
+    while ((opt = getopt_long(argc, argv, "a::cCdDefhij:M:osvx", long_options, NULL)) >= 0){
         switch (opt) {
         case NO_SHOW_RAW_INSN:
             opts |= NO_SHOW_RAW_INSN;
@@ -182,6 +297,13 @@ int main(int argc, char *argv[]){
         case 'i': /* imports */
             mode |= DUMPIMPORT;
             break;
+        case 'j': /* jobs */
+            nthreads = atoi(optarg);
+            if (nthreads < 1) {
+                fprintf(stderr, "Invalid number of jobs `%s'.\n", optarg);
+                return 1;
+            }
+            break;
         case 'M': /* additional options */
             if (!strcmp(optarg, "att") || !strcmp(optarg, "gas"))
                 asm_syntax = GAS;
@@ -216,6 +338,15 @@ int main(int argc, char *argv[]){
                 return 1;
             }
             break;
+        case 0x81:
+            cache_dir = optarg;
+            break;
+        case 0x82:
+            parallel_scan = 1;
+            break;
+        case 0x83:
+            pe_map_sections = 1;
+            break;
         default:
             fprintf(stderr, "Usage: dumpne [options] <file>\n");
             return 1;
@@ -228,10 +359,26 @@ int main(int argc, char *argv[]){
     if (optind == argc)
         printf(help_message);
 
+    output_init(&out, buffer, sizeof(buffer), STDOUT_FILENO);
+    warn_stdout = &out;
+
+    /* With only one file, put the threads to use on large sections. */
+    if (argc - optind == 1) {
+        sweep_threads = nthreads;
+        if (parallel_scan)
+            scan_threads = nthreads;
+    }
+
+    if (nthreads > 1 && optind < argc) {
+        dump_files(argv + optind, argc - optind, nthreads, &out);
+        return 0;
+    }
+
     while (optind < argc){
-        dump_file(argv[optind++]);
+        dump_file(argv[optind++], &out);
         if (optind < argc)
-            printf("\n\n");
+            out_puts(&out, "\n\n");
+        output_flush(&out);
     }
 
     return 0;
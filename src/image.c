@@ -0,0 +1,318 @@
+/*
+ * Reading executable files
+ *
+ * Copyright 2017-2020 Zebediah Figura
+ *
+ * This file is part of Semblance.
+ *
+ * Semblance is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Semblance is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Semblance; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "semblance.h"
+
+/* Every mapping is followed by IMAGE_SLACK bytes of zeroes, so that reading
+ * a little way past the end of the file is harmless.
+ *
+ * Normally the whole file is mapped at once. If that fails (usually because
+ * the file doesn't fit in the address space), it's mapped a window at a time
+ * instead, keeping the most recently used few around.
+ *
+ * Pointers from read_data() are expected to last as long as the image, so
+ * windows they point into are pinned, and never unmapped until we're done.
+ * Those are the headers, name tables and resources, which are small and few.
+ * Everything else (the code and data that we sweep through) is read through
+ * read_bytes() and friends, which don't pin anything.
+ *
+ * Input that can't be mapped at all, such as a pipe, is first copied to a
+ * temporary file. */
+
+#define WINDOW_SIZE     (1 << 20)
+#define WINDOW_COUNT    8           /* unpinned windows kept around */
+
+struct window {
+    byte *data;
+    off_t start;
+    size_t length;
+    unsigned long used;             /* for finding the least recently used */
+    int pinned;
+};
+
+struct image_file {
+    int fd;
+    FILE *tmp;                      /* copy of non-seekable input */
+    void *map;                      /* the whole file, if we could map it */
+    struct window *windows;
+    unsigned count, capacity;
+    unsigned unpinned;
+    unsigned long clock;
+    int error;                      /* something read outside the file; atomic,
+                                     * since any thread may set it */
+};
+
+static const byte zeroes[IMAGE_SLACK];
+
+/* Map length bytes of the file at start, followed by IMAGE_SLACK zeroes. */
+static void *map_padded(int fd, off_t start, size_t length)
+{
+    void *map = mmap(NULL, length + IMAGE_SLACK, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (map == MAP_FAILED)
+        return NULL;
+    if (length && mmap(map, length, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, start) == MAP_FAILED) {
+        munmap(map, length + IMAGE_SLACK);
+        return NULL;
+    }
+    return map;
+}
+
+static int copy_to_tmpfile(struct image_file *file)
+{
+    char buffer[65536];
+    ssize_t len;
+
+    if (!(file->tmp = tmpfile()))
+        return -1;
+
+    while ((len = read(file->fd, buffer, sizeof(buffer)))) {
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (fwrite(buffer, 1, len, file->tmp) != (size_t)len)
+            return -1;
+    }
+    if (fflush(file->tmp))
+        return -1;
+
+    if (file->fd != STDIN_FILENO)
+        close(file->fd);
+    file->fd = fileno(file->tmp);
+    return 0;
+}
+
+/* Open a file for dumping; "-" is standard input. */
+int image_open(struct image *image, const char *name, struct output *out)
+{
+    struct image_file *file = calloc(1, sizeof(*file));
+    struct stat st;
+
+    image->file = file;
+    image->map = NULL;
+    image->out = out;
+
+    if (!strcmp(name, "-"))
+        file->fd = STDIN_FILENO;
+    else if ((file->fd = open(name, O_RDONLY)) < 0) {
+        perror("Cannot open %s");
+        free(file);
+        return -1;
+    }
+
+    if (fstat(file->fd, &st) < 0)
+    {
+        perror("Cannot stat %s");
+        image_close(image);
+        return -1;
+    }
+
+    if (!S_ISREG(st.st_mode)) {
+        if (copy_to_tmpfile(file) < 0 || fstat(file->fd, &st) < 0) {
+            perror("Cannot read %s");
+            image_close(image);
+            return -1;
+        }
+    }
+
+    image->size = st.st_size;
+
+    if ((uintmax_t)st.st_size <= SIZE_MAX - IMAGE_SLACK)
+        image->map = file->map = map_padded(file->fd, 0, st.st_size);
+
+    return 0;
+}
+
+/* Returns nonzero if anything tried to read outside of the file. */
+int image_error(const struct image *image)
+{
+    return __atomic_load_n(&image->file->error, __ATOMIC_RELAXED);
+}
+
+void image_close(struct image *image)
+{
+    struct image_file *file = image->file;
+    unsigned i;
+
+    if (file->map)
+        munmap(file->map, image->size + IMAGE_SLACK);
+    for (i = 0; i < file->count; i++)
+        munmap(file->windows[i].data, file->windows[i].length + IMAGE_SLACK);
+    free(file->windows);
+
+    if (file->tmp)
+        fclose(file->tmp);
+    else if (file->fd != STDIN_FILENO)
+        close(file->fd);
+    free(file);
+}
+
+static struct window *map_window(struct image_file *file, off_t start, size_t length)
+{
+    struct window *window = NULL;
+    unsigned i;
+    void *data;
+
+    if (!(data = map_padded(file->fd, start, length)))
+        return NULL;
+
+    /* reuse the least recently used window, if we have enough */
+    if (file->unpinned >= WINDOW_COUNT) {
+        for (i = 0; i < file->count; i++) {
+            if (!file->windows[i].pinned && (!window || file->windows[i].used < window->used))
+                window = &file->windows[i];
+        }
+        munmap(window->data, window->length + IMAGE_SLACK);
+    } else {
+        if (file->count == file->capacity) {
+            file->capacity = file->capacity ? file->capacity * 2 : WINDOW_COUNT;
+            file->windows = realloc(file->windows, file->capacity * sizeof(*file->windows));
+        }
+        window = &file->windows[file->count++];
+        file->unpinned++;
+    }
+
+    window->data = data;
+    window->start = start;
+    window->length = length;
+    window->pinned = 0;
+    return window;
+}
+
+/* The slow path of the read functions: find (or map) a window holding len
+ * bytes at offset, or deal with an offset that isn't in the file at all. len
+ * may be no more than IMAGE_SLACK. */
+const byte *image_window(const struct image *image, off_t offset, size_t len, int pin)
+{
+    struct image_file *file = image->file;
+    struct window *window = NULL;
+    off_t start, end;
+    unsigned i;
+
+    if (!in_image(image, offset)) {
+        __atomic_store_n(&file->error, 1, __ATOMIC_RELAXED);
+        return zeroes;
+    }
+
+    end = offset + len;
+    if (end > image->size)
+        end = image->size;
+
+    for (i = 0; i < file->count; i++) {
+        struct window *w = &file->windows[i];
+
+        if (offset >= w->start && end <= w->start + (off_t)w->length) {
+            window = w;
+            break;
+        }
+    }
+
+    if (!window) {
+        /* Windows overlap by IMAGE_SLACK, so that anything that starts in
+         * one window can be read from it. */
+        start = offset & ~(off_t)(WINDOW_SIZE - 1);
+        if (end < start + WINDOW_SIZE + IMAGE_SLACK)
+            end = start + WINDOW_SIZE + IMAGE_SLACK;
+        if (end > image->size)
+            end = image->size;
+
+        if (!(window = map_window(file, start, end - start))) {
+            perror("Cannot map file");
+            return zeroes;
+        }
+    }
+
+    window->used = ++file->clock;
+    if (pin && !window->pinned) {
+        window->pinned = 1;
+        file->unpinned--;
+    }
+
+    return window->data + (offset - window->start);
+}
+
+/* Build a view of the file laid out by address rather than by offset, the way
+ * a loader would: each extent's bytes are placed at its address, and
+ * everything else up to size (and IMAGE_SLACK past it) reads as zeroes.
+ * Extents must not overlap. Those whose offset and address are both page
+ * aligned are mapped straight from the file, as far as they cover whole pages;
+ * the rest is copied. Returns NULL if the file isn't mapped whole, or if the
+ * view can't be made. */
+const byte *image_map_virtual(const struct image *image, const struct image_extent *extents,
+        unsigned count, dword size)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t total = (size_t)size + IMAGE_SLACK;
+    byte *view;
+    unsigned i;
+
+    if (!image->map)
+        return NULL;
+
+    view = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (view == MAP_FAILED)
+        return NULL;
+
+    for (i = 0; i < count; i++) {
+        const struct image_extent *e = &extents[i];
+        size_t len = min(e->length, size - min(e->address, size)), mapped = 0;
+
+        if (!len)
+            continue;
+        if (!in_image(image, e->offset) || len > (size_t)(image->size - e->offset)) {
+            /* the rest reads as zeroes, which is what we'd have said anyway */
+            __atomic_store_n(&image->file->error, 1, __ATOMIC_RELAXED);
+            if (!in_image(image, e->offset))
+                continue;
+            len = image->size - e->offset;
+        }
+
+        if (!(e->offset % page) && !(e->address % page) && len >= page) {
+            mapped = len & ~(page - 1);
+            if (mmap(view + e->address, mapped, PROT_READ, MAP_PRIVATE | MAP_FIXED,
+                    image->file->fd, e->offset) == MAP_FAILED) {
+                munmap(view, total);
+                return NULL;
+            }
+        }
+        memcpy(view + e->address + mapped, image->map + e->offset + mapped, len - mapped);
+    }
+
+    mprotect(view, total, PROT_READ);
+    return view;
+}
+
+void image_unmap_virtual(const byte *view, dword size)
+{
+    munmap((void *)view, (size_t)size + IMAGE_SLACK);
+}
@@ -0,0 +1,193 @@
+/*
+ * Compile specfiles into C source, to be built into dump
+ *
+ * Copyright 2017-2020 Zebediah Figura
+ *
+ * This file is part of Semblance.
+ *
+ * Semblance is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Semblance is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Semblance; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/* Usage: mkspecdb <srcdir> <specfile>... > specdb.c
+ *
+ * Each specfile is named after its module, e.g. spec/KERNEL.ORD. The output
+ * defines the tables declared in specfile.h: the modules sorted by name, each
+ * pointing to a run of its exports sorted by ordinal, whose names are offsets
+ * into one big string. Storing offsets rather than pointers means the tables
+ * need no relocation when the program is loaded. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "specfile.h"
+
+struct entry {
+    unsigned long ordinal;
+    char *name;     /* NULL if none given */
+    unsigned line;  /* for keeping the first of duplicate ordinals */
+};
+
+struct module {
+    char *name;
+    struct entry *entries;
+    unsigned count;
+};
+
+static unsigned long names_size;
+
+static int compare_modules(const void *a, const void *b)
+{
+    return strcmp(((const struct module *)a)->name, ((const struct module *)b)->name);
+}
+
+static int compare_entries(const void *a, const void *b)
+{
+    const struct entry *ea = a, *eb = b;
+
+    if (ea->ordinal != eb->ordinal)
+        return (ea->ordinal < eb->ordinal) ? -1 : 1;
+    return (ea->line < eb->line) ? -1 : 1;
+}
+
+/* Same rules as read_specfile() in specfile.c. */
+static void read_module(struct module *module, const char *srcdir, const char *path)
+{
+    const char *base = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+    unsigned capacity = 0, line_number = 0;
+    char filename[1024], line[300], *p;
+    unsigned long ordinal;
+    FILE *f;
+
+    snprintf(filename, sizeof(filename), "%s/%s", srcdir, path);
+    if (!(f = fopen(filename, "r"))) {
+        perror(filename);
+        exit(1);
+    }
+
+    module->name = strdup(base);
+    if ((p = strrchr(module->name, '.')))
+        *p = 0;
+    module->entries = NULL;
+    module->count = 0;
+
+    while (fgets(line, sizeof(line), f)) {
+        line_number++;
+        if (line[0] == '#' || line[0] == '\n') continue;
+        if ((p = strchr(line, '\n'))) *p = 0;
+
+        ordinal = strtoul(line, &p, 10);
+        if (p == line || ordinal > 0xffff) {
+            fprintf(stderr, "%s:%u: bad line `%s'\n", filename, line_number, line);
+            exit(1);
+        }
+
+        if (module->count == capacity) {
+            capacity = capacity ? capacity * 2 : 256;
+            module->entries = realloc(module->entries, capacity * sizeof(*module->entries));
+        }
+        module->entries[module->count].ordinal = ordinal;
+        module->entries[module->count].name = (p = strchr(line, '\t')) ? strdup(p + 1) : NULL;
+        module->entries[module->count].line = line_number;
+        module->count++;
+    }
+    fclose(f);
+
+    /* entries is NULL for an empty spec file */
+    if (module->count)
+        qsort(module->entries, module->count, sizeof(*module->entries), compare_entries);
+}
+
+/* Print name as part of a C string literal. ? is escaped so that no trigraphs
+ * can form, and anything unprintable is given as a three-digit octal escape,
+ * which can't run into the characters after it. */
+static unsigned long print_name(const char *name)
+{
+    unsigned long offset = names_size;
+    const unsigned char *p;
+
+    printf("    \"");
+    for (p = (const unsigned char *)name; *p; p++) {
+        if (*p == '"' || *p == '\\' || *p == '?')
+            printf("\\%c", *p);
+        else if (*p < 0x20 || *p >= 0x7f)
+            printf("\\%03o", *p);
+        else
+            putchar(*p);
+    }
+    printf("\\0\"\n");
+    names_size += strlen(name) + 1;
+    return offset;
+}
+
+int main(int argc, char **argv)
+{
+    struct module *modules;
+    unsigned long *module_names, **entry_names;
+    unsigned count = argc - 2, total = 0, i, j;
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: mkspecdb <srcdir> <specfile>...\n");
+        return 1;
+    }
+
+    modules = malloc(count * sizeof(*modules));
+    for (i = 0; i < count; i++)
+        read_module(&modules[i], argv[1], argv[i + 2]);
+    if (count)
+        qsort(modules, count, sizeof(*modules), compare_modules);
+
+    printf("/* Generated by mkspecdb from spec/; do not edit. */\n\n");
+    printf("#include \"specfile.h\"\n\n");
+
+    /* One string holding every name, each terminated with a null. */
+    module_names = malloc(count * sizeof(*module_names));
+    entry_names = malloc(count * sizeof(*entry_names));
+    printf("const char specdb_names[] =\n");
+    for (i = 0; i < count; i++) {
+        module_names[i] = print_name(modules[i].name);
+        entry_names[i] = malloc(modules[i].count * sizeof(**entry_names));
+        for (j = 0; j < modules[i].count; j++) {
+            if (j && modules[i].entries[j].ordinal == modules[i].entries[j - 1].ordinal)
+                continue;
+            entry_names[i][j] = modules[i].entries[j].name ? print_name(modules[i].entries[j].name) : SPECDB_NO_NAME;
+        }
+    }
+    printf("    \"\";\n\n");
+
+    printf("const struct specdb_export specdb_exports[] = {\n");
+    for (i = 0; i < count; i++) {
+        unsigned first = total;
+
+        for (j = 0; j < modules[i].count; j++) {
+            if (j && modules[i].entries[j].ordinal == modules[i].entries[j - 1].ordinal)
+                continue;
+            printf("    {%lu, %#lx},\n", modules[i].entries[j].ordinal, entry_names[i][j]);
+            total++;
+        }
+        modules[i].count = total - first;
+    }
+    printf("};\n\n");
+
+    printf("const struct specdb_module specdb_modules[] = {\n");
+    for (i = 0, total = 0; i < count; i++) {
+        printf("    {%#lx, %u, %u},\n", module_names[i], total, modules[i].count);
+        total += modules[i].count;
+    }
+    printf("};\n\n");
+
+    printf("const unsigned specdb_module_count = %u;\n", count);
+    return 0;
+}
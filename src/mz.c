@@ -26,37 +26,40 @@
 #include "semblance.h"
 #include "x86_instr.h"
 #include "mz.h"
+#include "scan.h"
 
 #pragma pack(1)
 
-static void print_header(const struct header_mz *header) {
-    putchar('\n');
-    printf("Minimum extra allocation: %d bytes\n", header->e_minalloc * 16); /* 0a */
-    printf("Maximum extra allocation: %d bytes\n", header->e_maxalloc * 16); /* 0c */
-    printf("Initial stack location: %#x\n", realaddr(header->e_ss, header->e_sp)); /* 0e */
-    printf("Program entry point: %#x\n", realaddr(header->e_cs, header->e_ip)); /* 14 */
-    printf("Overlay number: %d\n", header->e_ovno); /* 1a */
+static void print_header(const struct header_mz *header, const struct image *image) {
+    out_putc(image->out, '\n');
+    out_printf(image->out, "Minimum extra allocation: %d bytes\n", header->e_minalloc * 16); /* 0a */
+    out_printf(image->out, "Maximum extra allocation: %d bytes\n", header->e_maxalloc * 16); /* 0c */
+    out_printf(image->out, "Initial stack location: %#x\n", realaddr(header->e_ss, header->e_sp)); /* 0e */
+    out_printf(image->out, "Program entry point: %#x\n", realaddr(header->e_cs, header->e_ip)); /* 14 */
+    out_printf(image->out, "Overlay number: %d\n", header->e_ovno); /* 1a */
 }
 
 #ifdef USE_WARN
 #define warn_at(...) \
-    do { fprintf(stderr, "Warning: %05x: ", ip); \
-        fprintf(stderr, __VA_ARGS__); } while(0)
+    do { warn_printf("Warning: %05x: ", ip); \
+        warn_printf(__VA_ARGS__); } while(0)
 #else
 #define warn_at(...)
 #endif
 
-static int print_mz_instr(dword ip, const byte *p, const byte *flags) {
+static int print_mz_instr(dword ip, const byte *p, const struct mz *mz) {
     struct instr instr = {0};
+    struct instr_text text = {0};
     unsigned len;
 
     char ip_string[7];
 
-    len = get_instr(ip, p, &instr, 16);
+    if (!(len = decode_cache_find(&mz->decoded, ip, &instr)))
+        len = get_instr(ip, p, &instr, 16);
 
     sprintf(ip_string, "%05x", ip);
 
-    print_instr(ip_string, p, len, flags[ip], &instr, NULL, 16);
+    print_instr(mz->image->out, ip_string, p, len, get_instr_flags(mz->flags, ip), &instr, &text, NULL, 16);
 
     return len;
 }
@@ -65,22 +68,22 @@ static void print_code(struct mz *mz) {
     dword ip = 0;
     byte buffer[MAX_INSTR];
 
-    putchar('\n');
-    printf("Code (start = 0x%x, length = 0x%x):\n", mz->start, mz->length);
+    out_putc(mz->image->out, '\n');
+    out_printf(mz->image->out, "Code (start = 0x%x, length = 0x%x):\n", mz->start, mz->length);
 
     while (ip < mz->length) {
         /* find a valid instruction */
-        if (!(mz->flags[ip] & INSTR_VALID)) {
+        if (!has_instr_flag(mz->flags, ip, INSTR_VALID)) {
             if (opts & DISASSEMBLE_ALL) {
                 /* still skip zeroes */
-                if (read_byte(mz->start + ip) == 0) {
-                    printf("      ...\n");
+                if (read_byte(mz->image, mz->start + ip) == 0) {
+                    out_printf(mz->image->out, "      ...\n");
                     ip++;
-                    while (read_byte(mz->start + ip) == 0) ip++;
+                    while (ip < mz->length && read_byte(mz->image, mz->start + ip) == 0) ip++;
                 }
             } else {
-                printf("     ...\n");
-                while ((ip < mz->length) && !(mz->flags[ip] & INSTR_VALID)) ip++;
+                out_printf(mz->image->out, "     ...\n");
+                ip = find_instr_flag(mz->flags, ip, mz->length, INSTR_VALID);
             }
         }
 
@@ -91,43 +94,54 @@ static void print_code(struct mz *mz) {
          * unabashedly mix code and data, so we need to figure out a solution
          * for that. but we needed to do that anyway. */
 
-        memcpy(buffer, read_data(mz->start + ip), min(sizeof(buffer), mz->length - ip));
+        memcpy(buffer, read_bytes(mz->image, mz->start + ip, sizeof(buffer)), min(sizeof(buffer), mz->length - ip));
 
-        if (mz->flags[ip] & INSTR_FUNC) {
-            printf("\n");
-            printf("%05x <no name>:\n", ip);
+        if (has_instr_flag(mz->flags, ip, INSTR_FUNC)) {
+            out_printf(mz->image->out, "\n");
+            out_printf(mz->image->out, "%05x <no name>:\n", ip);
         }
 
-        ip += print_mz_instr(ip, buffer, mz->flags);
+        ip += print_mz_instr(ip, buffer, mz);
     }
 }
 
-static void scan_segment(dword ip, struct mz *mz) {
+/* Scan one run of code, queueing the targets of any branches we find. */
+static void scan_run(const struct scan_item *item, struct worklist *wl, void *ctx) {
+    struct mz *mz = ctx;
+    dword ip = item->ip;
     byte buffer[MAX_INSTR];
     struct instr instr;
+    struct scan_item target;
     int instr_length;
     int i;
 
-    if (ip > mz->length) {
-        warn_at("Attempt to scan past end of segment.\n");
-        return;
-    }
+    if (!item->resume) {
+        if (ip > mz->length) {
+            warn_at("Attempt to scan past end of segment.\n");
+            return;
+        }
 
-    if ((mz->flags[ip] & (INSTR_VALID|INSTR_SCANNED)) == INSTR_SCANNED)
-        warn_at("Attempt to scan byte that does not begin instruction.\n");
+        if (ip < mz->length && (get_instr_flags(mz->flags, ip) & (INSTR_VALID|INSTR_SCANNED)) == INSTR_SCANNED)
+            warn_at("Attempt to scan byte that does not begin instruction.\n");
+    }
 
     while (ip < mz->length) {
+        unsigned count = 0;
+
         /* check if we already read from here */
-        if (mz->flags[ip] & INSTR_SCANNED) return;
+        if (has_instr_flag(mz->flags, ip, INSTR_SCANNED)) return;
 
         /* read the instruction */
         memset(buffer, 0, sizeof(buffer));  // fixme
-        memcpy(buffer, read_data(mz->start + ip), min(sizeof(buffer), mz->length - ip));
+        memcpy(buffer, read_bytes(mz->image, mz->start + ip, sizeof(buffer)), min(sizeof(buffer), mz->length - ip));
         instr_length = get_instr(ip, buffer, &instr, 16);
+        if (mode & DISASSEMBLE)
+            decode_cache_add(&mz->decoded, ip, &instr, instr_length);
 
         /* mark the bytes */
-        mz->flags[ip] |= INSTR_VALID;
-        for (i = ip; i < ip+instr_length && i < mz->length; i++) mz->flags[i] |= INSTR_SCANNED;
+        set_instr_flags(mz->flags, ip, INSTR_VALID);
+        i = (ip < mz->length) ? min(ip + instr_length, mz->length) : ip;
+        set_instr_flag_range(mz->flags, ip, i, INSTR_SCANNED);
 
         /* instruction which hangs over the minimum allocation */
         if (i < ip+instr_length && i == mz->length) break;
@@ -135,16 +149,21 @@ static void scan_segment(dword ip, struct mz *mz) {
         /* handle conditional and unconditional jumps */
         if (instr.op.flags & OP_BRANCH) {
             /* near relative jump, loop, or call */
-            if (!strcmp(instr.op.name, "call"))
-                mz->flags[instr.args[0].value] |= INSTR_FUNC;
-            else
-                mz->flags[instr.args[0].value] |= INSTR_JUMP;
+            if (instr.args[0].value < mz->length)
+            {
+                if (!strcmp(instr.op.name, "call"))
+                    set_instr_flags(mz->flags, instr.args[0].value, INSTR_FUNC);
+                else
+                    set_instr_flags(mz->flags, instr.args[0].value, INSTR_JUMP);
+            }
 
             /* scan it */
-            scan_segment(instr.args[0].value, mz);
+            target.cs = 0;
+            target.ip = instr.args[0].value;
+            count = 1;
         }
 
-        if (instr.op.flags & OP_STOP)
+        if (worklist_branch(wl, &target, count, 0, ip + instr_length, instr.op.flags & OP_STOP))
             return;
 
         ip += instr_length;
@@ -154,23 +173,31 @@ static void scan_segment(dword ip, struct mz *mz) {
 }
 
 static void read_code(struct mz *mz) {
+    struct worklist wl;
 
     mz->entry_point = realaddr(mz->header->e_cs, mz->header->e_ip);
     mz->length = ((mz->header->e_cp - 1) * 512) + mz->header->e_cblp;
     if (mz->header->e_cblp == 0) mz->length += 512;
-    mz->flags = calloc(mz->length, sizeof(byte));
+    mz->flags = alloc_instr_flags(mz->length);
+    decode_cache_init(&mz->decoded, 0, mz->length);
 
-    if (mz->entry_point > mz->length)
+    if (mz->entry_point >= mz->length)
         warn("Entry point %05x exceeds segment length (%05x)\n", mz->entry_point, mz->length);
-    mz->flags[mz->entry_point] |= INSTR_FUNC;
-    scan_segment(mz->entry_point, mz);
+    else
+        set_instr_flags(mz->flags, mz->entry_point, INSTR_FUNC);
+
+    worklist_init(&wl, SCAN_LIFO);
+    worklist_push(&wl, 0, mz->entry_point);
+    scan_worklist(&wl, scan_run, mz);
+    worklist_free(&wl);
+    decode_cache_finish(&mz->decoded);
 }
 
 void readmz(struct mz *mz) {
-    mz->header = read_data(0);
+    mz->header = read_data(mz->image, 0);
 
     /* read the relocation table */
-    mz->reltab = read_data(mz->header->e_lfarlc);
+    mz->reltab = read_data(mz->image, mz->header->e_lfarlc);
 
     /* read the code */
     mz->start = mz->header->e_cparhdr * 16;
@@ -179,17 +206,19 @@ void readmz(struct mz *mz) {
 
 void freemz(struct mz *mz) {
     free(mz->flags);
+    decode_cache_free(&mz->decoded);
 }
 
-void dumpmz(void) {
+void dumpmz(const struct image *image) {
     struct mz mz;
 
+    mz.image = image;
     readmz(&mz);
 
-    printf("Module type: MZ (DOS executable)\n");
+    out_printf(image->out, "Module type: MZ (DOS executable)\n");
 
     if (mode & DUMPHEADER)
-        print_header(mz.header);
+        print_header(mz.header, image);
 
     if (mode & DISASSEMBLE)
         print_code(&mz);
@@ -2,6 +2,7 @@
 #define __MZ_H
 
 #include "semblance.h"
+#include "scan.h"
 
 /* MZ (aka real-mode) addresses are "segmented", but not really. Just
  * use the actual value. */
@@ -42,14 +43,15 @@ struct reloc {
 };
 
 struct mz {
-    /* fixme: file pointer here */
+    const struct image *image;
 
     const struct header_mz *header;
     const struct reloc *reltab;
 
     /* code */
     dword entry_point;
-    byte *flags;
+    qword *flags;           /* see scan.h */
+    struct decode_cache decoded;
     dword start;
     dword length;
 };
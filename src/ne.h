@@ -2,6 +2,8 @@
 #define __NE_H
 
 #include "semblance.h"
+#include "scan.h"
+#include "specfile.h"
 
 #pragma pack(1)
 
@@ -53,15 +55,9 @@ struct entry {
     char *name;     /* may be NULL */
 };
 
-struct export {
-    word ordinal;
-    char *name;
-};
-
 struct import_module {
     char *name;
-    struct export *exports;
-    unsigned export_count;
+    const struct specfile *spec;    /* NULL if not loaded or not found */
 };
 
 struct reloc {
@@ -80,13 +76,15 @@ struct segment {
     word length;
     word flags;
     word min_alloc;
-    byte *instr_flags;
+    qword *instr_flags;     /* see scan.h */
     struct reloc *reloc_table;
     word reloc_count;
+    word *reloc_map;    /* offset -> index into reloc_table + 1, or 0 */
+    struct decode_cache decoded;
 };
 
 struct ne {
-    /* fixme: file pointer here */
+    const struct image *image;
 
     struct header_ne header;
 
@@ -97,16 +95,19 @@ struct ne {
 
     struct entry *enttab;
     unsigned entcount;
+    struct entry **entindex;    /* enttab sorted by segment:offset */
 
     struct import_module *imptab;
 
     struct segment *segments;
 };
 
+/* in ne_header.c */
+extern char *demangle(char *func);
 /* in ne_resource.c */
-extern void print_rsrc(off_t start);
+extern void print_rsrc(off_t start, const struct image *image);
 /* in ne_segment.c */
-extern void read_segments(off_t start, struct ne *ne);
+extern int read_segments(off_t start, struct ne *ne);
 extern void free_segments(struct ne *ne);
 extern void print_segments(struct ne *ne);
 
@@ -28,7 +28,7 @@
 #include "semblance.h"
 #include "ne.h"
 
-static void print_flags(word flags){
+static void print_flags(word flags, struct output *out){
     char buffer[1024];
     
     if      ((flags & 0x0003) == 0) strcpy(buffer, "no DGROUP");
@@ -52,10 +52,10 @@ static void print_flags(word flags){
     if (flags & 0x4000) strcat(buffer, ", non-conforming program");
     if (flags & 0x8000) strcat(buffer, ", library");
     
-    printf("Flags: 0x%04x (%s)\n", flags, buffer);
+    out_printf(out, "Flags: 0x%04x (%s)\n", flags, buffer);
 }
 
-static void print_os2flags(word flags){
+static void print_os2flags(word flags, struct output *out){
     char buffer[1024];
 
     buffer[0] = 0;
@@ -67,9 +67,9 @@ static void print_os2flags(word flags){
         sprintf(buffer+strlen(buffer), ", (unknown flags 0x%04x)", flags & 0xfff0);
 
     if(buffer[0])
-        printf("OS/2 flags: 0x%04x (%s)\n", flags, buffer+2);
+        out_printf(out, "OS/2 flags: 0x%04x (%s)\n", flags, buffer+2);
     else
-        printf("OS/2 flags: 0x0000\n");
+        out_printf(out, "OS/2 flags: 0x0000\n");
 }
 
 static const char *const exetypes[] = {
@@ -82,7 +82,7 @@ static const char *const exetypes[] = {
     0
 };
 
-static void print_header(struct header_ne *header){
+static void print_header(struct header_ne *header, struct output *out){
     /* Still need to deal with:
      *
      * 34 - number of resource segments (all of my testcases return 0)
@@ -90,24 +90,24 @@ static void print_header(struct header_ne *header){
      * 3a - offset to segment ref. bytes (same)
      */
 
-    putchar('\n');
-    printf("Linker version: %d.%d\n", header->ne_ver, header->ne_rev); /* 02 */
-    printf("Checksum: %08x\n", header->ne_crc); /* 08 */
-    print_flags(header->ne_flags); /* 0c */
-    printf("Automatic data segment: %d\n", header->ne_autodata);
+    out_putc(out, '\n');
+    out_printf(out, "Linker version: %d.%d\n", header->ne_ver, header->ne_rev); /* 02 */
+    out_printf(out, "Checksum: %08x\n", header->ne_crc); /* 08 */
+    print_flags(header->ne_flags, out); /* 0c */
+    out_printf(out, "Automatic data segment: %d\n", header->ne_autodata);
     if (header->ne_unused != 0)
         warn("Header byte at position 0f has value 0x%02x.\n", header->ne_unused);
-    printf("Heap size: %d bytes\n", header->ne_heap); /* 10 */
-    printf("Stack size: %d bytes\n", header->ne_stack); /* 12 */
-    printf("Program entry point: %d:%04x\n", header->ne_cs, header->ne_ip); /* 14 */
-    printf("Initial stack location: %d:%04x\n", header->ne_ss, header->ne_sp); /* 18 */
+    out_printf(out, "Heap size: %d bytes\n", header->ne_heap); /* 10 */
+    out_printf(out, "Stack size: %d bytes\n", header->ne_stack); /* 12 */
+    out_printf(out, "Program entry point: %d:%04x\n", header->ne_cs, header->ne_ip); /* 14 */
+    out_printf(out, "Initial stack location: %d:%04x\n", header->ne_ss, header->ne_sp); /* 18 */
     if (header->ne_exetyp <= 5) /* 36 */
-        printf("Target OS: %s\n", exetypes[header->ne_exetyp]);
+        out_printf(out, "Target OS: %s\n", exetypes[header->ne_exetyp]);
     else
-        printf("Target OS: (unknown value %d)\n", header->ne_exetyp);
-    print_os2flags(header->ne_flagsothers); /* 37 */
-    printf("Swap area: %d\n", header->ne_swaparea); /* 3c */
-    printf("Expected Windows version: %d.%d\n", /* 3e */
+        out_printf(out, "Target OS: (unknown value %d)\n", header->ne_exetyp);
+    print_os2flags(header->ne_flagsothers, out); /* 37 */
+    out_printf(out, "Swap area: %d\n", header->ne_swaparea); /* 3c */
+    out_printf(out, "Expected Windows version: %d.%d\n", /* 3e */
            header->ne_expver_maj, header->ne_expver_min);
 }
 
@@ -117,11 +117,11 @@ static void print_export(struct ne *ne) {
     for (i = 0; i < ne->entcount; i++)
         if (ne->enttab[i].segment == 0xfe)
             /* absolute value */
-            printf("\t%5d\t   %04x\t%s\n", i+1, ne->enttab[i].offset, ne->enttab[i].name ? ne->enttab[i].name : "<no name>");
+            out_printf(ne->image->out, "\t%5d\t   %04x\t%s\n", i+1, ne->enttab[i].offset, ne->enttab[i].name ? ne->enttab[i].name : "<no name>");
         else if (ne->enttab[i].segment)
-            printf("\t%5d\t%2d:%04x\t%s\n", i+1, ne->enttab[i].segment,
+            out_printf(ne->image->out, "\t%5d\t%2d:%04x\t%s\n", i+1, ne->enttab[i].segment,
                 ne->enttab[i].offset, ne->enttab[i].name ? ne->enttab[i].name : "<no name>");
-    putchar('\n');
+    out_putc(ne->image->out, '\n');
 }
 
 static void print_specfile(struct ne *ne) {
@@ -277,7 +277,7 @@ static int demangle_type(char **known_names, char *buffer, char *type) {
 /* Demangle a C++ function name. The scheme used seems to be mostly older
  * than any documented, but I was able to find documentation that is at
  * least close in Agner Fog's manual. */
-static char *demangle(char *func) {
+char *demangle(char *func) {
     char *known_types[10] = {}, *known_names[10] = {};
     unsigned int known_type_idx = 0, known_name_idx = 0;
     char buffer[1024];
@@ -377,32 +377,42 @@ static char *demangle(char *func) {
 }
 
 /* return the first entry (module name/desc) */
-static char *read_res_name_table(off_t start, struct entry *entry_table)
+static char *read_res_name_table(off_t start, struct ne *ne)
 {
     /* reads (non)resident names into our entry table */
+    const struct image *image = ne->image;
     off_t cursor = start;
+    word ordinal;
     byte length;
     char *first;
     char *name;
 
-    length = read_byte(cursor++);
+    length = read_byte(image, cursor++);
     first = malloc((length+1)*sizeof(char));
-    memcpy(first, read_data(cursor), length);
+    memcpy(first, read_data(image, cursor), length);
     first[length] = 0;
     cursor += length + 2;
 
-    while ((length = read_byte(cursor++)))
+    while ((length = read_byte(image, cursor++)))
     {
         name = malloc((length+1)*sizeof(char));
-        memcpy(name, read_data(cursor), length);
+        memcpy(name, read_data(image, cursor), length);
         name[length] = 0;
         cursor += length;
 
         if ((opts & DEMANGLE) && name[0] == '?')
             name = demangle(name);
 
-        entry_table[read_word(cursor) - 1].name = name;
+        ordinal = read_word(image, cursor);
         cursor += 2;
+        if (!ordinal || ordinal > ne->entcount) {
+            warn("Name %s has ordinal %d, but there are only %d entries.\n",
+                 name, ordinal, ne->entcount);
+            free(name);
+            continue;
+        }
+        free(ne->enttab[ordinal-1].name);
+        ne->enttab[ordinal-1].name = name;
     }
 
     return first;
@@ -418,9 +428,9 @@ static void get_entry_table(off_t start, struct ne *ne)
 
     /* get a count */
     cursor = start;
-    while ((length = read_byte(cursor++)))
+    while ((length = read_byte(ne->image, cursor++)))
     {
-        index = read_byte(cursor++);
+        index = read_byte(ne->image, cursor++);
         count += length;
         if (index != 0)
             cursor += (index == 0xff ? 6 : 3) * length;
@@ -429,24 +439,24 @@ static void get_entry_table(off_t start, struct ne *ne)
 
     count = 0;
     cursor = start;
-    while ((length = read_byte(cursor++)))
+    while ((length = read_byte(ne->image, cursor++)))
     {
-        index = read_byte(cursor++);
+        index = read_byte(ne->image, cursor++);
         for (i = 0; i < length; ++i)
         {
             if (index == 0xff) {
-                ne->enttab[count].flags = read_byte(cursor);
-                if ((w = read_word(cursor + 1)) != 0x3fcd)
+                ne->enttab[count].flags = read_byte(ne->image, cursor);
+                if ((w = read_word(ne->image, cursor + 1)) != 0x3fcd)
                     warn("Entry %d has interrupt bytes %02x %02x (expected 3f cd).\n", count+1, w & 0xff, w >> 16);
-                ne->enttab[count].segment = read_byte(cursor + 3);
-                ne->enttab[count].offset = read_word(cursor + 4);
+                ne->enttab[count].segment = read_byte(ne->image, cursor + 3);
+                ne->enttab[count].offset = read_word(ne->image, cursor + 4);
                 cursor += 6;
             } else if (index == 0x00) {
                 /* no entries, just here to skip ordinals */
             } else {
-                ne->enttab[count].flags = read_byte(cursor);
+                ne->enttab[count].flags = read_byte(ne->image, cursor);
                 ne->enttab[count].segment = index;
-                ne->enttab[count].offset = read_word(cursor + 1);
+                ne->enttab[count].offset = read_word(ne->image, cursor + 1);
                 cursor += 3;
             }
             count++;
@@ -456,63 +466,29 @@ static void get_entry_table(off_t start, struct ne *ne)
     ne->entcount = count;
 }
 
-static void load_exports(struct import_module *module) {
-    FILE *specfile;
-    char spec_name[18];
-    char line[300], *p;
-    int count;
-    word ordinal;
-
-    sprintf(spec_name, "%.8s.ORD", module->name);
-    specfile = fopen(spec_name, "r");
-    if (!specfile) {
-        sprintf(spec_name, "spec/%.8s.ORD", module->name);
-        specfile = fopen(spec_name, "r");
-        if (!specfile) {
-            fprintf(stderr, "Note: couldn't find specfile for module %s; exported names won't be given.\n", module->name);
-            fprintf(stderr, "      To create a specfile, run `dumpne -o <module.dll>'.\n");
-            module->exports = NULL;
-            module->export_count = 0;
-            return;
-        }
-    }
-
-    /* first grab a count */
-    count = 0;
-    while (fgets(line, sizeof(line), specfile)) {
-        if (line[0] == '#' || line[0] == '\n') continue;
-        count++;
-    }
-
-    module->exports = malloc(count * sizeof(struct export));
-
-    fseek(specfile, 0, SEEK_SET);
-    count = 0;
-    while (fgets(line, sizeof(line), specfile)) {
-        if (line[0] == '#' || line[0] == '\n') continue;
-        if ((p = strchr(line, '\n'))) *p = 0;   /* kill final newline */
-        if (sscanf(line, "%hu", &ordinal) != 1) {
-            fprintf(stderr, "Error reading specfile near line: `%s'\n", line);
-            continue;
-        }
-        module->exports[count].ordinal = ordinal;
-
-        p = strchr(line, '\t');
-        if (p) {
-            p++;
-            module->exports[count].name = strdup(p);
-    
-            if ((opts & DEMANGLE) && module->exports[count].name[0] == '?')
-                module->exports[count].name = demangle(module->exports[count].name);
-        } else {
-            module->exports[count].name = NULL;
-        }
-        count++;
-    }
+static int compare_entries(const void *a, const void *b)
+{
+    const struct entry *ea = *(const struct entry **)a;
+    const struct entry *eb = *(const struct entry **)b;
+
+    if (ea->segment != eb->segment)
+        return (ea->segment < eb->segment) ? -1 : 1;
+    if (ea->offset != eb->offset)
+        return (ea->offset < eb->offset) ? -1 : 1;
+    /* keep entries at the same address in ordinal order */
+    return (ea < eb) ? -1 : (ea > eb);
+}
 
-    module->export_count = count;
+/* Sort the entry table by address, so that get_entry_name() can do a binary
+ * search instead of scanning every entry. */
+static void build_entry_index(struct ne *ne)
+{
+    unsigned i;
 
-    fclose(specfile);
+    ne->entindex = malloc(ne->entcount * sizeof(*ne->entindex));
+    for (i = 0; i < ne->entcount; i++)
+        ne->entindex[i] = &ne->enttab[i];
+    qsort(ne->entindex, ne->entcount, sizeof(*ne->entindex), compare_entries);
 }
 
 static void get_import_module_table(off_t start, struct ne *ne)
@@ -523,38 +499,37 @@ static void get_import_module_table(off_t start, struct ne *ne)
 
     ne->imptab = malloc(ne->header.ne_cmod * sizeof(struct import_module));
     for (i = 0; i < ne->header.ne_cmod; i++) {
-        offset = read_word(start + i * 2);
+        offset = read_word(ne->image, start + i * 2);
         length = ne->nametab[offset];
         ne->imptab[i].name = malloc((length+1)*sizeof(char));
         memcpy(ne->imptab[i].name, &ne->nametab[offset+1], length);
         ne->imptab[i].name[length] = 0;
 
         if (mode & DISASSEMBLE)
-            load_exports(&ne->imptab[i]);
-        else {
-            ne->imptab[i].exports = NULL;
-            ne->imptab[i].export_count = 0;
-        }
+            ne->imptab[i].spec = get_specfile(ne->imptab[i].name);
+        else
+            ne->imptab[i].spec = NULL;
     }
 }
 
-static void readne(off_t offset_ne, struct ne *ne) {
-    memcpy(&ne->header, read_data(offset_ne), sizeof(ne->header));
+static int readne(off_t offset_ne, struct ne *ne) {
+    memcpy(&ne->header, read_data(ne->image, offset_ne), sizeof(ne->header));
 
     /* read our various tables */
     get_entry_table(offset_ne + ne->header.ne_enttab, ne);
-    ne->name = read_res_name_table(offset_ne + ne->header.ne_restab, ne->enttab);
+    build_entry_index(ne);
+    ne->name = read_res_name_table(offset_ne + ne->header.ne_restab, ne);
     if (ne->header.ne_nrestab)
-        ne->description = read_res_name_table(ne->header.ne_nrestab, ne->enttab);
+        ne->description = read_res_name_table(ne->header.ne_nrestab, ne);
     else
         ne->description = NULL;
-    ne->nametab = read_data(offset_ne + ne->header.ne_imptab);
+    ne->nametab = read_data(ne->image, offset_ne + ne->header.ne_imptab);
     get_import_module_table(offset_ne + ne->header.ne_modtab, ne);
-    read_segments(offset_ne + ne->header.ne_segtab, ne);
+    return read_segments(offset_ne + ne->header.ne_segtab, ne);
 }
 
 static void freene(struct ne *ne) {
-    int i, j;
+    int i;
 
     free(ne->name);
     free(ne->description);
@@ -565,26 +540,27 @@ static void freene(struct ne *ne) {
             free(ne->enttab[i].name);
         free(ne->enttab);
     }
+    free(ne->entindex);
 
     /* free the import module table */
     if (ne->imptab) {
-        for (i = 0; i < ne->header.ne_cmod; i++) {
+        for (i = 0; i < ne->header.ne_cmod; i++)
             free(ne->imptab[i].name);
-            for (j = 0; j < ne->imptab[i].export_count; j++)
-                free(ne->imptab[i].exports[j].name);
-            free(ne->imptab[i].exports);
-        }
         free(ne->imptab);
     }
 
     free_segments(ne);
 }
 
-void dumpne(off_t offset_ne) {
+void dumpne(const struct image *image, off_t offset_ne) {
     struct ne ne;
     int i;
 
-    readne(offset_ne, &ne);
+    ne.image = image;
+    if (readne(offset_ne, &ne) < 0) {
+        freene(&ne);
+        return;
+    }
 
     if (mode == SPECFILE) {
         print_specfile(&ne);
@@ -592,25 +568,25 @@ void dumpne(off_t offset_ne) {
         return;
     }
 
-    printf("Module type: NE (New Executable)\n");
-    printf("Module name: %s\n", ne.name);
+    out_printf(image->out, "Module type: NE (New Executable)\n");
+    out_printf(image->out, "Module name: %s\n", ne.name);
     if (ne.description)
-        printf("Module description: %s\n", ne.description);
+        out_printf(image->out, "Module description: %s\n", ne.description);
 
     if (mode & DUMPHEADER)
-        print_header(&ne.header);
+        print_header(&ne.header, image->out);
 
     if (mode & DUMPEXPORT) {
-        putchar('\n');
-        printf("Exports:\n");
+        out_putc(image->out, '\n');
+        out_printf(image->out, "Exports:\n");
         print_export(&ne);
     }
 
     if (mode & DUMPIMPORT) {
-        putchar('\n');
-        printf("Imported modules:\n");
+        out_putc(image->out, '\n');
+        out_printf(image->out, "Imported modules:\n");
         for (i = 0; i < ne.header.ne_cmod; i++)
-            printf("\t%s\n", ne.imptab[i].name);
+            out_printf(image->out, "\t%s\n", ne.imptab[i].name);
     }
 
     if (mode & DISASSEMBLE)
@@ -618,9 +594,9 @@ void dumpne(off_t offset_ne) {
 
     if (mode & DUMPRSRC){
         if (ne.header.ne_rsrctab != ne.header.ne_restab)
-            print_rsrc(offset_ne + ne.header.ne_rsrctab);
+            print_rsrc(offset_ne + ne.header.ne_rsrctab, image);
         else
-            printf("No resource table\n");
+            out_printf(image->out, "No resource table\n");
     }
 
     freene(&ne);
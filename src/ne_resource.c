@@ -46,60 +46,60 @@ struct header_bitmap_info {
 
 STATIC_ASSERT(sizeof(struct header_bitmap_info) == 0x28);
 
-static char *dup_string_resource(off_t offset)
+static char *dup_string_resource(off_t offset, const struct image *image)
 {
-    byte length = read_byte(offset);
+    byte length = read_byte(image, offset);
     char *ret = malloc(length + 1);
-    memcpy(ret, read_data(offset + 1), length);
+    memcpy(ret, read_data(image, offset + 1), length);
     ret[length] = 0;
     return ret;
 }
 
 /* length-indexed; returns  */
-static void print_escaped_string(off_t offset, long length){
-    putchar('"');
+static void print_escaped_string(off_t offset, long length, const struct image *image){
+    out_putc(image->out, '"');
     while (length--){
-        char c = read_byte(offset++);
+        char c = read_byte(image, offset++);
         if (c == '\t')
-            printf("\\t");
+            out_printf(image->out, "\\t");
         else if (c == '\n')
-            printf("\\n");
+            out_printf(image->out, "\\n");
         else if (c == '\r')
-            printf("\\r");
+            out_printf(image->out, "\\r");
         else if (c == '"')
-            printf("\\\"");
+            out_printf(image->out, "\\\"");
         else if (c == '\\')
-            printf("\\\\");
+            out_printf(image->out, "\\\\");
         else if (c >= ' ' && c <= '~')
-            putchar(c);
+            out_putc(image->out, c);
         else
-            printf("\\x%02hhx", c);
+            out_printf(image->out, "\\x%02hhx", c);
     }
-    putchar('"');
+    out_putc(image->out, '"');
 }
 
 /* null-terminated; returns the end of the string */
-static off_t print_escaped_string0(off_t offset)
+static off_t print_escaped_string0(off_t offset, const struct image *image)
 {
     char c;
-    putchar('"');
-    while ((c = read_byte(offset++))){
+    out_putc(image->out, '"');
+    while ((c = read_byte(image, offset++))){
         if (c == '\t')
-            printf("\\t");
+            out_printf(image->out, "\\t");
         else if (c == '\n')
-            printf("\\n");
+            out_printf(image->out, "\\n");
         else if (c == '\r')
-            printf("\\r");
+            out_printf(image->out, "\\r");
         else if (c == '"')
-            printf("\\\"");
+            out_printf(image->out, "\\\"");
         else if (c == '\\')
-            printf("\\\\");
+            out_printf(image->out, "\\\\");
         else if (c >= ' ' && c <= '~')
-            putchar(c);
+            out_putc(image->out, c);
         else
-            printf("\\x%02hhx", c);
+            out_printf(image->out, "\\x%02hhx", c);
     }
-    putchar('"');
+    out_putc(image->out, '"');
     return offset;
 }
 
@@ -148,15 +148,15 @@ static const char *const rsrc_bmp_compression[] = {
     0
 };
 
-static void print_rsrc_flags(word flags){
+static void print_rsrc_flags(word flags, struct output *out){
     if (flags & 0x0010)
-        printf(", moveable");
+        out_printf(out, ", moveable");
     if (flags & 0x0020)
-        printf(", shareable");
+        out_printf(out, ", shareable");
     if (flags & 0x0040)
-        printf(", preloaded");
+        out_printf(out, ", preloaded");
     if (flags & 0xff8f)
-        printf(", (unknown flags 0x%04x)", flags & 0xff8f);
+        out_printf(out, ", (unknown flags 0x%04x)", flags & 0xff8f);
 }
 
 /* There are a lot of styles here and most of them would require longer
@@ -200,7 +200,7 @@ static const char *const rsrc_dialog_style[] = {
     0
 };
 
-static void print_rsrc_dialog_style(dword flags){
+static void print_rsrc_dialog_style(dword flags, struct output *out){
     int i;
     char buffer[1024];
     buffer[0] = 0;
@@ -211,7 +211,7 @@ static void print_rsrc_dialog_style(dword flags){
             strcat(buffer, rsrc_dialog_style[i]);
         }
     }
-    printf("    Style: %s\n", buffer+2);
+    out_printf(out, "    Style: %s\n", buffer+2);
 }
 
 static const char *const rsrc_button_type[] = {
@@ -327,12 +327,12 @@ static const char *const rsrc_combobox_style[] = {
     0
 };
 
-static void print_rsrc_control_style(byte class, dword flags){
+static void print_rsrc_control_style(byte class, dword flags, struct output *out){
     int i;
     char buffer[1024];
     buffer[0] = 0;
 
-    printf("        Style: ");
+    out_printf(out, "        Style: ");
     
     switch (class){
     case 0x80: /* Button */
@@ -457,7 +457,7 @@ static void print_rsrc_control_style(byte class, dword flags){
         }
     }
 
-    printf("%s\n", (buffer[0] == ',') ? (buffer+2) : buffer);
+    out_printf(out, "%s\n", (buffer[0] == ',') ? (buffer+2) : buffer);
 }
 
 struct dialog_control {
@@ -480,26 +480,36 @@ static const char *const rsrc_dialog_class[] = {
     0
 };
 
-static off_t print_rsrc_menu_items(int depth, off_t offset)
+static off_t print_rsrc_menu_items(int depth, off_t offset, const struct image *image)
 {
     word flags, id;
     char buffer[1024];
     int i;
 
+    if (depth > 32) {
+        warn("Menu items are nested too deeply.\n");
+        return offset;
+    }
+
     while (1) {
-        flags = read_word(offset);
+        if (!in_image(image, offset)) {
+            warn("Menu extends past the end of the file.\n");
+            break;
+        }
+
+        flags = read_word(image, offset);
         offset += 2;
 
-        printf("        ");
-        for (i = 0; i < depth; i++) printf("  ");
+        out_printf(image->out, "        ");
+        for (i = 0; i < depth; i++) out_printf(image->out, "  ");
         if (!(flags & 0x0010)) {
             /* item ID */
-            id = read_word(offset);
+            id = read_word(image, offset);
             offset += 2;
-            printf("%d: ", id);
+            out_printf(image->out, "%d: ", id);
         }
 
-        offset = print_escaped_string0(offset);
+        offset = print_escaped_string0(offset, image);
 
         /* and print flags */
         buffer[0] = '\0';
@@ -515,12 +525,12 @@ static off_t print_rsrc_menu_items(int depth, off_t offset)
             sprintf(buffer+strlen(buffer), ", unknown flags 0x%04x", flags & 0xff00);
     
         if (buffer[0])
-            printf(" (%s)", buffer+2);
-        putchar('\n');
+            out_printf(image->out, " (%s)", buffer+2);
+        out_putc(image->out, '\n');
 
         /* if we have a popup, recurse */
         if (flags & 0x0010)
-            offset = print_rsrc_menu_items(depth + 1, offset);
+            offset = print_rsrc_menu_items(depth + 1, offset, image);
 
         if (flags & 0x0080)
             break;
@@ -599,7 +609,7 @@ static const char *const rsrc_version_subtype_drv[] = {
     0
 };
 
-static void print_rsrc_version_flags(struct version_header header){
+static void print_rsrc_version_flags(struct version_header header, struct output *out){
     char buffer[1024];
     int i;
     
@@ -612,9 +622,9 @@ static void print_rsrc_version_flags(struct version_header header){
     }
     if (header.flags_file & 0xffc0)
         sprintf(buffer+strlen(buffer), ", (unknown flags 0x%04x)", header.flags_file & 0xffc0);
-    printf("    File flags: ");
+    out_printf(out, "    File flags: ");
     if (header.flags_file)
-        printf("%s", buffer+2);
+        out_printf(out, "%s", buffer+2);
 
     buffer[0] = '\0';
     if (header.flags_os == 0)
@@ -636,44 +646,44 @@ static void print_rsrc_version_flags(struct version_header header){
         default: sprintf(buffer+strlen(buffer), ", (unknown OS 0x%04x)", header.flags_os >> 16);
         }
     }
-    printf("\n    OS flags: %s\n", buffer+2);
+    out_printf(out, "\n    OS flags: %s\n", buffer+2);
 
     if (header.flags_type <= 7)
-        printf("    Type: %s\n", rsrc_version_type[header.flags_type]);
+        out_printf(out, "    Type: %s\n", rsrc_version_type[header.flags_type]);
     else
-        printf("    Type: (unknown type %d)\n", header.flags_type);
+        out_printf(out, "    Type: (unknown type %d)\n", header.flags_type);
 
     if (header.flags_type == 3){ /* driver */
         if (header.flags_subtype <= 12)
-            printf("    Subtype: %s driver\n", rsrc_version_subtype_drv[header.flags_subtype]);
+            out_printf(out, "    Subtype: %s driver\n", rsrc_version_subtype_drv[header.flags_subtype]);
         else
-            printf("    Subtype: (unknown subtype %d)\n", header.flags_subtype);
+            out_printf(out, "    Subtype: (unknown subtype %d)\n", header.flags_subtype);
     } else if (header.flags_type == 4){ /* font */
-        if (header.flags_subtype == 0)      printf("    Subtype: unknown font\n");
-        else if (header.flags_subtype == 1) printf("    Subtype: raster font\n");
-        else if (header.flags_subtype == 2) printf("    Subtype: vector font\n");
-        else if (header.flags_subtype == 3) printf("    Subtype: TrueType font\n");
-        else printf("    Subtype: (unknown subtype %d)\n", header.flags_subtype);
+        if (header.flags_subtype == 0)      out_printf(out, "    Subtype: unknown font\n");
+        else if (header.flags_subtype == 1) out_printf(out, "    Subtype: raster font\n");
+        else if (header.flags_subtype == 2) out_printf(out, "    Subtype: vector font\n");
+        else if (header.flags_subtype == 3) out_printf(out, "    Subtype: TrueType font\n");
+        else out_printf(out, "    Subtype: (unknown subtype %d)\n", header.flags_subtype);
     } else if (header.flags_type == 5){ /* VXD */
-        printf("    Virtual device ID: %d\n", header.flags_subtype);
+        out_printf(out, "    Virtual device ID: %d\n", header.flags_subtype);
     } else if (header.flags_subtype){
         /* according to MSDN nothing else is valid */
-        printf("    Subtype: (unknown subtype %d)\n", header.flags_subtype);
+        out_printf(out, "    Subtype: (unknown subtype %d)\n", header.flags_subtype);
     }
 };
 
-static void print_rsrc_strings(off_t offset, off_t end)
+static void print_rsrc_strings(off_t offset, off_t end, const struct image *image)
 {
     word length;
 
     while (offset < end)
     {
         /* first length is redundant */
-        length = read_word(offset + 2);
-        printf("        ");
-        offset = print_escaped_string0(offset + 4);
+        length = read_word(image, offset + 2);
+        out_printf(image->out, "        ");
+        offset = print_escaped_string0(offset + 4, image);
         offset = (offset + 3) & ~3;
-        printf(": ");
+        out_printf(image->out, ": ");
         /* According to MSDN this is zero-terminated, and in most cases it is.
          * However, at least one application (msbsolar) has NEs with what
          * appears to be a non-zero-terminated string. In Windows this is cut
@@ -682,14 +692,14 @@ static void print_rsrc_strings(off_t offset, off_t end)
          *
          * And another file has a zero length here. How do compilers screw this
          * up so badly? */
-        print_escaped_string(offset, length ? length - 1 : 0);
+        print_escaped_string(offset, length ? length - 1 : 0, image);
         offset += length;
         offset = (offset + 3) & ~3;
-        putchar('\n');
+        out_putc(image->out, '\n');
     }
 };
 
-static void print_rsrc_stringfileinfo(off_t offset, off_t end)
+static void print_rsrc_stringfileinfo(off_t offset, off_t end, const struct image *image)
 {
     word length;
     unsigned int lang = 0;
@@ -699,148 +709,156 @@ static void print_rsrc_stringfileinfo(off_t offset, off_t end)
     while (offset < end)
     {
         /* StringTable header */
-        length = read_word(offset);
+        length = read_word(image, offset);
+        if (!length)
+            break;
 
         /* codepage and language code */
-        sscanf(read_data(offset + 4), "%4x%4x", &lang, &codepage);
-        printf("    String table (lang=%04x, codepage=%04x):\n", lang, codepage);
+        sscanf(read_data(image, offset + 4), "%4x%4x", &lang, &codepage);
+        out_printf(image->out, "    String table (lang=%04x, codepage=%04x):\n", lang, codepage);
 
-        print_rsrc_strings(offset + 16, offset + length);
+        print_rsrc_strings(offset + 16, offset + length, image);
         offset += length;
     }
 };
 
-static void print_rsrc_varfileinfo(off_t offset, off_t end)
+static void print_rsrc_varfileinfo(off_t offset, off_t end, const struct image *image)
 {
     while (offset < end)
     {
         /* first length is redundant */
-        word length = read_word(offset + 2), i;
+        word length = read_word(image, offset + 2), i;
         offset += 16;
         for (i = 0; i < length; i += 4)
-            printf("    Var (lang=%04x, codepage=%04x)\n", read_word(offset + i), read_word(offset + i + 2));
+            out_printf(image->out, "    Var (lang=%04x, codepage=%04x)\n", read_word(image, offset + i), read_word(image, offset + i + 2));
         offset += length;
     }
 };
 
-static void print_rsrc_resource(word type, off_t offset, size_t length, word rn_id)
+static void print_rsrc_resource(word type, off_t offset, size_t length, word rn_id, const struct image *image)
 {
     switch (type)
     {
     case 0x8001: /* Cursor */
-        printf("    Hotspot: (%d, %d)\n", read_word(offset), read_word(offset + 2));
+        out_printf(image->out, "    Hotspot: (%d, %d)\n", read_word(image, offset), read_word(image, offset + 2));
         offset += 4;
         /* fall through */
 
     case 0x8002: /* Bitmap */
     case 0x8003: /* Icon */
-        if (read_dword(offset) == 12) /* BITMAPCOREHEADER */
+        if (read_dword(image, offset) == 12) /* BITMAPCOREHEADER */
         {
-            printf("    Size: %dx%d\n", read_word(offset + 4), read_word(offset + 6));
-            printf("    Planes: %d\n", read_word(offset + 8));
-            printf("    Bit depth: %d\n", read_word(offset + 10));
+            out_printf(image->out, "    Size: %dx%d\n", read_word(image, offset + 4), read_word(image, offset + 6));
+            out_printf(image->out, "    Planes: %d\n", read_word(image, offset + 8));
+            out_printf(image->out, "    Bit depth: %d\n", read_word(image, offset + 10));
         }
-        else if (read_dword(offset) == 40) /* BITMAPINFOHEADER */
+        else if (read_dword(image, offset) == 40) /* BITMAPINFOHEADER */
         {
-            const struct header_bitmap_info *header = read_data(offset);
-            printf("    Size: %dx%d\n", header->biWidth, header->biHeight / 2);
-            printf("    Planes: %d\n", header->biPlanes);
-            printf("    Bit depth: %d\n", header->biBitCount);
+            struct header_bitmap_info bmp;
+            const struct header_bitmap_info *header = &bmp;
+
+            memcpy(&bmp, read_bytes(image, offset, sizeof(bmp)), sizeof(bmp));
+            out_printf(image->out, "    Size: %dx%d\n", header->biWidth, header->biHeight / 2);
+            out_printf(image->out, "    Planes: %d\n", header->biPlanes);
+            out_printf(image->out, "    Bit depth: %d\n", header->biBitCount);
             if (header->biCompression <= 13 && rsrc_bmp_compression[header->biCompression])
-                printf("    Compression: %s\n", rsrc_bmp_compression[header->biCompression]);
+                out_printf(image->out, "    Compression: %s\n", rsrc_bmp_compression[header->biCompression]);
             else
-                printf("    Compression: (unknown value %d)\n", header->biCompression);
-            printf("    Resolution: %dx%d pixels/meter\n",
+                out_printf(image->out, "    Compression: (unknown value %d)\n", header->biCompression);
+            out_printf(image->out, "    Resolution: %dx%d pixels/meter\n",
                     header->biXPelsPerMeter, header->biYPelsPerMeter);
-            printf("    Colors used: %d", header->biClrUsed); /* todo: implied */
+            out_printf(image->out, "    Colors used: %d", header->biClrUsed); /* todo: implied */
             if (header->biClrImportant)
-                printf(" (%d marked important)", header->biClrImportant);
-            putchar('\n');
+                out_printf(image->out, " (%d marked important)", header->biClrImportant);
+            out_putc(image->out, '\n');
         }
         else
-            warn("Unknown bitmap header size %d.\n", read_dword(offset));
+            warn("Unknown bitmap header size %d.\n", read_dword(image, offset));
         break;
 
     case 0x8004: /* Menu */
     {
-        word extended = read_word(offset);
+        word extended = read_word(image, offset);
 
         if (extended > 1) {
             warn("Unknown menu version %d\n",extended);
             break;
         }
-        printf(extended ? "    Type: extended\n" : "    Type: standard\n");
-        if (read_word(offset + 2) != extended*4)
-            warn("Unexpected offset value %d (expected %d).\n", read_word(offset + 2), extended * 4);
+        out_printf(image->out, extended ? "    Type: extended\n" : "    Type: standard\n");
+        if (read_word(image, offset + 2) != extended*4)
+            warn("Unexpected offset value %d (expected %d).\n", read_word(image, offset + 2), extended * 4);
         offset += 4;
 
         if (extended)
         {
-            printf("    Help ID: %d\n", read_dword(offset));
+            out_printf(image->out, "    Help ID: %d\n", read_dword(image, offset));
             offset += 4;
         }
 
-        printf("    Items:\n");
-        print_rsrc_menu_items(0, offset);
+        out_printf(image->out, "    Items:\n");
+        print_rsrc_menu_items(0, offset, image);
         break;
     }
     case 0x8005: /* Dialog box */
     {
         byte count;
         word font_size;
-        dword style = read_dword(offset);
-        print_rsrc_dialog_style(style);
-        count = read_byte(offset + 4);
-        printf("    Position: (%d, %d)\n", read_word(offset + 5), read_word(offset + 7));
-        printf("    Size: %dx%d\n", read_word(offset + 9), read_word(offset + 11));
-        if (read_byte(offset + 13) == 0xff){
-            printf("    Menu resource: #%d", read_word(offset + 14));
+        dword style = read_dword(image, offset);
+        print_rsrc_dialog_style(style, image->out);
+        count = read_byte(image, offset + 4);
+        out_printf(image->out, "    Position: (%d, %d)\n", read_word(image, offset + 5), read_word(image, offset + 7));
+        out_printf(image->out, "    Size: %dx%d\n", read_word(image, offset + 9), read_word(image, offset + 11));
+        if (read_byte(image, offset + 13) == 0xff){
+            out_printf(image->out, "    Menu resource: #%d", read_word(image, offset + 14));
         } else {
-            printf("    Menu name: ");
-            offset = print_escaped_string0(offset + 13);
+            out_printf(image->out, "    Menu name: ");
+            offset = print_escaped_string0(offset + 13, image);
         }
-        printf("\n    Class name: ");
-        offset = print_escaped_string0(offset);
-        printf("\n    Caption: ");
-        offset = print_escaped_string0(offset);
+        out_printf(image->out, "\n    Class name: ");
+        offset = print_escaped_string0(offset, image);
+        out_printf(image->out, "\n    Caption: ");
+        offset = print_escaped_string0(offset, image);
         if (style & 0x00000040){ /* DS_SETFONT */
-            font_size = read_word(offset);
-            printf("\n    Font: ");
-            offset = print_escaped_string0(offset + 2);
-            printf(" (%d pt)", font_size);
+            font_size = read_word(image, offset);
+            out_printf(image->out, "\n    Font: ");
+            offset = print_escaped_string0(offset + 2, image);
+            out_printf(image->out, " (%d pt)", font_size);
         }
-        putchar('\n');
+        out_putc(image->out, '\n');
 
         while (count--){
-            const struct dialog_control *control = read_data(offset);
+            struct dialog_control ctl;
+            const struct dialog_control *control = &ctl;
+
+            memcpy(&ctl, read_bytes(image, offset, sizeof(ctl)), sizeof(ctl));
             offset += sizeof(*control);
 
             if (control->class & 0x80){
                 if (control->class <= 0x85)
-                    printf("    %s", rsrc_dialog_class[control->class & (~0x80)]);
+                    out_printf(image->out, "    %s", rsrc_dialog_class[control->class & (~0x80)]);
                 else
-                    printf("    (unknown class %d)", control->class);
+                    out_printf(image->out, "    (unknown class %d)", control->class);
             }
             else
-                offset = print_escaped_string0(offset);
-            printf(" %d:\n", control->id);
+                offset = print_escaped_string0(offset, image);
+            out_printf(image->out, " %d:\n", control->id);
 
-            printf("        Position: (%d, %d)\n", control->x, control->y);
-            printf("        Size: %dx%d\n", control->width, control->height);
-            print_rsrc_control_style(control->class, control->style);
+            out_printf(image->out, "        Position: (%d, %d)\n", control->x, control->y);
+            out_printf(image->out, "        Size: %dx%d\n", control->width, control->height);
+            print_rsrc_control_style(control->class, control->style, image->out);
 
-            if (read_byte(offset) == 0xff){
+            if (read_byte(image, offset) == 0xff){
                 /* todo: we can check the style for SS_ICON/SS_BITMAP and *maybe* also
                  * refer back to a printed RT_GROUPICON/GROUPCUROR/BITMAP resource. */
-                printf("        Resource: #%d", read_word(offset));
+                out_printf(image->out, "        Resource: #%d", read_word(image, offset));
                 offset += 3;
             } else {
-                printf("        Text: ");
-                offset = print_escaped_string0(offset );
+                out_printf(image->out, "        Text: ");
+                offset = print_escaped_string0(offset , image);
             }
             /* todo: WINE parses this as "data", but all of my testcases return 0. */
-            /* read_byte(); */
-            putchar('\n');
+            /* read_byte(image, ); */
+            out_putc(image->out, '\n');
         }
     }
     break;
@@ -851,12 +869,12 @@ static void print_rsrc_resource(word type, off_t offset, size_t length, word rn_
 
         while (cursor < offset + length)
         {
-            byte str_length = read_byte(cursor++);
+            byte str_length = read_byte(image, cursor++);
             if (str_length)
             {
-                printf("    %3d (0x%06lx): ", i + ((rn_id & (~0x8000))-1)*16, cursor);
-                print_escaped_string(cursor, str_length);
-                putchar('\n');
+                out_printf(image->out, "    %3d (0x%06lx): ", i + ((rn_id & (~0x8000))-1)*16, cursor);
+                print_escaped_string(cursor, str_length, image);
+                out_putc(image->out, '\n');
                 cursor += str_length;
             }
             i++;
@@ -883,27 +901,27 @@ static void print_rsrc_resource(word type, off_t offset, size_t length, word rn_
         byte flags;
 
         do {
-            flags = read_byte();
-            key = read_word();
-            id = read_word();
+            flags = read_byte(image, );
+            key = read_word(image, );
+            id = read_word(image, );
 
-            printf("    ");
+            out_printf(image->out, "    ");
 
             if (flags & 0x02)
-                printf("(FNOINVERT) ");
+                out_printf(image->out, "(FNOINVERT) ");
 
             if (flags & 0x04)
-                printf("Shift+");
+                out_printf(image->out, "Shift+");
             if (flags & 0x08)
-                printf("Ctrl+");
+                out_printf(image->out, "Ctrl+");
             if (flags & 0x10)
-                printf("Alt+");
+                out_printf(image->out, "Alt+");
             if (flags & 0x60)
                 warn("Unknown accelerator flags 0x%02x\n", flags & 0x60);
 
             /* fixme: print the key itself */
 
-            printf(": %d\n", id);
+            out_printf(image->out, ": %d\n", id);
         } while (!(flags & 0x80));
     }
     break;
@@ -916,62 +934,72 @@ static void print_rsrc_resource(word type, off_t offset, size_t length, word rn_
          * resource. Therefore we only list the components this refers to.
          * Fortunately, the headers are different but the relevant information
          * is stored in the same bytes. */
-        word count = read_word(offset + 4);
+        word count = read_word(image, offset + 4);
         offset += 6;
-        printf("    Resources: ");
+        out_printf(image->out, "    Resources: ");
         if (count--) {
-            printf("#%d", read_word(offset + 12));
+            out_printf(image->out, "#%d", read_word(image, offset + 12));
             offset += 14;
         }
         while (count--) {
-            printf(", #%d", read_word(offset + 12));
+            out_printf(image->out, ", #%d", read_word(image, offset + 12));
             offset += 14;
         }
-        printf("\n");
+        out_printf(image->out, "\n");
     }
     break;
     case 0x8010: /* Version */
     {
-        const struct version_header *header = read_data(offset);
-        const off_t end = offset + header->length;
+        struct version_header version;
+        const struct version_header *header = &version;
+        off_t end;
+
+        memcpy(&version, read_bytes(image, offset, sizeof(version)), sizeof(version));
+        end = offset + image_clamp(image, offset, header->length);
 
         if (header->value_length != 52)
             warn("Version header length is %d (expected 52).\n", header->value_length);
-        if (strcmp((char *)header->string, "VS_VERSION_INFO"))
+        if (memcmp(header->string, "VS_VERSION_INFO", sizeof(header->string)))
             warn("Version header is %.16s (expected VS_VERSION_INFO).\n", header->string);
         if (header->magic != 0xfeef04bd)
             warn("Version magic number is 0x%08x (expected 0xfeef04bd).\n", header->magic);
         if (header->struct_1 != 1 || header->struct_2 != 0)
             warn("Version header version is %d.%d (expected 1.0).\n", header->struct_1, header->struct_2);
-        print_rsrc_version_flags(*header);
+        print_rsrc_version_flags(*header, image->out);
 
-        printf("    File version:    %d.%d.%d.%d\n",
+        out_printf(image->out, "    File version:    %d.%d.%d.%d\n",
                header->file_1, header->file_2, header->file_3, header->file_4);
-        printf("    Product version: %d.%d.%d.%d\n",
+        out_printf(image->out, "    Product version: %d.%d.%d.%d\n",
                header->prod_1, header->prod_2, header->prod_3, header->prod_4);
 
         if (0) {
-        printf("    Created on: ");
+        out_printf(image->out, "    Created on: ");
         print_timestamp(header->date_1, header->date_2);
-        putchar('\n');
+        out_putc(image->out, '\n');
         }
 
         offset += sizeof(struct version_header);
 
         while (offset < end)
         {
-            word info_length = read_word(offset);
-            word value_length = read_word(offset + 2);
-            const char *key = read_data(offset + 4);
+            word info_length = read_word(image, offset);
+            word value_length = read_word(image, offset + 2);
+            char key[32];
+
+            if (!info_length)
+                break;
+
+            memcpy(key, read_bytes(image, offset + 4, sizeof(key) - 1), sizeof(key) - 1);
+            key[sizeof(key) - 1] = 0;
 
             if (value_length)
                 warn("Value length is nonzero: %04x\n", value_length);
 
             /* "type" is again omitted */
             if (!strcmp(key, "StringFileInfo"))
-                print_rsrc_stringfileinfo(offset + 20, offset + info_length);
+                print_rsrc_stringfileinfo(offset + 20, offset + info_length, image);
             else if (!strcmp(key, "VarFileInfo"))
-                print_rsrc_varfileinfo(offset + 16, offset + info_length);
+                print_rsrc_varfileinfo(offset + 16, offset + info_length, image);
             else
                 warn("Unrecognized file info key: %s\n", key);
 
@@ -989,22 +1017,22 @@ static void print_rsrc_resource(word type, off_t offset, size_t length, word rn_
         {
             len = min(offset + length - cursor, 16);
             
-            printf("    %lx:", cursor);
+            out_printf(image->out, "    %lx:", cursor);
             for (i=0; i<16; i++){
                 if (!(i & 1))
                     /* Since this is 16 bits, we put a space after (before) every other two bytes. */
-                    putchar(' ');
+                    out_putc(image->out, ' ');
                 if (i<len)
-                    printf("%02x", read_byte(cursor + i));
+                    out_printf(image->out, "%02x", read_byte(image, cursor + i));
                 else
-                    printf("  ");
+                    out_printf(image->out, "  ");
             }
-            printf("  ");
+            out_printf(image->out, "  ");
             for (i=0; i<len; i++){
-                char c = read_byte(cursor + i);
-                putchar(isprint(c) ? c : '.');
+                char c = read_byte(image, cursor + i);
+                out_putc(image->out, isprint(c) ? c : '.');
             }
-            putchar('\n');
+            out_putc(image->out, '\n');
 
             cursor += len;
         }
@@ -1053,74 +1081,90 @@ struct resource {
 
 STATIC_ASSERT(sizeof(struct resource) == 0xc);
 
-struct type_header
-{
-    word type_id;
-    word count;
-    dword resloader; /* fixme: what is this? */
-    struct resource resources[1];
-};
-
-void print_rsrc(off_t start){
-    const struct type_header *header;
-    word align = read_word(start);
+void print_rsrc(off_t start, const struct image *image){
+    word align = read_word(image, start);
+    off_t cursor = start + sizeof(word);
     char *idstr;
-    word i;
+    word type_id, count, i;
+    dword resloader; /* fixme: what is this? */
 
-    header = read_data(start + sizeof(word));
+    if (align >= 16) {
+        warn("Resource alignment shift %d is too large.\n", align);
+        return;
+    }
 
-    while (header->type_id)
+    /* Each type is a header (type ID, count, resloader) followed by count
+     * resources. Read them field by field rather than overlaying structs, since
+     * a corrupt count can run the table off the end of the file. */
+    while ((type_id = read_word(image, cursor)))
     {
-        if (header->resloader)
-            warn("resloader is nonzero: %08x\n", header->resloader);
+        count = read_word(image, cursor + 2);
+        resloader = read_dword(image, cursor + 4);
+        cursor += 8;
+
+        if (!in_image(image, cursor + count * sizeof(struct resource) - 1)) {
+            warn("Resource table extends past the end of the file.\n");
+            return;
+        }
+
+        if (resloader)
+            warn("resloader is nonzero: %08x\n", resloader);
 
-        for (i = 0; i < header->count; ++i)
+        for (i = 0; i < count; ++i, cursor += sizeof(struct resource))
         {
-            const struct resource *rn = &header->resources[i];
+            struct resource rn;
+            dword offset, length;
+
+            memcpy(&rn, read_bytes(image, cursor, sizeof(rn)), sizeof(rn));
+            offset = (dword)rn.offset << align;
+            length = (dword)rn.length << align;
 
-            if (rn->id & 0x8000){
+            if (rn.id & 0x8000){
                 idstr = malloc(6);
-                sprintf(idstr, "%d", rn->id & ~0x8000);
+                sprintf(idstr, "%d", rn.id & ~0x8000);
             } else
-                idstr = dup_string_resource(start + rn->id);
+                idstr = dup_string_resource(start + rn.id, image);
 
-            if (header->type_id & 0x8000)
+            if (type_id & 0x8000)
             {
-                if ((header->type_id & (~0x8000)) < rsrc_types_count && rsrc_types[header->type_id & (~0x8000)]){
-                    if (!filter_resource(rsrc_types[header->type_id & ~0x8000], idstr))
+                if ((type_id & (~0x8000)) < rsrc_types_count && rsrc_types[type_id & (~0x8000)]){
+                    if (!filter_resource(rsrc_types[type_id & ~0x8000], idstr))
                         goto next;
-                    printf("\n%s", rsrc_types[header->type_id & ~0x8000]);
+                    out_printf(image->out, "\n%s", rsrc_types[type_id & ~0x8000]);
                 } else {
                     char typestr[7];
-                    sprintf(typestr, "0x%04x", header->type_id);
+                    sprintf(typestr, "0x%04x", type_id);
                     if (!filter_resource(typestr, idstr))
                         goto next;
-                    printf("\n%s", typestr);
+                    out_printf(image->out, "\n%s", typestr);
                 }
             }
             else
             {
-                char *typestr = dup_string_resource(start + header->type_id);
+                char *typestr = dup_string_resource(start + type_id, image);
                 if (!filter_resource(typestr, idstr))
                 {
                     free(typestr);
                     goto next;
                 }
-                printf("\n\"%s\"", typestr);
+                out_printf(image->out, "\n\"%s\"", typestr);
                 free(typestr);
             }
 
-            printf(" %s", idstr);
-            printf(" (offset = 0x%x, length = %d [0x%x]", rn->offset << align, rn->length << align, rn->length << align);
-            print_rsrc_flags(rn->flags);
-            printf("):\n");
+            out_printf(image->out, " %s", idstr);
+            out_printf(image->out, " (offset = 0x%x, length = %d [0x%x]", offset, length, length);
+            print_rsrc_flags(rn.flags, image->out);
+            out_printf(image->out, "):\n");
 
-            print_rsrc_resource(header->type_id, rn->offset << align, rn->length << align, rn->id);
+            if (image_clamp(image, offset, length) < length) {
+                warn("Resource extends past the end of the file.\n");
+                length = image_clamp(image, offset, length);
+            }
+
+            print_rsrc_resource(type_id, offset, length, rn.id, image);
 
 next:
             free(idstr);
         }
-
-        header = (struct type_header *)(&header->resources[header->count]);
     }
 }
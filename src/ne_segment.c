@@ -20,57 +20,61 @@
  * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
  */
 
-#include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "semblance.h"
 #include "ne.h"
+#include "cache.h"
+#include "scan.h"
+#include "sweep.h"
 #include "x86_instr.h"
 
 #ifdef USE_WARN
 #define warn_at(...) \
-    do { fprintf(stderr, "Warning: %d:%04x: ", cs, ip); \
-        fprintf(stderr, __VA_ARGS__); } while(0)
+    do { warn_printf("Warning: %d:%04x: ", cs, ip); \
+        warn_printf(__VA_ARGS__); } while(0)
 #else
 #define warn_at(...)
 #endif
 
-/* index function */
+/* index function; entindex is sorted by build_entry_index() */
 static char *get_entry_name(word cs, word ip, const struct ne *ne) {
-    unsigned i;
-    for (i=0; i<ne->entcount; i++) {
-        if (ne->enttab[i].segment == cs &&
-            ne->enttab[i].offset == ip)
-            return ne->enttab[i].name;
+    unsigned lo = 0, hi = ne->entcount;
+    const struct entry *entry;
+
+    while (lo < hi) {
+        unsigned mid = lo + (hi - lo) / 2;
+        entry = ne->entindex[mid];
+        if (entry->segment < cs || (entry->segment == cs && entry->offset < ip))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (lo < ne->entcount) {
+        entry = ne->entindex[lo];
+        if (entry->segment == cs && entry->offset == ip)
+            return entry->name;
     }
     return NULL;
 }
 
 /* index function */
 static const struct reloc *get_reloc(const struct segment *seg, word ip) {
-    unsigned i, o;
-    for (i = 0; i < seg->reloc_count; i++) {
-        for (o = 0; o < seg->reloc_table[i].offset_count; o++)
-            if (seg->reloc_table[i].offsets[o] == ip)
-                return &seg->reloc_table[i];
-    }
-    return NULL;
+    if (!seg->reloc_map || ip >= seg->length || !seg->reloc_map[ip])
+        return NULL;
+    return &seg->reloc_table[seg->reloc_map[ip] - 1];
 }
 
 /* load an imported name from a specfile */
-static char *get_imported_name(word module, word ordinal, const struct ne *ne) {
-    unsigned i;
-    for (i=0; i<ne->imptab[module-1].export_count; i++) {
-        if (ne->imptab[module-1].exports[i].ordinal == ordinal)
-            return ne->imptab[module-1].exports[i].name;
-    }
-    return NULL;
+static const char *get_imported_name(word module, word ordinal, const struct ne *ne) {
+    return specfile_name(ne->imptab[module-1].spec, ordinal);
 }
 
-/* Tweak the inline string and return the comment. */
-static const char *relocate_arg(const struct segment *seg, struct arg *arg, const struct ne *ne)
+/* Fill in the argument string and return the comment. */
+static const char *relocate_arg(const struct segment *seg, const struct arg *arg, char *string, const struct ne *ne)
 {
     const struct reloc *r = get_reloc(seg, arg->ip);
     char *module = NULL;
@@ -87,20 +91,20 @@ static const char *relocate_arg(const struct segment *seg, struct arg *arg, cons
     if (arg->type == SEGPTR && r->size == 3) {
         /* 32-bit relocation on 32-bit pointer, so just copy the name */
         if (r->type == 0) {
-            snprintf(arg->string, sizeof(arg->string), "%d:%04x", r->tseg, r->toffset);
+            snprintf(string, ARG_STRING_MAX, "%d:%04x", r->tseg, r->toffset);
             return r->text;
         } else if (r->type == 1) {
-            snprintf(arg->string, sizeof(arg->string), "%s.%d", module, r->toffset);
+            snprintf(string, ARG_STRING_MAX, "%s.%d", module, r->toffset);
             return get_imported_name(r->tseg, r->toffset, ne);
         } else if (r->type == 2) {
-            snprintf(arg->string, sizeof(arg->string), "%s.%.*s", module,
+            snprintf(string, ARG_STRING_MAX, "%s.%.*s", module,
                 ne->nametab[r->toffset], &ne->nametab[r->toffset+1]);
             return NULL;
         }
     } else if (arg->type == SEGPTR && r->size == 2 && r->type == 0) {
         /* segment relocation on 32-bit pointer; copy the segment but keep the
          * offset */
-        snprintf(arg->string, sizeof(arg->string), "%d:%04lx", r->tseg, arg->value);
+        snprintf(string, ARG_STRING_MAX, "%d:%04lx", r->tseg, arg->value);
         return get_entry_name(r->tseg, arg->value, ne);
     } else if ((arg->type == IMM || arg->type == MEM) && (r->size == 2 || r->size == 5)) {
         /* imm16 referencing a segment or offset directly; MEM with lea has also
@@ -113,13 +117,13 @@ static const char *relocate_arg(const struct segment *seg, struct arg *arg, cons
             close = "]";
         }
         if (r->type == 0) {
-            snprintf(arg->string, sizeof(arg->string), "%s%s%d%s", open, pfx, r->tseg, close);
+            snprintf(string, ARG_STRING_MAX, "%s%s%d%s", open, pfx, r->tseg, close);
             return NULL;
         } else if (r->type == 1) {
-            snprintf(arg->string, sizeof(arg->string), "%s%s%s.%d%s", open, pfx, module, r->toffset, close);
+            snprintf(string, ARG_STRING_MAX, "%s%s%s.%d%s", open, pfx, module, r->toffset, close);
             return get_imported_name(r->tseg, r->toffset, ne);
         } else if (r->type == 2) {
-            snprintf(arg->string, sizeof(arg->string), "%s%s%s.%.*s%s", open, pfx, module,
+            snprintf(string, ARG_STRING_MAX, "%s%s%s.%.*s%s", open, pfx, module,
                 ne->nametab[r->toffset], &ne->nametab[r->toffset+1], close);
             return NULL;
         }
@@ -132,132 +136,149 @@ static const char *relocate_arg(const struct segment *seg, struct arg *arg, cons
 }
 
 /* Returns the number of bytes processed (same as get_instr). */
-static int print_ne_instr(const struct segment *seg, word ip, byte *p, const struct ne *ne) {
+static int print_ne_instr(struct output *out, const struct segment *seg, word ip, byte *p, const struct ne *ne) {
     word cs = seg->cs;
     struct instr instr = {0};
+    struct instr_text text = {0};
     unsigned len;
     int bits = (seg->flags & 0x2000) ? 32 : 16;
 
     const char *comment = NULL;
     char ip_string[11];
 
-    len = get_instr(ip, p, &instr, bits);
+    if (!(len = decode_cache_find(&seg->decoded, ip, &instr)))
+        len = get_instr(ip, p, &instr, bits);
 
     sprintf(ip_string, "%3d:%04x", seg->cs, ip);
 
     /* check for relocations */
-    if (seg->instr_flags[instr.args[0].ip] & INSTR_RELOC)
-        comment = relocate_arg(seg, &instr.args[0], ne);
-    if (seg->instr_flags[instr.args[1].ip] & INSTR_RELOC)
-        comment = relocate_arg(seg, &instr.args[1], ne);
+    if (has_instr_flag(seg->instr_flags, instr.args[0].ip, INSTR_RELOC))
+        comment = relocate_arg(seg, &instr.args[0], text.args[0], ne);
+    if (has_instr_flag(seg->instr_flags, instr.args[1].ip, INSTR_RELOC))
+        comment = relocate_arg(seg, &instr.args[1], text.args[1], ne);
     /* make sure to check for SEGPTR segment-only relocations */
-    if (instr.op.arg0 == SEGPTR && seg->instr_flags[instr.args[0].ip+2] & INSTR_RELOC)
-        comment = relocate_arg(seg, &instr.args[0], ne);
+    if (instr.op.arg0 == SEGPTR && has_instr_flag(seg->instr_flags, instr.args[0].ip+2, INSTR_RELOC))
+        comment = relocate_arg(seg, &instr.args[0], text.args[0], ne);
 
     /* check if we are referencing a named export */
     if (!comment && instr.op.arg0 == REL)
         comment = get_entry_name(cs, instr.args[0].value, ne);
 
-    print_instr(ip_string, p, len, seg->instr_flags[ip], &instr, comment, bits);
+    print_instr(out, ip_string, p, len, get_instr_flags(seg->instr_flags, ip), &instr, &text, comment, bits);
 
     return len;
 };
 
-static void print_disassembly(const struct segment *seg, const struct ne *ne) {
+struct sweep_segment {
+    const struct segment *seg;
+    const struct ne *ne;
+};
+
+/* Print the instruction at ip, or skip what can't be printed. */
+static dword print_step(dword ip, struct output *out, void *ctx) {
+    const struct sweep_segment *sweep_seg = ctx;
+    const struct segment *seg = sweep_seg->seg;
+    const struct ne *ne = sweep_seg->ne;
     const word cs = seg->cs;
-    word ip = 0;
 
     byte buffer[MAX_INSTR];
 
-    while (ip < seg->length) {
-        /* find a valid instruction */
-        if (!(seg->instr_flags[ip] & INSTR_VALID)) {
-            if (opts & DISASSEMBLE_ALL) {
-                /* still skip zeroes */
-                if (read_byte(seg->start + ip) == 0)
-                {
-                    printf("     ...\n");
-                    ip++;
-                    while (read_byte(seg->start + ip) == 0) ip++;
-                }
-            } else {
-                printf("     ...\n");
-                while ((ip < seg->length) && !(seg->instr_flags[ip] & INSTR_VALID)) ip++;
+    /* find a valid instruction */
+    if (!has_instr_flag(seg->instr_flags, ip, INSTR_VALID)) {
+        if (opts & DISASSEMBLE_ALL) {
+            /* still skip zeroes */
+            if (read_byte(ne->image, seg->start + ip) == 0)
+            {
+                out_printf(out, "     ...\n");
+                ip++;
+                while (ip < seg->length && read_byte(ne->image, seg->start + ip) == 0) ip++;
+                return (ip < seg->length) ? ip : SWEEP_END;
             }
+        } else {
+            out_printf(out, "     ...\n");
+            ip = find_instr_flag(seg->instr_flags, ip, seg->length, INSTR_VALID);
+            return (ip < seg->length) ? ip : SWEEP_END;
         }
+    }
 
-        if (ip >= seg->length) return;
+    /* Instructions can "hang over" the end of a segment.
+     * Zero should be supplied. */
+    memset(buffer, 0, sizeof(buffer));
+    memcpy(buffer, read_bytes(ne->image, seg->start + ip, sizeof(buffer)), min(sizeof(buffer), seg->length - ip));
+
+    if (has_instr_flag(seg->instr_flags, ip, INSTR_FUNC)) {
+        char *name = get_entry_name(cs, ip, ne);
+        out_printf(out, "\n");
+        out_printf(out, "%d:%04x <%s>:\n", cs, ip, name ? name : "no name");
+        /* don't mark far functions—we can't reliably detect them
+         * because of "push cs", and they should be evident anyway. */
+    }
 
-        /* Instructions can "hang over" the end of a segment.
-         * Zero should be supplied. */
-        memset(buffer, 0, sizeof(buffer));
-        memcpy(buffer, read_data(seg->start + ip), min(sizeof(buffer), seg->length - ip));
-
-        if (seg->instr_flags[ip] & INSTR_FUNC) {
-            char *name = get_entry_name(cs, ip, ne);
-            printf("\n");
-            printf("%d:%04x <%s>:\n", cs, ip, name ? name : "no name");
-            /* don't mark far functions—we can't reliably detect them
-             * because of "push cs", and they should be evident anyway. */
-        }
+    return ip + print_ne_instr(out, seg, ip, buffer, ne);
+}
 
-        ip += print_ne_instr(seg, ip, buffer, ne);
-    }
-    putchar('\n');
+static void print_disassembly(const struct segment *seg, const struct ne *ne, struct output *out) {
+    struct sweep_segment ctx = {seg, ne};
+
+    if (sweep(ne->image, 0, seg->length, print_step, out, &ctx) != SWEEP_END)
+        out_putc(out, '\n');
 }
 
-static void print_data(const struct segment *seg) {
-    word ip;    /* well, not really ip */
+static void print_data(const struct segment *seg, const struct ne *ne, struct output *out) {
+    dword length = image_clamp(ne->image, seg->start, seg->length);
+    dword ip;   /* well, not really ip */
 
-    for (ip = 0; ip < seg->length; ip += 16) {
-        int len = min(seg->length-ip, 16);
-        int i;
+    if (length < seg->length)
+        warn("Segment %d extends past the end of the file.\n", seg->cs);
 
-        printf("%3d:%04x", seg->cs, ip);
-        for (i=0; i<16; i++) {
-            if (i < len)
-                printf(" %02x", read_byte(seg->start + ip + i));
-            else
-                printf("   ");
-        }
-        printf("  ");
-        for (i = 0; i < len; ++i)
-        {
-            char c = read_byte(seg->start + ip + i);
-            putchar(isprint(c) ? c : '.');
-        }
-        putchar('\n');
+    for (ip = 0; ip < length; ip += 16) {
+        int len = min(length-ip, 16);
+
+        out_printf(out, "%3d:%04x", seg->cs, ip);
+        out_hex_line(out, read_bytes(ne->image, seg->start + ip, len), len);
     }
 }
 
-static void scan_segment(word cs, word ip, struct ne *ne) {
+/* Scan one run of code, queueing the targets of any branches we find. */
+static void scan_run(const struct scan_item *item, struct worklist *wl, void *ctx) {
+    struct ne *ne = ctx;
+    word cs = item->cs;
+    word ip = item->ip;
     struct segment *seg = &ne->segments[cs-1];
 
     byte buffer[MAX_INSTR];
     struct instr instr;
+    struct scan_item target;
     int instr_length;
     int i;
 
-    if (ip >= seg->length) {
-        warn_at("Attempt to scan past end of segment.\n");
-        return;
-    }
+    if (!item->resume) {
+        if (ip >= seg->length) {
+            warn_at("Attempt to scan past end of segment.\n");
+            return;
+        }
 
-    if ((seg->instr_flags[ip] & (INSTR_VALID|INSTR_SCANNED)) == INSTR_SCANNED)
-        warn_at("Attempt to scan byte that does not begin instruction.\n");
+        if ((get_instr_flags(seg->instr_flags, ip) & (INSTR_VALID|INSTR_SCANNED)) == INSTR_SCANNED)
+            warn_at("Attempt to scan byte that does not begin instruction.\n");
+    }
 
     while (ip < seg->length) {
+        unsigned count = 0;
+
         /* check if we already read from here */
-        if (seg->instr_flags[ip] & INSTR_SCANNED) return;
+        if (has_instr_flag(seg->instr_flags, ip, INSTR_SCANNED)) return;
 
         /* read the instruction */
         memset(buffer, 0, sizeof(buffer));
-        memcpy(buffer, read_data(seg->start + ip), min(sizeof(buffer), seg->length - ip));
+        memcpy(buffer, read_bytes(ne->image, seg->start + ip, sizeof(buffer)), min(sizeof(buffer), seg->length - ip));
         instr_length = get_instr(ip, buffer, &instr, (seg->flags & 0x2000) ? 32 : 16);
+        if (mode & DISASSEMBLE)
+            decode_cache_add(&seg->decoded, ip, &instr, instr_length);
 
         /* mark the bytes */
-        seg->instr_flags[ip] |= INSTR_VALID;
-        for (i = ip; i < ip+instr_length && i < seg->min_alloc; i++) seg->instr_flags[i] |= INSTR_SCANNED;
+        set_instr_flags(seg->instr_flags, ip, INSTR_VALID);
+        i = (ip < seg->min_alloc) ? min(ip + instr_length, seg->min_alloc) : ip;
+        set_instr_flag_range(seg->instr_flags, ip, i, INSTR_SCANNED);
 
         /* instruction which hangs over the minimum allocation */
         if (i < ip+instr_length && i == seg->min_alloc) break;
@@ -265,31 +286,50 @@ static void scan_segment(word cs, word ip, struct ne *ne) {
         /* handle conditional and unconditional jumps */
         if (instr.op.arg0 == SEGPTR) {
             for (i = ip; i < ip+instr_length; i++) {
-                if (seg->instr_flags[i] & INSTR_RELOC) {
+                if (has_instr_flag(seg->instr_flags, i, INSTR_RELOC)) {
                     const struct reloc *r = get_reloc(seg, i);
                     const struct segment *tseg;
 
                     if (!r) break;
-                    tseg = &ne->segments[r->tseg-1];
-
                     if (r->type != 0) break;
 
+                    if (!r->tseg || r->tseg > ne->header.ne_cseg) {
+                        warn_at("Relocation to segment %d, but there are only %d segments.\n",
+                                r->tseg, ne->header.ne_cseg);
+                        break;
+                    }
+                    tseg = &ne->segments[r->tseg-1];
+
                     if (r->size == 3) {
                         /* 32-bit relocation on 32-bit pointer */
-                        tseg->instr_flags[r->toffset] |= INSTR_FAR;
+                        if (r->toffset >= tseg->min_alloc) {
+                            warn_at("Relocation to %d:%04x exceeds segment allocation (%04x).\n",
+                                    r->tseg, r->toffset, tseg->min_alloc);
+                            break;
+                        }
+                        set_instr_flags(tseg->instr_flags, r->toffset, INSTR_FAR);
                         if (!strcmp(instr.op.name, "call"))
-                            tseg->instr_flags[r->toffset] |= INSTR_FUNC;
+                            set_instr_flags(tseg->instr_flags, r->toffset, INSTR_FUNC);
                         else
-                            tseg->instr_flags[r->toffset] |= INSTR_JUMP;
-                        scan_segment(r->tseg, r->toffset, ne);
+                            set_instr_flags(tseg->instr_flags, r->toffset, INSTR_JUMP);
+                        target.cs = r->tseg;
+                        target.ip = r->toffset;
+                        count = 1;
                     } else if (r->size == 2) {
                         /* segment relocation on 32-bit pointer */
-                        tseg->instr_flags[instr.args[0].value] |= INSTR_FAR;
+                        if (instr.args[0].value >= tseg->min_alloc) {
+                            warn_at("Relocation to %d:%04lx exceeds segment allocation (%04x).\n",
+                                    r->tseg, instr.args[0].value, tseg->min_alloc);
+                            break;
+                        }
+                        set_instr_flags(tseg->instr_flags, instr.args[0].value, INSTR_FAR);
                         if (!strcmp(instr.op.name, "call"))
-                            tseg->instr_flags[instr.args[0].value] |= INSTR_FUNC;
+                            set_instr_flags(tseg->instr_flags, instr.args[0].value, INSTR_FUNC);
                         else
-                            tseg->instr_flags[instr.args[0].value] |= INSTR_JUMP;
-                        scan_segment(r->tseg, instr.args[0].value, ne);
+                            set_instr_flags(tseg->instr_flags, instr.args[0].value, INSTR_JUMP);
+                        target.cs = r->tseg;
+                        target.ip = (word)instr.args[0].value;
+                        count = 1;
                     }
 
                     break;
@@ -301,9 +341,9 @@ static void scan_segment(word cs, word ip, struct ne *ne) {
             if (instr.args[0].value < seg->min_alloc)
             {
                 if (!strcmp(instr.op.name, "call"))
-                    seg->instr_flags[instr.args[0].value] |= INSTR_FUNC;
+                    set_instr_flags(seg->instr_flags, instr.args[0].value, INSTR_FUNC);
                 else
-                    seg->instr_flags[instr.args[0].value] |= INSTR_JUMP;
+                    set_instr_flags(seg->instr_flags, instr.args[0].value, INSTR_JUMP);
             }
             else
             {
@@ -312,10 +352,12 @@ static void scan_segment(word cs, word ip, struct ne *ne) {
             }
 
             /* scan it */
-            scan_segment(cs, instr.args[0].value, ne);
+            target.cs = cs;
+            target.ip = (word)instr.args[0].value;
+            count = 1;
         }
 
-        if (instr.op.flags & OP_STOP)
+        if (worklist_branch(wl, &target, count, cs, (word)(ip + instr_length), instr.op.flags & OP_STOP))
             return;
 
         ip += instr_length;
@@ -324,7 +366,12 @@ static void scan_segment(word cs, word ip, struct ne *ne) {
     warn_at("Scan reached the end of segment.\n");
 }
 
-static void print_segment_flags(word flags) {
+static void scan_segment(struct worklist *wl, word cs, word ip, struct ne *ne) {
+    worklist_push(wl, cs, ip);
+    scan_worklist(wl, scan_run, ne);
+}
+
+static void print_segment_flags(word flags, struct output *out) {
     char buffer[1024];
 
     if (flags & 0x0001)
@@ -350,18 +397,18 @@ static void print_segment_flags(word flags) {
     if (flags & 0x2000) strcat(buffer, ", 32-bit");
 
     if (flags & 0xc608) sprintf(buffer+strlen(buffer), ", (unknown flags 0x%04x)", flags & 0xc608);
-    printf("    Flags: 0x%04x (%s)\n", flags, buffer);
+    out_printf(out, "    Flags: 0x%04x (%s)\n", flags, buffer);
 }
 
 static void read_reloc(const struct segment *seg, word index, struct ne *ne)
 {
     off_t entry = seg->start + seg->length + 2 + (index * 8);
     struct reloc *r = &seg->reloc_table[index];
-    byte size = read_byte(entry);
-    byte type = read_byte(entry + 1);
-    word offset = read_word(entry + 2);
-    word module = read_word(entry + 4); /* or segment */
-    word ordinal = read_word(entry + 6); /* or offset */
+    byte size = read_byte(ne->image, entry);
+    byte type = read_byte(ne->image, entry + 1);
+    word offset = read_word(ne->image, entry + 2);
+    word module = read_word(ne->image, entry + 4); /* or segment */
+    word ordinal = read_word(ne->image, entry + 6); /* or offset */
 
     word offset_cursor;
     word next;
@@ -371,11 +418,22 @@ static void read_reloc(const struct segment *seg, word index, struct ne *ne)
     r->size = size;
     r->type = type & 3;
 
+    if ((r->type == 1 || r->type == 2) && (!module || module > ne->header.ne_cmod)) {
+        warn("%d:%04x: Relocation to module %d, but there are only %d modules.\n",
+             seg->cs, offset, module, ne->header.ne_cmod);
+        return;
+    }
+
     if ((type & 3) == 0) {
         /* internal reference */
         char *name;
 
         if (module == 0xff) {
+            if (!ordinal || ordinal > ne->entcount) {
+                warn("%d:%04x: Relocation to entry %d, but there are only %d entries.\n",
+                     seg->cs, offset, ordinal, ne->entcount);
+                return;
+            }
             r->tseg = ne->enttab[ordinal-1].segment;
             r->toffset = ne->enttab[ordinal-1].offset;
         } else {
@@ -402,10 +460,10 @@ static void read_reloc(const struct segment *seg, word index, struct ne *ne)
     }
 
     if (type & ~7)
-        warn("%d: Relocation with unknown type flags %#x.\n", type);
+        warn("%d:%04x: Relocation with unknown type flags %#x.\n", seg->cs, offset, type);
 
     if (size != 2 && size != 3 && size != 5)
-        warn("%d: Relocation with unknown size %#x.\n", size);
+        warn("%d:%04x: Relocation with unknown size %#x.\n", seg->cs, offset, size);
 
     /* get the offset list */
     offset_cursor = offset;
@@ -418,16 +476,16 @@ static void read_reloc(const struct segment *seg, word index, struct ne *ne)
             break;
         }
 
-        if (seg->instr_flags[offset_cursor] & INSTR_RELOC) {
+        if (has_instr_flag(seg->instr_flags, offset_cursor, INSTR_RELOC)) {
             warn("%d:%04x: Infinite loop reading relocation data.\n", seg->cs, offset_cursor);
             r->offset_count = 0;
             return;
         }
 
         r->offset_count++;
-        seg->instr_flags[offset_cursor] |= INSTR_RELOC;
+        set_instr_flags(seg->instr_flags, offset_cursor, INSTR_RELOC);
 
-        next = read_word(seg->start + offset_cursor);
+        next = read_word(ne->image, seg->start + offset_cursor);
         if (type & 4)
         {
             if (!next)
@@ -450,7 +508,7 @@ static void read_reloc(const struct segment *seg, word index, struct ne *ne)
         r->offsets[r->offset_count] = offset_cursor;
         r->offset_count++;
 
-        next = read_word(seg->start + offset_cursor);
+        next = read_word(ne->image, seg->start + offset_cursor);
         if (type & 4)
         {
             if (!next)
@@ -462,6 +520,22 @@ static void read_reloc(const struct segment *seg, word index, struct ne *ne)
     } while (next < 0xfffb);
 }
 
+/* Map each relocated offset back to its relocation. If two relocations claim
+ * the same offset, the first one wins. */
+static void build_reloc_map(struct segment *seg)
+{
+    unsigned i, o;
+
+    seg->reloc_map = calloc(seg->length, sizeof(word));
+    for (i = 0; i < seg->reloc_count; i++) {
+        const struct reloc *r = &seg->reloc_table[i];
+        for (o = 0; o < r->offset_count; o++) {
+            if (!seg->reloc_map[r->offsets[o]])
+                seg->reloc_map[r->offsets[o]] = i + 1;
+        }
+    }
+}
+
 static void free_reloc(struct reloc *reloc_data, word reloc_count) {
     int i;
     for (i = 0; i < reloc_count; i++) {
@@ -471,13 +545,22 @@ static void free_reloc(struct reloc *reloc_data, word reloc_count) {
     free(reloc_data);
 }
 
-void read_segments(off_t start, struct ne *ne)
+int read_segments(off_t start, struct ne *ne)
 {
     word entry_cs = ne->header.ne_cs;
     word entry_ip = ne->header.ne_ip;
     word count = ne->header.ne_cseg;
+    struct flag_cache cache;
     struct segment *seg;
+    struct worklist wl;
     word i, j;
+    int use_cache;
+    int ret = 0;
+
+    if (image_clamp(ne->image, start, count * 8) < count * 8) {
+        warn("Segment table extends past the end of the file.\n");
+        count = ne->header.ne_cseg = image_clamp(ne->image, start, count * 8) / 8;
+    }
 
     ne->segments = malloc(count * sizeof(struct segment));
 
@@ -485,14 +568,25 @@ void read_segments(off_t start, struct ne *ne)
     {
         seg = &ne->segments[i];
         seg->cs = i + 1;
-        seg->start = read_word(start + i*8) << ne->header.ne_align;
-        seg->length = read_word(start + i*8 + 2);
-        seg->flags = read_word(start + i*8 + 4);
-        seg->min_alloc = read_word(start + i*8 + 6);
-
-        /* Use min_alloc rather than length because data can "hang over". */
-        seg->instr_flags = calloc(seg->min_alloc, sizeof(byte));
+        seg->start = read_word(ne->image, start + i*8) << ne->header.ne_align;
+        seg->length = read_word(ne->image, start + i*8 + 2);
+        seg->flags = read_word(ne->image, start + i*8 + 4);
+        seg->min_alloc = read_word(ne->image, start + i*8 + 6);
+
+        /* Use min_alloc rather than length because data can "hang over", but
+         * relocations and printing still walk the whole length. */
+        seg->instr_flags = alloc_instr_flags(max(seg->length, seg->min_alloc));
+        decode_cache_init(&seg->decoded, 0, seg->min_alloc);
+        seg->reloc_count = 0;
+        seg->reloc_table = NULL;
+        seg->reloc_map = NULL;
+        if (!seg->instr_flags) {
+            warn("Segment %d: out of memory allocating instruction flags.\n", seg->cs);
+            ret = -1;
+        }
     }
+    if (ret < 0)
+        return ret;
 
     /* First pass: just read the relocation data */
     for (i = 0; i < count; ++i)
@@ -500,25 +594,45 @@ void read_segments(off_t start, struct ne *ne)
         seg = &ne->segments[i];
 
         if (seg->flags & 0x0100) {
-            seg->reloc_count = read_word(seg->start + seg->length);
+            seg->reloc_count = read_word(ne->image, seg->start + seg->length);
             seg->reloc_table = malloc(seg->reloc_count * sizeof(struct reloc));
 
             for (j = 0; j < seg->reloc_count; j++)
                 read_reloc(seg, j, ne);
-        } else {
-            seg->reloc_count = 0;
-            seg->reloc_table = NULL;
+            build_reloc_map(seg);
+        }
+    }
+
+    /* the flags are only printed when disassembling, so that's the only time
+     * they're worth caching */
+    use_cache = cache_dir && (mode & DISASSEMBLE);
+    if (use_cache) {
+        flag_cache_init(&cache, count);
+        for (i = 0; i < count; i++) {
+            cache.flags[i] = (byte *)ne->segments[i].instr_flags;
+            cache.lengths[i] = instr_flags_size(max(ne->segments[i].length, ne->segments[i].min_alloc));
+        }
+        if (flag_cache_load(ne->image, &cache)) {
+            flag_cache_free(&cache);
+            return 0;
         }
     }
 
     /* Second pass: scan entry points (we have to do this after we read
      * relocation data for all segments.) */
+    worklist_init(&wl, SCAN_LIFO);
     for (i = 0; i < ne->entcount; i++) {
 
         /* don't scan exported values */
         if (ne->enttab[i].segment == 0 ||
             ne->enttab[i].segment == 0xfe) continue;
 
+        if (ne->enttab[i].segment > count) {
+            warn("Entry %d is in segment %d, but there are only %d segments.\n",
+                 i + 1, ne->enttab[i].segment, count);
+            continue;
+        }
+
         /* or values that live in data segments */
         if (ne->segments[ne->enttab[i].segment-1].flags & 0x0001) continue;
 
@@ -528,20 +642,40 @@ void read_segments(off_t start, struct ne *ne)
          * may potentially miss private entries, but it's better than nothing. */
         if (!(ne->enttab[i].flags & 1)) continue;
 
-        scan_segment(ne->enttab[i].segment, ne->enttab[i].offset, ne);
-        ne->segments[ne->enttab[i].segment-1].instr_flags[ne->enttab[i].offset] |= INSTR_FUNC;
+        if (ne->enttab[i].offset >= ne->segments[ne->enttab[i].segment-1].min_alloc) {
+            warn("Entry %d:%04x exceeds segment allocation (%04x).\n", ne->enttab[i].segment,
+                 ne->enttab[i].offset, ne->segments[ne->enttab[i].segment-1].min_alloc);
+            continue;
+        }
+
+        scan_segment(&wl, ne->enttab[i].segment, ne->enttab[i].offset, ne);
+        set_instr_flags(ne->segments[ne->enttab[i].segment-1].instr_flags, ne->enttab[i].offset, INSTR_FUNC);
     }
 
     /* and don't forget to scan the program entry point */
     if (entry_cs == 0 && entry_ip == 0) {
         /* do nothing */
+    } else if (!entry_cs || entry_cs > count) {
+        warn("Entry point %d:%04x is not in a segment.\n", entry_cs, entry_ip);
     } else if (entry_ip >= ne->segments[entry_cs-1].length) {
         /* see note above under relocations */
         warn("Entry point %d:%04x exceeds segment length (%04x)\n", entry_cs, entry_ip, ne->segments[entry_cs-1].length);
+    } else if (entry_ip >= ne->segments[entry_cs-1].min_alloc) {
+        warn("Entry point %d:%04x exceeds segment allocation (%04x)\n", entry_cs, entry_ip, ne->segments[entry_cs-1].min_alloc);
     } else {
-        ne->segments[entry_cs-1].instr_flags[entry_ip] |= INSTR_FUNC;
-        scan_segment(entry_cs, entry_ip, ne);
+        set_instr_flags(ne->segments[entry_cs-1].instr_flags, entry_ip, INSTR_FUNC);
+        scan_segment(&wl, entry_cs, entry_ip, ne);
+    }
+
+    worklist_free(&wl);
+    for (i = 0; i < count; i++)
+        decode_cache_finish(&ne->segments[i].decoded);
+
+    if (use_cache) {
+        flag_cache_store(ne->image, &cache);
+        flag_cache_free(&cache);
     }
+    return 0;
 }
 
 void free_segments(struct ne *ne) {
@@ -551,34 +685,44 @@ void free_segments(struct ne *ne) {
     for (cs = 1; cs <= ne->header.ne_cseg; cs++) {
         seg = &ne->segments[cs-1];
         free_reloc(seg->reloc_table, seg->reloc_count);
+        free(seg->reloc_map);
         free(seg->instr_flags);
+        decode_cache_free(&seg->decoded);
     }
 
     free(ne->segments);
 }
 
-void print_segments(struct ne *ne) {
-    unsigned cs;
-    struct segment *seg;
-
-    /* Final pass: print data */
-    for (cs = 1; cs <= ne->header.ne_cseg; cs++) {
-        seg = &ne->segments[cs-1];
+static void print_segment(unsigned i, struct output *out, void *ctx) {
+    const struct ne *ne = ctx;
+    const struct segment *seg = &ne->segments[i];
 
-        putchar('\n');
-        printf("Segment %d (start = 0x%lx, length = 0x%x, minimum allocation = 0x%x):\n",
-            cs, seg->start, seg->length, seg->min_alloc ? seg->min_alloc : 65536);
-        print_segment_flags(seg->flags);
+    out_putc(out, '\n');
+    out_printf(out, "Segment %d (start = 0x%lx, length = 0x%x, minimum allocation = 0x%x):\n",
+        seg->cs, seg->start, seg->length, seg->min_alloc ? seg->min_alloc : 65536);
+    print_segment_flags(seg->flags, out);
 
-        if (seg->flags & 0x0001) {
-            /* FIXME: We should at least make a special note of entry points. */
-            /* FIXME #2: Data segments can still have relocations... */
-            print_data(seg);
-        } else {
-            /* like objdump, print the whole code segment like a data segment */
-            if (opts & FULL_CONTENTS)
-                print_data(seg);
-            print_disassembly(seg, ne);
-        }
+    if (seg->flags & 0x0001) {
+        /* FIXME: We should at least make a special note of entry points. */
+        /* FIXME #2: Data segments can still have relocations... */
+        print_data(seg, ne, out);
+    } else {
+        /* like objdump, print the whole code segment like a data segment */
+        if (opts & FULL_CONTENTS)
+            print_data(seg, ne, out);
+        print_disassembly(seg, ne, out);
     }
 }
+
+static dword disassembly_size(unsigned i, void *ctx) {
+    const struct ne *ne = ctx;
+    const struct segment *seg = &ne->segments[i];
+
+    return (seg->flags & 0x0001) ? 0 : seg->length;
+}
+
+void print_segments(struct ne *ne) {
+    /* Final pass: print data */
+    print_in_order(ne->image, ne->header.ne_cseg, print_segment,
+        disassembly_size, ne->image->out, ne);
+}
@@ -0,0 +1,322 @@
+/*
+ * Buffered output
+ *
+ * Copyright 2017-2020 Zebediah Figura
+ *
+ * This file is part of Semblance.
+ *
+ * Semblance is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Semblance is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Semblance; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "semblance.h"
+
+/* stdio's formatting is a large part of the cost of disassembling, so the
+ * printers that run once per instruction or byte use out_putc(), out_puts()
+ * and the hex formatters here instead. out_printf() is for everything else. */
+
+void output_init(struct output *out, char *buf, size_t size, int fd)
+{
+    out->buf = buf;
+    out->len = 0;
+    out->size = size;
+    out->fd = fd;
+}
+
+static void write_all(int fd, const char *s, size_t len)
+{
+    while (len) {
+        ssize_t ret = write(fd, s, len);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("Cannot write output");
+            return;
+        }
+        s += ret;
+        len -= ret;
+    }
+}
+
+void output_flush(struct output *out)
+{
+    if (out->fd < 0)
+        return;
+    write_all(out->fd, out->buf, out->len);
+    out->len = 0;
+}
+
+/* Make room for at least len more bytes in the buffer. If we're writing to a
+ * file, that might not be possible; callers that can write directly check. */
+void output_reserve(struct output *out, size_t len)
+{
+    if (out->len + len <= out->size)
+        return;
+
+    if (out->fd >= 0) {
+        output_flush(out);
+        return;
+    }
+
+    out->size = out->size ? out->size * 2 : 4096;
+    while (out->len + len > out->size)
+        out->size *= 2;
+    out->buf = realloc(out->buf, out->size);
+}
+
+void out_write(struct output *out, const char *s, size_t len)
+{
+    output_reserve(out, len);
+    if (out->len + len > out->size) {
+        /* too big to buffer at all */
+        write_all(out->fd, s, len);
+        return;
+    }
+    memcpy(out->buf + out->len, s, len);
+    out->len += len;
+}
+
+void out_vprintf(struct output *out, const char *format, va_list args)
+{
+    va_list copy;
+    int len;
+
+    va_copy(copy, args);
+    len = vsnprintf(out->buf + out->len, out->size - out->len, format, copy);
+    va_end(copy);
+
+    if (len >= 0 && out->len + len >= out->size) {
+        /* Didn't fit (including the terminating null vsnprintf wants). */
+        char *str;
+
+        output_reserve(out, len + 1);
+        if (out->len + len >= out->size) {
+            str = malloc(len + 1);
+            vsnprintf(str, len + 1, format, args);
+            out_write(out, str, len);
+            free(str);
+            return;
+        }
+
+        vsnprintf(out->buf + out->len, out->size - out->len, format, args);
+    }
+
+    if (len > 0)
+        out->len += len;
+}
+
+void out_printf(struct output *out, const char *format, ...)
+{
+    va_list args;
+
+    va_start(args, format);
+    out_vprintf(out, format, args);
+    va_end(args);
+}
+
+__thread struct output *warn_output;
+__thread struct output *warn_stdout;
+
+/* Write out the complete lines in warn_stdout, so that a warning goes between
+ * lines rather than into the middle of one. */
+static void flush_stdout_lines(void)
+{
+    struct output *out = warn_stdout;
+    size_t len = out->len;
+
+    if (out->fd < 0)
+        return;
+    while (len && out->buf[len - 1] != '\n')
+        len--;
+    if (!len)
+        return;
+    write_all(out->fd, out->buf, len);
+    memmove(out->buf, out->buf + len, out->len - len);
+    out->len -= len;
+}
+
+void warn_printf(const char *format, ...)
+{
+    va_list args;
+
+    va_start(args, format);
+    if (warn_output)
+        out_vprintf(warn_output, format, args);
+    else {
+        if (warn_stdout)
+            flush_stdout_lines();
+        vfprintf(stderr, format, args);
+    }
+    va_end(args);
+}
+
+void warn_write(const char *s, size_t len)
+{
+    if (warn_output)
+        out_write(warn_output, s, len);
+    else if (len) {
+        if (warn_stdout)
+            flush_stdout_lines();
+        fwrite(s, 1, len, stderr);
+    }
+}
+
+static const char hex_lower[] = "0123456789abcdef";
+static const char hex_upper[] = "0123456789ABCDEF";
+
+/* Format value in hex, zero-padded to at least width digits, like "%0*lx".
+ * Returns a pointer past the last digit; the string is not terminated. */
+char *fmt_hex(char *p, qword value, int width, int upper)
+{
+    const char *digits = upper ? hex_upper : hex_lower;
+    int count = 1, i;
+    qword v;
+
+    for (v = value >> 4; v; v >>= 4)
+        count++;
+    if (count < width)
+        count = width;
+
+    for (i = count - 1; i >= 0; i--) {
+        p[i] = digits[value & 0xf];
+        value >>= 4;
+    }
+    return p + count;
+}
+
+void out_hex(struct output *out, qword value, int width)
+{
+    char str[32];
+
+    out_write(out, str, fmt_hex(str, value, width, 0) - str);
+}
+
+void out_dec(struct output *out, long value)
+{
+    char str[24], *p = str + sizeof(str);
+    unsigned long v = (value < 0) ? -(unsigned long)value : value;
+
+    do {
+        *--p = '0' + v % 10;
+        v /= 10;
+    } while (v);
+    if (value < 0)
+        *--p = '-';
+    out_write(out, p, str + sizeof(str) - p);
+}
+
+/* Hex dump lines, as used by -s: up to 16 bytes in hex, padded out to the
+ * full width, then the same bytes in ASCII with unprintable ones as dots.
+ * Printable means the same as isprint() in the C locale. */
+
+#define HEX_LINE_MAX (16 * 3 + 2 + 16 + 1)
+
+static char *fmt_hex_line_scalar(char *p, const byte *data, int len)
+{
+    int i;
+
+    for (i = 0; i < len; i++) {
+        *p++ = ' ';
+        *p++ = hex_lower[data[i] >> 4];
+        *p++ = hex_lower[data[i] & 0xf];
+    }
+    for (; i < 16; i++) {
+        *p++ = ' ';
+        *p++ = ' ';
+        *p++ = ' ';
+    }
+    *p++ = ' ';
+    *p++ = ' ';
+    for (i = 0; i < len; i++)
+        *p++ = (data[i] >= 0x20 && data[i] < 0x7f) ? data[i] : '.';
+    *p++ = '\n';
+    return p;
+}
+
+#ifdef __SSE2__
+
+static inline __m128i hex_digits(__m128i nibbles)
+{
+    /* '0' + n, plus the distance from '9'+1 to 'a' if n > 9 */
+    __m128i letters = _mm_and_si128(_mm_cmpgt_epi8(nibbles, _mm_set1_epi8(9)), _mm_set1_epi8('a' - '0' - 10));
+    return _mm_add_epi8(_mm_add_epi8(nibbles, _mm_set1_epi8('0')), letters);
+}
+
+/* Widen eight pairs of digits into " xx?" groups, one per dword. */
+static inline void store_groups(dword *groups, __m128i pairs)
+{
+    const __m128i zero = _mm_setzero_si128(), space = _mm_set1_epi32(' ');
+
+    _mm_storeu_si128((__m128i *)groups, _mm_or_si128(_mm_slli_epi32(_mm_unpacklo_epi16(pairs, zero), 8), space));
+    _mm_storeu_si128((__m128i *)(groups + 4), _mm_or_si128(_mm_slli_epi32(_mm_unpackhi_epi16(pairs, zero), 8), space));
+}
+
+/* A full line is a single vector, so the whole thing is done at once. */
+static char *fmt_hex_line_sse2(char *p, const byte *data)
+{
+    __m128i bytes = _mm_loadu_si128((const __m128i *)data);
+    __m128i hi = hex_digits(_mm_and_si128(_mm_srli_epi16(bytes, 4), _mm_set1_epi8(0xf)));
+    __m128i lo = hex_digits(_mm_and_si128(bytes, _mm_set1_epi8(0xf)));
+    __m128i printable = _mm_and_si128(_mm_cmpgt_epi8(bytes, _mm_set1_epi8(0x1f)),
+                                      _mm_cmplt_epi8(bytes, _mm_set1_epi8(0x7f)));
+    dword groups[16];
+    int i;
+
+    store_groups(groups, _mm_unpacklo_epi8(hi, lo));
+    store_groups(groups + 8, _mm_unpackhi_epi8(hi, lo));
+
+    /* Each store writes one byte too many, which the next one overwrites. */
+    for (i = 0; i < 16; i++)
+        memcpy(p + i * 3, &groups[i], 4);
+    p += 16 * 3;
+    *p++ = ' ';
+    *p++ = ' ';
+
+    _mm_storeu_si128((__m128i *)p, _mm_or_si128(_mm_and_si128(printable, bytes),
+                                                _mm_andnot_si128(printable, _mm_set1_epi8('.'))));
+    p += 16;
+    *p++ = '\n';
+    return p;
+}
+
+#endif
+
+char *fmt_hex_line(char *p, const byte *data, int len)
+{
+#ifdef __SSE2__
+    if (len == 16)
+        return fmt_hex_line_sse2(p, data);
+#endif
+    return fmt_hex_line_scalar(p, data, len);
+}
+
+void out_hex_line(struct output *out, const byte *data, int len)
+{
+    char str[HEX_LINE_MAX];
+
+    output_reserve(out, HEX_LINE_MAX);
+    if (out->len + HEX_LINE_MAX > out->size) {
+        out_write(out, str, fmt_hex_line(str, data, len) - str);
+        return;
+    }
+    out->len = fmt_hex_line(out->buf + out->len, data, len) - out->buf;
+}
@@ -2,6 +2,8 @@
 #define __PE_H
 
 #include "semblance.h"
+#include "scan.h"
+#include "specfile.h"
 
 #pragma pack(1)
 
@@ -108,7 +110,8 @@ struct section {
     dword flags;            /* 24 */
 
     /* and our data: */
-    byte *instr_flags;
+    qword *instr_flags;     /* see scan.h */
+    struct decode_cache decoded;
 };
 
 struct reloc_pe
@@ -125,22 +128,45 @@ struct export {
     const char *name;
 };
 
+struct import_name {
+    union
+    {
+        const char *name;
+        word ordinal;
+    };
+    int is_ordinal;
+    char *ordinal_name;     /* "module.ordinal", if is_ordinal */
+    const char *spec_name;  /* name from the module's specfile, if is_ordinal */
+};
+
 struct import_module {
     const char *module;
     dword iat_addr;
-    struct
-    {
-        union
-        {
-            const char *name;
-            word ordinal;
-        };
-        int is_ordinal;
-    } *nametab;
+    struct import_name *nametab;
+    unsigned count;
+    const struct specfile *spec;    /* if imported by ordinal */
+};
+
+/* The name to print for an import, preferring one from a specfile to the
+ * bare ordinal. */
+static inline const char *get_import_name(const struct import_name *import)
+{
+    if (!import->is_ordinal)
+        return import->name;
+    return import->spec_name ? import->spec_name : import->ordinal_name;
+}
+
+/* sorted lookup table for addr2section() */
+struct section_map {
+    struct section **sections;  /* sorted by address, empty sections omitted */
     unsigned count;
+    int overlap;                /* sections overlap; search them in order */
+    struct section *last;       /* last section found */
 };
 
 struct pe {
+    const struct image *image;
+
     word magic; /* same as opt->Magic field, but avoids casting */
     qword imagebase; /* same as opt->ImageBase field, but simpler */
 
@@ -152,23 +178,82 @@ struct pe {
     const struct directory *dirs;
 
     const char *name;
+    int rel_addr;   /* print addresses relative to the image base */
 
     struct section *sections;
+    struct section_map *section_map;
+    const byte *view;           /* the sections laid out by address, or NULL */
+    dword view_size;
 
     struct export *exports;
     unsigned export_count;
+    unsigned *export_hash;      /* open-addressed by address; index + 1 */
+    unsigned export_hash_bits;
 
     struct import_module *imports;
     unsigned import_count;
+    const char **import_slots;  /* imported name of each IAT slot */
+    dword import_base;          /* address of the first slot */
+    unsigned import_slot_count;
 
     struct reloc_pe *relocs;
     unsigned reloc_count;
 };
 
 /* in pe_section.c */
+extern void build_section_map(struct pe *pe);
+extern void free_section_map(struct pe *pe);
 extern struct section *addr2section(dword addr, const struct pe *pe);
 extern off_t addr2offset(dword addr, const struct pe *pe);
+extern unsigned hash_address(dword addr, unsigned bits);
 extern void read_sections(struct pe *pe);
 extern void print_sections(struct pe *pe);
+extern void map_sections(struct pe *pe);
+
+/* Reading by address: pos bytes into the table or string at addr. With a view
+ * (see map_sections()), this is just pointer arithmetic. Otherwise addr is
+ * looked up in the section table and pos is added to the file offset, so that
+ * a table which runs past the end of its section keeps reading the file, the
+ * same as it always has. Data from read_rva() lasts as long as the image. */
+
+static inline const void *read_rva(const struct pe *pe, dword addr, dword pos)
+{
+    if ((qword)addr + pos < pe->view_size)
+        return pe->view + addr + pos;
+    return read_data(pe->image, addr2offset(addr, pe) + pos);
+}
+
+static inline word read_rva_word(const struct pe *pe, dword addr, dword pos)
+{
+    word value;
+
+    if ((qword)addr + pos + sizeof(value) <= pe->view_size) {
+        memcpy(&value, pe->view + addr + pos, sizeof(value));
+        return value;
+    }
+    return read_word(pe->image, addr2offset(addr, pe) + pos);
+}
+
+static inline dword read_rva_dword(const struct pe *pe, dword addr, dword pos)
+{
+    dword value;
+
+    if ((qword)addr + pos + sizeof(value) <= pe->view_size) {
+        memcpy(&value, pe->view + addr + pos, sizeof(value));
+        return value;
+    }
+    return read_dword(pe->image, addr2offset(addr, pe) + pos);
+}
+
+static inline qword read_rva_qword(const struct pe *pe, dword addr, dword pos)
+{
+    qword value;
+
+    if ((qword)addr + pos + sizeof(value) <= pe->view_size) {
+        memcpy(&value, pe->view + addr + pos, sizeof(value));
+        return value;
+    }
+    return read_qword(pe->image, addr2offset(addr, pe) + pos);
+}
 
 #endif /* __PE_H */
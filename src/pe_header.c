@@ -20,13 +20,14 @@
  * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
  */
 
+#include <ctype.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include "semblance.h"
 #include "pe.h"
 
-static void print_flags(word flags) {
+static void print_flags(word flags, struct output *out) {
     char buffer[1024] = "";
 
     if (flags & 0x0001) strcat(buffer, ", relocations stripped");
@@ -46,10 +47,10 @@ static void print_flags(word flags) {
     if (flags & 0x4000) strcat(buffer, ", uniprocessor");
     if (flags & 0x8000) strcat(buffer, ", big-endian");
 
-    printf("Flags: 0x%04x (%s)\n", flags, buffer+2);
+    out_printf(out, "Flags: 0x%04x (%s)\n", flags, buffer+2);
 }
 
-static void print_dll_flags(word flags) {
+static void print_dll_flags(word flags, struct output *out) {
     char buffer[1024] = "";
 
     if (flags & 0x0001) strcat(buffer, ", per-process initialization");
@@ -66,7 +67,7 @@ static void print_dll_flags(word flags) {
     if (flags & 0x8000) strcat(buffer, ", terminal server aware");
     if (flags & 0x5030) sprintf(buffer+strlen(buffer), ", (unknown flags 0x%04x)", flags & 0x5030);
 
-    printf("DLL flags: 0x%04x (%s)\n", flags, buffer+2);
+    out_printf(out, "DLL flags: 0x%04x (%s)\n", flags, buffer+2);
 }
 
 static const char *const subsystems[] = {
@@ -90,109 +91,127 @@ static const char *const subsystems[] = {
     0
 };
 
-static void print_opt32(const struct optional_header *opt)
+static void print_opt32(const struct optional_header *opt, const struct pe *pe)
 {
-    printf("File version: %d.%d\n", opt->MajorImageVersion, opt->MinorImageVersion); /* 44 */
+    out_printf(pe->image->out, "File version: %d.%d\n", opt->MajorImageVersion, opt->MinorImageVersion); /* 44 */
 
-    printf("Linker version: %d.%d\n", opt->MajorLinkerVersion, opt->MinorLinkerVersion); /* 1a */
+    out_printf(pe->image->out, "Linker version: %d.%d\n", opt->MajorLinkerVersion, opt->MinorLinkerVersion); /* 1a */
 
     if (opt->AddressOfEntryPoint) {
         dword address = opt->AddressOfEntryPoint;
-        if (!pe_rel_addr)
+        if (!pe->rel_addr)
             address += opt->ImageBase;
-        printf("Program entry point: 0x%x\n", address); /* 28 */
+        out_printf(pe->image->out, "Program entry point: 0x%x\n", address); /* 28 */
     }
 
-    printf("Base of code section: 0x%x\n", opt->BaseOfCode); /* 2c */
-    printf("Base of data section: 0x%x\n", opt->BaseOfData); /* 30 */
+    out_printf(pe->image->out, "Base of code section: 0x%x\n", opt->BaseOfCode); /* 2c */
+    out_printf(pe->image->out, "Base of data section: 0x%x\n", opt->BaseOfData); /* 30 */
 
-    printf("Preferred base address: 0x%x\n", opt->ImageBase); /* 34 */
-    printf("Required OS version: %d.%d\n", opt->MajorOperatingSystemVersion, opt->MinorOperatingSystemVersion); /* 40 */
+    out_printf(pe->image->out, "Preferred base address: 0x%x\n", opt->ImageBase); /* 34 */
+    out_printf(pe->image->out, "Required OS version: %d.%d\n", opt->MajorOperatingSystemVersion, opt->MinorOperatingSystemVersion); /* 40 */
 
     if (opt->Win32VersionValue != 0)
         warn("Win32VersionValue is %d (expected 0)\n", opt->Win32VersionValue); /* 4c */
 
     if (opt->Subsystem <= 16) /* 5c */
-        printf("Subsystem: %s\n", subsystems[opt->Subsystem]);
+        out_printf(pe->image->out, "Subsystem: %s\n", subsystems[opt->Subsystem]);
     else
-        printf("Subsystem: (unknown value %d)\n", opt->Subsystem);
-    printf("Subsystem version: %d.%d\n", opt->MajorSubsystemVersion, opt->MinorSubsystemVersion); /* 48 */
+        out_printf(pe->image->out, "Subsystem: (unknown value %d)\n", opt->Subsystem);
+    out_printf(pe->image->out, "Subsystem version: %d.%d\n", opt->MajorSubsystemVersion, opt->MinorSubsystemVersion); /* 48 */
 
-    print_dll_flags(opt->DllCharacteristics); /* 5e */
+    print_dll_flags(opt->DllCharacteristics, pe->image->out); /* 5e */
 
-    printf("Stack size (reserve): %d bytes\n", opt->SizeOfStackReserve); /* 60 */
-    printf("Stack size (commit): %d bytes\n", opt->SizeOfStackCommit); /* 64 */
-    printf("Heap size (reserve): %d bytes\n", opt->SizeOfHeapReserve); /* 68 */
-    printf("Heap size (commit): %d bytes\n", opt->SizeOfHeapCommit); /* 6c */
+    out_printf(pe->image->out, "Stack size (reserve): %d bytes\n", opt->SizeOfStackReserve); /* 60 */
+    out_printf(pe->image->out, "Stack size (commit): %d bytes\n", opt->SizeOfStackCommit); /* 64 */
+    out_printf(pe->image->out, "Heap size (reserve): %d bytes\n", opt->SizeOfHeapReserve); /* 68 */
+    out_printf(pe->image->out, "Heap size (commit): %d bytes\n", opt->SizeOfHeapCommit); /* 6c */
 
     if (opt->LoaderFlags != 0)
         warn("LoaderFlags is 0x%x (expected 0)\n", opt->LoaderFlags); /* 70 */
 }
 
-static void print_opt64(const struct optional_header_pep *opt)
+static void print_opt64(const struct optional_header_pep *opt, const struct pe *pe)
 {
-    printf("File version: %d.%d\n", opt->MajorImageVersion, opt->MinorImageVersion); /* 44 */
+    out_printf(pe->image->out, "File version: %d.%d\n", opt->MajorImageVersion, opt->MinorImageVersion); /* 44 */
 
-    printf("Linker version: %d.%d\n", opt->MajorLinkerVersion, opt->MinorLinkerVersion); /* 1a */
+    out_printf(pe->image->out, "Linker version: %d.%d\n", opt->MajorLinkerVersion, opt->MinorLinkerVersion); /* 1a */
 
     if (opt->AddressOfEntryPoint) {
         dword address = opt->AddressOfEntryPoint;
-        if (!pe_rel_addr)
+        if (!pe->rel_addr)
             address += opt->ImageBase;
-        printf("Program entry point: 0x%x\n", address); /* 28 */
+        out_printf(pe->image->out, "Program entry point: 0x%x\n", address); /* 28 */
     }
 
-    printf("Base of code section: 0x%x\n", opt->BaseOfCode); /* 2c */
+    out_printf(pe->image->out, "Base of code section: 0x%x\n", opt->BaseOfCode); /* 2c */
 
-    printf("Preferred base address: 0x%lx\n", opt->ImageBase); /* 30 */
-    printf("Required OS version: %d.%d\n", opt->MajorOperatingSystemVersion, opt->MinorOperatingSystemVersion); /* 40 */
+    out_printf(pe->image->out, "Preferred base address: 0x%lx\n", opt->ImageBase); /* 30 */
+    out_printf(pe->image->out, "Required OS version: %d.%d\n", opt->MajorOperatingSystemVersion, opt->MinorOperatingSystemVersion); /* 40 */
 
     if (opt->Win32VersionValue != 0)
         warn("Win32VersionValue is %d (expected 0)\n", opt->Win32VersionValue); /* 4c */
 
     if (opt->Subsystem <= 16) /* 5c */
-        printf("Subsystem: %s\n", subsystems[opt->Subsystem]);
+        out_printf(pe->image->out, "Subsystem: %s\n", subsystems[opt->Subsystem]);
     else
-        printf("Subsystem: (unknown value %d)\n", opt->Subsystem);
-    printf("Subsystem version: %d.%d\n", opt->MajorSubsystemVersion, opt->MinorSubsystemVersion); /* 48 */
+        out_printf(pe->image->out, "Subsystem: (unknown value %d)\n", opt->Subsystem);
+    out_printf(pe->image->out, "Subsystem version: %d.%d\n", opt->MajorSubsystemVersion, opt->MinorSubsystemVersion); /* 48 */
 
-    print_dll_flags(opt->DllCharacteristics); /* 5e */
+    print_dll_flags(opt->DllCharacteristics, pe->image->out); /* 5e */
 
-    printf("Stack size (reserve): %ld bytes\n", opt->SizeOfStackReserve); /* 60 */
-    printf("Stack size (commit): %ld bytes\n", opt->SizeOfStackCommit); /* 68 */
-    printf("Heap size (reserve): %ld bytes\n", opt->SizeOfHeapReserve); /* 70 */
-    printf("Heap size (commit): %ld bytes\n", opt->SizeOfHeapCommit); /* 78 */
+    out_printf(pe->image->out, "Stack size (reserve): %ld bytes\n", opt->SizeOfStackReserve); /* 60 */
+    out_printf(pe->image->out, "Stack size (commit): %ld bytes\n", opt->SizeOfStackCommit); /* 68 */
+    out_printf(pe->image->out, "Heap size (reserve): %ld bytes\n", opt->SizeOfHeapReserve); /* 70 */
+    out_printf(pe->image->out, "Heap size (commit): %ld bytes\n", opt->SizeOfHeapCommit); /* 78 */
 
     if (opt->LoaderFlags != 0)
         warn("LoaderFlags is 0x%x (expected 0)\n", opt->LoaderFlags); /* 80 */
 }
 
 static void print_header(struct pe *pe) {
-    putchar('\n');
+    out_putc(pe->image->out, '\n');
 
     if (!pe->header->SizeOfOptionalHeader) {
-        printf("No optional header\n");
+        out_printf(pe->image->out, "No optional header\n");
         return;
     } else if (pe->header->SizeOfOptionalHeader < sizeof(struct optional_header))
         warn("Size of optional header is %u (expected at least %lu).\n",
             pe->header->SizeOfOptionalHeader, sizeof(struct optional_header));
 
-    print_flags(pe->header->Characteristics); /* 16 */
+    print_flags(pe->header->Characteristics, pe->image->out); /* 16 */
 
     if (pe->magic == 0x10b) {
-        printf("Image type: 32-bit\n");
-        print_opt32(pe->opt32);
+        out_printf(pe->image->out, "Image type: 32-bit\n");
+        print_opt32(pe->opt32, pe);
     } else if (pe->magic == 0x20b) {
-        printf("Image type: 64-bit\n");
-        print_opt64(pe->opt64);
+        out_printf(pe->image->out, "Image type: 64-bit\n");
+        print_opt64(pe->opt64, pe);
     }
 }
 
+/* Specfiles are named after the module in upper case and without any
+ * extension, the way NE module names are; e.g. KERNEL32.dll has KERNEL32.ORD. */
+static void get_spec_module(char *buffer, size_t size, const char *module)
+{
+    size_t i;
+
+    for (i = 0; i + 1 < size && module[i] && module[i] != '.'; i++)
+        buffer[i] = toupper((unsigned char)module[i]);
+    buffer[i] = 0;
+}
+
 static void print_specfile(struct pe *pe) {
     int i;
     FILE *specfile;
-    char *spec_name = malloc(strlen(pe->name) + 4);
-    sprintf(spec_name, "%s.ord", pe->name);
+    char spec_name[300];
+
+    if (!pe->name) {
+        fprintf(stderr, "No export table; can't create a specfile.\n");
+        return;
+    }
+
+    get_spec_module(spec_name, sizeof(spec_name) - 4, pe->name);
+    strcat(spec_name, ".ORD");
     specfile = fopen(spec_name, "w");
 
     if (!specfile) {
@@ -203,8 +222,12 @@ static void print_specfile(struct pe *pe) {
     fprintf(specfile, "#Generated by dump -o\n");
     for (i = 0; i < pe->export_count; i++)
     {
-        if (pe->exports[i].address)
+        if (!pe->exports[i].address)
+            continue;
+        if (pe->exports[i].name)
             fprintf(specfile, "%d\t%s\n", pe->exports[i].ordinal, pe->exports[i].name);
+        else
+            fprintf(specfile, "%d\n", pe->exports[i].ordinal);
     }
     fclose(specfile);
 }
@@ -225,19 +248,41 @@ struct export_header {
 
 STATIC_ASSERT(sizeof(struct export_header) == 0x28);
 
+/* Index the exports by address, keeping the first export at each address,
+ * which is the one a linear search would find. */
+static void build_export_hash(struct pe *pe)
+{
+    unsigned bits = 4, mask, i;
+
+    while ((1u << bits) < pe->export_count * 2)
+        bits++;
+    mask = (1u << bits) - 1;
+
+    pe->export_hash = calloc(1u << bits, sizeof(*pe->export_hash));
+    pe->export_hash_bits = bits;
+
+    for (i = 0; i < pe->export_count; i++)
+    {
+        unsigned h = hash_address(pe->exports[i].address, bits);
+
+        while (pe->export_hash[h] && pe->exports[pe->export_hash[h] - 1].address != pe->exports[i].address)
+            h = (h + 1) & mask;
+        if (!pe->export_hash[h])
+            pe->export_hash[h] = i + 1;
+    }
+}
+
 static void get_export_table(struct pe *pe)
 {
     const struct export_header *header;
-    off_t offset;
     int i;
 
     /* More headers. It's like a PE file is nothing but headers.
      * Do we really need to print any of this? No, not really. Just use the data. */
-    header = read_data(addr2offset(pe->dirs[0].address, pe));
-    offset = addr2offset(header->addr_table_addr, pe);
+    header = read_rva(pe, pe->dirs[0].address, 0);
 
     /* Grab the name. */
-    pe->name = read_data(addr2offset(header->module_name_addr, pe));
+    pe->name = read_rva(pe, header->module_name_addr, 0);
 
     /* Grab the exports. */
     pe->exports = malloc(header->addr_table_count * sizeof(struct export));
@@ -248,142 +293,248 @@ static void get_export_table(struct pe *pe)
     for (i = 0; i < header->addr_table_count; ++i)
     {
         pe->exports[i].ordinal = i + header->ordinal_base;
-        pe->exports[i].address = read_dword(offset + i * 4);
+        pe->exports[i].address = read_rva_dword(pe, header->addr_table_addr, i * 4);
         pe->exports[i].name = NULL;
     }
 
     /* Why? WHY? */
     for (i = 0; i < header->export_count; ++i)
     {
-        word index = read_word(addr2offset(header->ord_table_addr, pe) + (i * sizeof(word)));
-        dword name_addr = read_dword(addr2offset(header->name_table_addr, pe) + (i * sizeof(dword)));
-        pe->exports[index].name = read_data(addr2offset(name_addr, pe));
+        word index = read_rva_word(pe, header->ord_table_addr, i * sizeof(word));
+        dword name_addr = read_rva_dword(pe, header->name_table_addr, i * sizeof(dword));
+        pe->exports[index].name = read_rva(pe, name_addr, 0);
     }
 
     pe->export_count = header->addr_table_count;
+
+    build_export_hash(pe);
 }
 
 static void get_import_name_table(struct import_module *module, dword nametab_addr, struct pe *pe)
 {
-    off_t offset = addr2offset(nametab_addr, pe);
     unsigned i, count;
+    int spec_loaded = 0;
 
     count = 0;
     if (pe->magic == 0x10b)
-        while (read_dword(offset + count * 4)) count++;
+        while (read_rva_dword(pe, nametab_addr, count * 4)) count++;
     else
-        while (read_qword(offset + count * 8)) count++;
+        while (read_rva_qword(pe, nametab_addr, count * 8)) count++;
 
     module->nametab = malloc(count * sizeof(*module->nametab));
+    module->spec = NULL;
 
     for (i = 0; i < count; i++) {
         qword address;
         if (pe->magic == 0x10b)
         {
-            address = read_dword(offset + i * 4);
+            address = read_rva_dword(pe, nametab_addr, i * 4);
             module->nametab[i].is_ordinal = !!(address & (1u << 31));
         }
         else
         {
-            address = read_qword(offset + i * 8);
+            address = read_rva_qword(pe, nametab_addr, i * 8);
             module->nametab[i].is_ordinal = !!(address & (1ull << 63));
         }
         if (module->nametab[i].is_ordinal)
+        {
             module->nametab[i].ordinal = (word)address;
+            module->nametab[i].ordinal_name = malloc(strlen(module->module) + 7);
+            sprintf(module->nametab[i].ordinal_name, "%s.%u", module->module, module->nametab[i].ordinal);
+
+            /* Only look for a specfile if the module is imported by ordinal,
+             * and only once. */
+            if ((mode & DISASSEMBLE) && !spec_loaded)
+            {
+                char spec_module[300];
+
+                get_spec_module(spec_module, sizeof(spec_module), module->module);
+                module->spec = get_specfile(spec_module);
+                spec_loaded = 1;
+            }
+            module->nametab[i].spec_name = specfile_name(module->spec, module->nametab[i].ordinal);
+        }
         else
-            module->nametab[i].name = read_data(addr2offset(address, pe) + 2); /* skip hint */
+        {
+            module->nametab[i].name = read_rva(pe, address, 2); /* skip hint */
+            module->nametab[i].ordinal_name = NULL;
+            module->nametab[i].spec_name = NULL;
+        }
     }
     module->count = count;
 }
 
+/* Map each IAT slot directly to the name imported through it. This only works
+ * if every module's IAT is aligned to the same slot grid and the IATs aren't
+ * spread too far apart; otherwise get_imported_name() searches the modules. */
+static void build_import_slots(struct pe *pe)
+{
+    unsigned slot_size = (pe->magic == 0x10b) ? sizeof(dword) : sizeof(qword);
+    qword end = 0, total = 0;
+    dword base = ~0u;
+    int i;
+    unsigned j;
+
+    for (i = 0; i < pe->import_count; i++)
+    {
+        qword module_end = pe->imports[i].iat_addr + (qword)pe->imports[i].count * slot_size;
+
+        if (!pe->imports[i].count) continue;
+        base = min(base, pe->imports[i].iat_addr);
+        if (module_end > end) end = module_end;
+        total += pe->imports[i].count;
+    }
+    if (!total || end > 0xffffffffull) return;
+
+    for (i = 0; i < pe->import_count; i++)
+    {
+        if (pe->imports[i].count && (pe->imports[i].iat_addr - base) % slot_size)
+            return;
+    }
+
+    if ((end - base) / slot_size > total * 4 + 1024)
+        return;
+
+    pe->import_base = base;
+    pe->import_slot_count = (end - base) / slot_size;
+    pe->import_slots = calloc(pe->import_slot_count, sizeof(*pe->import_slots));
+
+    /* Fill in reverse, so that the first module wins if any overlap. */
+    for (i = pe->import_count - 1; i >= 0; i--)
+    {
+        struct import_module *module = &pe->imports[i];
+        unsigned first = (module->iat_addr - base) / slot_size;
+
+        for (j = 0; j < module->count; j++)
+        {
+            pe->import_slots[first + j] = get_import_name(&module->nametab[j]);
+        }
+    }
+}
+
 static void get_import_module_table(struct pe *pe) {
-    off_t offset = addr2offset(pe->dirs[1].address, pe);
+    dword addr = pe->dirs[1].address;
     static const dword zeroes[5] = {0};
     int i;
 
     pe->import_count = 0;
-    while (memcmp(read_data(offset + pe->import_count * 20), zeroes, 20))
+    while (memcmp(read_rva(pe, addr, pe->import_count * 20), zeroes, 20))
         pe->import_count++;
 
     pe->imports = malloc(pe->import_count * sizeof(struct import_module));
 
     for (i = 0; i < pe->import_count; i++)
     {
-        pe->imports[i].module = read_data(addr2offset(read_dword(offset + i * 20 + 12), pe));
-        pe->imports[i].iat_addr = read_dword(offset + i * 20 + 16);
-        get_import_name_table(&pe->imports[i], read_dword(offset + i * 20), pe);
+        pe->imports[i].module = read_rva(pe, read_rva_dword(pe, addr, i * 20 + 12), 0);
+        pe->imports[i].iat_addr = read_rva_dword(pe, addr, i * 20 + 16);
+        get_import_name_table(&pe->imports[i], read_rva_dword(pe, addr, i * 20), pe);
     }
+
+    build_import_slots(pe);
+}
+
+static int compare_relocs(const void *a, const void *b)
+{
+    const struct reloc_pe *ra = a, *rb = b;
+
+    if (ra->offset != rb->offset)
+        return (ra->offset < rb->offset) ? -1 : 1;
+    /* Sort padding after any real relocation at the same address. */
+    return (ra->type == 0) - (rb->type == 0);
 }
 
 static void get_reloc_table(struct pe *pe) {
-    off_t offset = addr2offset(pe->dirs[5].address, pe), cursor = offset;
+    dword start = pe->dirs[5].address;
+    qword cursor = 0;
     unsigned i, reloc_idx = 0;
 
     pe->reloc_count = 0;
-    while (cursor < offset + pe->dirs[5].size)
+    while (cursor < pe->dirs[5].size)
     {
-        pe->reloc_count += (read_dword(cursor + 4) - 8) / 2;
-        cursor += read_dword(cursor + 4);
+        dword block_size = read_rva_dword(pe, start, cursor + 4);
+
+        /* a block too small to hold its own header is corrupt */
+        if (block_size < 8)
+            break;
+        pe->reloc_count += (block_size - 8) / 2;
+        cursor += block_size;
     }
 
     pe->relocs = malloc(pe->reloc_count * sizeof(*pe->relocs));
-    cursor = offset;
-    while (cursor < offset + pe->dirs[5].size)
+    cursor = 0;
+    while (cursor < pe->dirs[5].size)
     {
-        dword block_base = read_dword(cursor);
-        dword block_size = read_dword(cursor + 4);
+        dword block_base = read_rva_dword(pe, start, cursor);
+        dword block_size = read_rva_dword(pe, start, cursor + 4);
 
+        if (block_size < 8)
+            break;
         for (i = 0; i < (block_size - 8) / 2; ++i)
         {
-            word r = read_word(cursor + 8 + i * 2);
+            word r = read_rva_word(pe, start, cursor + 8 + i * 2);
             pe->relocs[reloc_idx].offset = block_base + (r & 0xfff);
             pe->relocs[reloc_idx].type = r >> 12;
             reloc_idx++;
         }
         cursor += block_size;
     }
+
+    /* Sort by address, so that get_reloc() can do a binary search. */
+    qsort(pe->relocs, pe->reloc_count, sizeof(*pe->relocs), compare_relocs);
 }
 
-static void readpe(off_t offset_pe, struct pe *pe)
+static int readpe(off_t offset_pe, struct pe *pe)
 {
     off_t offset;
     int i, cdirs;
+    int ret = 0;
 
-    pe->header = read_data(offset_pe + 4);
-    pe->magic = read_word(offset_pe + 4 + sizeof(struct file_header));
+    pe->header = read_data(pe->image, offset_pe + 4);
+    pe->magic = read_word(pe->image, offset_pe + 4 + sizeof(struct file_header));
     if (pe->magic == 0x10b)
     {
-        pe->opt32 = read_data(offset_pe + 4 + sizeof(struct file_header));
+        pe->opt32 = read_data(pe->image, offset_pe + 4 + sizeof(struct file_header));
         pe->imagebase = pe->opt32->ImageBase;
         cdirs = pe->opt32->NumberOfRvaAndSizes;
         offset = offset_pe + 4 + sizeof(struct file_header) + sizeof(struct optional_header);
     } else if (pe->magic == 0x20b) {
-        pe->opt64 = read_data(offset_pe + 4 + sizeof(struct file_header));
+        pe->opt64 = read_data(pe->image, offset_pe + 4 + sizeof(struct file_header));
         pe->imagebase = pe->opt64->ImageBase;
         cdirs = pe->opt64->NumberOfRvaAndSizes;
         offset = offset_pe + 4 + sizeof(struct file_header) + sizeof(struct optional_header_pep);
     } else {
         warn("Don't know how to read image type %#x\n", pe->magic);
-        exit(1);
+        return -1;
     }
 
-    pe->dirs = read_data(offset);
+    pe->dirs = read_data(pe->image, offset);
     offset += cdirs * sizeof(struct directory);
 
     /* read the section table */
     pe->sections = malloc(pe->header->NumberOfSections * sizeof(struct section));
     for (i = 0; i < pe->header->NumberOfSections; i++)
     {
-        memcpy(&pe->sections[i], read_data(offset + i*0x28), 0x28);
+        memcpy(&pe->sections[i], read_data(pe->image, offset + i*0x28), 0x28);
+        decode_cache_init(&pe->sections[i].decoded, pe->sections[i].address, pe->sections[i].min_alloc);
 
         /* allocate zeroes, but only if it's a code section */
         /* in theory nobody will ever try to jump into a data section.
          * VirtualProtect() be damned */
         if (pe->sections[i].flags & 0x20)
-            pe->sections[i].instr_flags = calloc(pe->sections[i].min_alloc, sizeof(byte));
+            pe->sections[i].instr_flags = alloc_instr_flags(pe->sections[i].min_alloc);
         else
             pe->sections[i].instr_flags = NULL;
+        if ((pe->sections[i].flags & 0x20) && !pe->sections[i].instr_flags) {
+            warn("Section %.8s: out of memory allocating instruction flags for %#x bytes.\n",
+                 pe->sections[i].name, pe->sections[i].min_alloc);
+            ret = -1;
+        }
     }
+    if (ret < 0)
+        return ret;
+    build_section_map(pe);
+    if (pe_map_sections)
+        map_sections(pe);
 
     /* Read the Data Directories.
      * PE is bizarre. It tries to make all of these things generic by putting
@@ -400,26 +551,45 @@ static void readpe(off_t offset_pe, struct pe *pe)
     /* Read the code. */
     if (mode & DISASSEMBLE)
         read_sections(pe);
+
+    return 0;
 }
 
 static void freepe(struct pe *pe) {
-    int i;
+    int i, j;
 
-    for (i = 0; i < pe->header->NumberOfSections; i++)
-        free(pe->sections[i].instr_flags);
+    if (pe->sections)
+        for (i = 0; i < pe->header->NumberOfSections; i++)
+        {
+            free(pe->sections[i].instr_flags);
+            decode_cache_free(&pe->sections[i].decoded);
+        }
+    free_section_map(pe);
+    if (pe->view)
+        image_unmap_virtual(pe->view, pe->view_size);
     free(pe->sections);
     free(pe->exports);
+    free(pe->export_hash);
     for (i = 0; i < pe->import_count; i++)
+    {
+        for (j = 0; j < pe->imports[i].count; j++)
+            free(pe->imports[i].nametab[j].ordinal_name);
         free(pe->imports[i].nametab);
+    }
+    free(pe->import_slots);
     free(pe->relocs);
     free(pe->imports);
 }
 
-void dumppe(off_t offset_pe) {
+void dumppe(const struct image *image, off_t offset_pe) {
     struct pe pe = {0};
     int i, j;
 
-    readpe(offset_pe, &pe);
+    pe.image = image;
+    if (readpe(offset_pe, &pe) < 0) {
+        freepe(&pe);
+        return;
+    }
 
     if (mode == SPECFILE) {
         print_specfile(&pe);
@@ -443,56 +613,58 @@ void dumppe(off_t offset_pe) {
      * Internally we want to use relative IPs everywhere possible. The only place
      * that we can't is in arg->value. */
     if (pe_rel_addr == -1)
-        pe_rel_addr = pe.header->Characteristics & 0x2000;
+        pe.rel_addr = pe.header->Characteristics & 0x2000;
+    else
+        pe.rel_addr = pe_rel_addr;
 
-    printf("Module type: PE (Portable Executable)\n");
-    if (pe.name) printf("Module name: %s\n", pe.name);
+    out_printf(image->out, "Module type: PE (Portable Executable)\n");
+    if (pe.name) out_printf(image->out, "Module name: %s\n", pe.name);
 
     if (mode & DUMPHEADER)
         print_header(&pe);
 
     if (mode & DUMPEXPORT) {
-        putchar('\n');
+        out_putc(image->out, '\n');
         if (pe.exports) {
-            printf("Exports:\n");
+            out_printf(image->out, "Exports:\n");
 
             for (i = 0; i < pe.export_count; i++) {
                 dword address = pe.exports[i].address;
                 if (!address)
                     continue;
-                if (!pe_rel_addr)
+                if (!pe.rel_addr)
                     address += pe.imagebase;
-                printf("\t%5d\t%#8x\t%s", pe.exports[i].ordinal, address,
+                out_printf(image->out, "\t%5d\t%#8x\t%s", pe.exports[i].ordinal, address,
                     pe.exports[i].name ? pe.exports[i].name : "<no name>");
                 if (pe.exports[i].address >= pe.dirs[0].address
                         && pe.exports[i].address < (pe.dirs[0].address + pe.dirs[0].size))
-                    printf(" -> %s", (const char *)read_data(addr2offset(pe.exports[i].address, &pe)));
-                putchar('\n');
+                    out_printf(image->out, " -> %s", (const char *)read_rva(&pe, pe.exports[i].address, 0));
+                out_putc(image->out, '\n');
             }
         } else
-            printf("No export table\n");
+            out_printf(image->out, "No export table\n");
     }
 
     if (mode & DUMPIMPORT) {
-        putchar('\n');
+        out_putc(image->out, '\n');
         if (pe.imports) {
-            printf("Imported modules:\n");
+            out_printf(image->out, "Imported modules:\n");
             for (i = 0; i < pe.import_count; i++)
-                printf("\t%s\n", pe.imports[i].module);
+                out_printf(image->out, "\t%s\n", pe.imports[i].module);
 
-            printf("\nImported functions:\n");
+            out_printf(image->out, "\nImported functions:\n");
             for (i = 0; i < pe.import_count; i++) {
-                printf("\t%s:\n", pe.imports[i].module);
+                out_printf(image->out, "\t%s:\n", pe.imports[i].module);
                 for (j = 0; j < pe.imports[i].count; j++)
                 {
                     if (pe.imports[i].nametab[j].is_ordinal)
-                        printf("\t\t<ordinal %u>\n", pe.imports[i].nametab[j].ordinal);
+                        out_printf(image->out, "\t\t<ordinal %u>\n", pe.imports[i].nametab[j].ordinal);
                     else
-                        printf("\t\t%s\n", pe.imports[i].nametab[j].name);
+                        out_printf(image->out, "\t\t%s\n", pe.imports[i].nametab[j].name);
                 }
             }
         } else
-            printf("No imported module table\n");
+            out_printf(image->out, "No imported module table\n");
     }
 
     if (mode & DISASSEMBLE)
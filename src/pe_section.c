@@ -20,29 +20,108 @@
  * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
  */
 
-#include <ctype.h>
+#include <stdlib.h>
 #include <string.h>
 #include "semblance.h"
 #include "pe.h"
+#include "cache.h"
+#include "scan.h"
+#include "sweep.h"
 #include "x86_instr.h"
 
 #ifdef USE_WARN
 #define warn_at(...) \
-    do { fprintf(stderr, "Warning: %x: ", ip); \
-        fprintf(stderr, __VA_ARGS__); } while(0)
+    do { warn_printf("Warning: %x: ", ip); \
+        warn_printf(__VA_ARGS__); } while(0)
 #else
 #define warn_at(...)
 #endif
 
 int pe_rel_addr = -1;
+int pe_map_sections;
+
+static int compare_sections(const void *a, const void *b)
+{
+    const struct section *sa = *(const struct section **)a;
+    const struct section *sb = *(const struct section **)b;
+
+    if (sa->address != sb->address)
+        return (sa->address < sb->address) ? -1 : 1;
+    return (sa < sb) ? -1 : (sa > sb);
+}
+
+void build_section_map(struct pe *pe) {
+    struct section_map *map = calloc(1, sizeof(*map));
+    int i;
+
+    map->sections = malloc(pe->header->NumberOfSections * sizeof(*map->sections));
+    for (i = 0; i < pe->header->NumberOfSections; i++) {
+        if (pe->sections[i].min_alloc)
+            map->sections[map->count++] = &pe->sections[i];
+    }
+
+    qsort(map->sections, map->count, sizeof(*map->sections), compare_sections);
+
+    /* If any two sections overlap (or one wraps around the address space),
+     * a binary search could return a different section than the first one
+     * in the table, so give up and search them in order. */
+    for (i = 0; i < map->count; i++) {
+        dword end = map->sections[i]->address + map->sections[i]->min_alloc;
+        if (end < map->sections[i]->address
+                || (i + 1 < map->count && end > map->sections[i + 1]->address)) {
+            warn("Section %.8s overlaps another section.\n", map->sections[i]->name);
+            map->overlap = 1;
+            break;
+        }
+    }
+
+    pe->section_map = map;
+}
+
+void free_section_map(struct pe *pe) {
+    if (pe->section_map)
+        free(pe->section_map->sections);
+    free(pe->section_map);
+}
+
+static int section_contains(const struct section *sec, dword addr) {
+    return addr >= sec->address && addr < sec->address + sec->min_alloc;
+}
 
 struct section *addr2section(dword addr, const struct pe *pe) {
     /* Even worse than the below, some data is sensitive to which section it's in! */
 
+    struct section_map *map = pe->section_map;
+    unsigned lo = 0, hi = map->count;
+    struct section *last;
     int i;
-    for (i = 0; i < pe->header->NumberOfSections; i++) {
-         if (addr >= pe->sections[i].address && addr < pe->sections[i].address + pe->sections[i].min_alloc)
-            return &pe->sections[i];
+
+    if (map->overlap) {
+        for (i = 0; i < pe->header->NumberOfSections; i++) {
+            if (section_contains(&pe->sections[i], addr))
+                return &pe->sections[i];
+        }
+        return NULL;
+    }
+
+    /* Lookups tend to come in runs within the same section. This may be
+     * called from several threads at once (see sweep.c), hence the atomics. */
+    last = __atomic_load_n(&map->last, __ATOMIC_RELAXED);
+    if (last && section_contains(last, addr))
+        return last;
+
+    /* find the last section starting at or below addr */
+    while (lo < hi) {
+        unsigned mid = lo + (hi - lo) / 2;
+        if (map->sections[mid]->address <= addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (lo && section_contains(map->sections[lo - 1], addr)) {
+        __atomic_store_n(&map->last, map->sections[lo - 1], __ATOMIC_RELAXED);
+        return map->sections[lo - 1];
     }
 
     return NULL;
@@ -51,59 +130,120 @@ struct section *addr2section(dword addr, const struct pe *pe) {
 off_t addr2offset(dword addr, const struct pe *pe) {
     /* Everything inside a PE file is built so that the file is read while it's
      * already loaded. Offsets aren't file offsets, they're *memory* offsets.
-     * We don't want to load the file like that, so we have to search through
-     * each section to figure out where in the *file* a virtual address points. */
+     * Unless asked to (see map_sections()), we don't load the file like that,
+     * so we have to search through each section to figure out where in the
+     * *file* a virtual address points. */
 
     struct section *section = addr2section(addr, pe);
     if (!section) return 0;
     return addr - section->address + section->offset;
 }
 
+/* Don't reserve more address space than this for a view. */
+#define MAX_VIEW_SIZE   0x80000000u
+
+/* With --map-sections, lay the headers and sections out by address, as the
+ * loader would, so that read_rva() doesn't have to look anything up. As with
+ * the loader, whatever is past the end of a section's data, or between
+ * sections, reads as zeroes. If the sections overlap, we don't bother. */
+void map_sections(struct pe *pe) {
+    const struct section_map *map = pe->section_map;
+    struct image_extent *extents;
+    const struct section *last;
+    dword header_size;
+    qword size;
+    unsigned i;
+
+    if (map->overlap || !map->count)
+        return;
+
+    last = map->sections[map->count - 1];
+    size = (qword)last->address + last->min_alloc;
+    if (size > MAX_VIEW_SIZE)
+        return;
+
+    extents = malloc((map->count + 1) * sizeof(*extents));
+
+    header_size = (pe->magic == 0x10b) ? pe->opt32->SizeOfHeaders : pe->opt64->SizeOfHeaders;
+    extents[0].offset = 0;
+    extents[0].address = 0;
+    extents[0].length = min(header_size, map->sections[0]->address);
+
+    for (i = 0; i < map->count; i++) {
+        extents[i + 1].offset = map->sections[i]->offset;
+        extents[i + 1].address = map->sections[i]->address;
+        extents[i + 1].length = min(map->sections[i]->length, map->sections[i]->min_alloc);
+    }
+
+    if ((pe->view = image_map_virtual(pe->image, extents, map->count + 1, size)))
+        pe->view_size = size;
+    free(extents);
+}
+
+unsigned hash_address(dword addr, unsigned bits) {
+    return (dword)(addr * 2654435761u) >> (32 - bits);
+}
+
 /* index function */
 static const char *get_export_name(dword ip, const struct pe *pe) {
-    int i;
-    for (i = 0; i < pe->export_count; i++) {
-        if (pe->exports[i].address == ip)
-            return pe->exports[i].name;
+    unsigned mask, h, i;
+
+    if (!pe->export_hash)
+        return NULL;
+
+    mask = (1u << pe->export_hash_bits) - 1;
+    h = hash_address(ip, pe->export_hash_bits);
+    while ((i = pe->export_hash[h])) {
+        if (pe->exports[i - 1].address == ip)
+            return pe->exports[i - 1].name;
+        h = (h + 1) & mask;
     }
     return NULL;
 }
 
+/* index function */
 static const char *get_imported_name(dword offset, const struct pe *pe) {
-    static char comment[256];
+    unsigned slot_size = (pe->magic == 0x10b) ? sizeof(dword) : sizeof(qword);
     unsigned i;
 
+    if (pe->import_slots)
+    {
+        unsigned slot = (offset - pe->import_base) / slot_size;
+        if (offset >= pe->import_base && slot < pe->import_slot_count)
+            return pe->import_slots[slot];
+        return NULL;
+    }
+
     for (i = 0; i < pe->import_count; ++i)
     {
         struct import_module *module = &pe->imports[i];
-        unsigned index = (offset - module->iat_addr) /
-                         ((pe->magic == 0x10b) ? sizeof(dword) : sizeof(qword));
+        unsigned index = (offset - module->iat_addr) / slot_size;
         if (index < module->count)
-        {
-            if (module->nametab[index].is_ordinal)
-            {
-                sprintf(comment, "%s.%u", module->module, module->nametab[index].ordinal);
-                return comment;
-            }
-            return module->nametab[index].name;
-        }
+            return get_import_name(&module->nametab[index]);
     }
     return NULL;
 }
 
-/* index function */
+/* index function; the relocation table is sorted by get_reloc_table() */
 static const struct reloc_pe *get_reloc(dword ip, const struct pe *pe) {
-    unsigned i;
-    for (i=0; i<pe->reloc_count; i++) {
-        if (pe->relocs[i].offset == ip)
-            return &pe->relocs[i];
+    unsigned lo = 0, hi = pe->reloc_count;
+
+    while (lo < hi) {
+        unsigned mid = lo + (hi - lo) / 2;
+        if (pe->relocs[mid].offset < ip)
+            lo = mid + 1;
+        else
+            hi = mid;
     }
+
+    if (lo < pe->reloc_count && pe->relocs[lo].offset == ip)
+        return &pe->relocs[lo];
     return NULL;
 }
 
-static char *relocate_arg(const struct instr *instr, const struct arg *arg, const struct pe *pe) {
+static char *relocate_arg(const struct instr *instr, const struct arg *arg,
+        const struct pe *pe, char comment[10]) {
     const struct reloc_pe *r = get_reloc(arg->ip, pe);
-    static char comment[10];
 
     if (!r)
         return NULL;
@@ -112,7 +252,7 @@ static char *relocate_arg(const struct instr *instr, const struct arg *arg, cons
         return NULL;    /* not even a real relocation, just padding */
     else if (r->type == 3) {
         if (arg->type == IMM || (arg->type == RM && instr->modrm_reg == -1) || arg->type == MOFFS) {
-            snprintf(comment, 10, "%lx", pe_rel_addr ? arg->value - pe->opt32->ImageBase : arg->value);
+            snprintf(comment, 10, "%lx", pe->rel_addr ? arg->value - pe->opt32->ImageBase : arg->value);
             return comment;
         }
     }
@@ -120,10 +260,11 @@ static char *relocate_arg(const struct instr *instr, const struct arg *arg, cons
     return NULL;
 }
 
+/* comment_str is scratch space for comments we have to format ourselves. */
 static const char *get_arg_comment(const struct section *sec, dword end_ip,
-        const struct instr *instr, const struct arg *arg, const struct pe *pe)
+        const struct instr *instr, const struct arg *arg, const struct pe *pe,
+        char comment_str[10])
 {
-    static char comment_str[10];
     struct section *tsec;
     const char *comment;
     qword rel_value;
@@ -138,7 +279,7 @@ static const char *get_arg_comment(const struct section *sec, dword end_ip,
 
         tip = end_ip + arg->value;
         abstip = tip;
-        if (!pe_rel_addr) abstip += pe->imagebase;
+        if (!pe->rel_addr) abstip += pe->imagebase;
 
         if ((comment = get_imported_name(tip, pe)))
             return comment;
@@ -152,11 +293,11 @@ static const char *get_arg_comment(const struct section *sec, dword end_ip,
 
     /* FIXME: This is getting messy. */
     rel_value = arg->value;
-    if (!pe_rel_addr) rel_value -= pe->imagebase;
+    if (!pe->rel_addr) rel_value -= pe->imagebase;
 
     /* Relocate anything that points inside the image's address space or that
      * has a relocation entry. */
-    if ((tsec = addr2section(rel_value, pe)) || (sec->instr_flags[arg->ip - sec->address] & INSTR_RELOC))
+    if ((tsec = addr2section(rel_value, pe)) || has_instr_flag(sec->instr_flags, arg->ip - sec->address, INSTR_RELOC))
     {
         if ((comment = get_imported_name(rel_value, pe)))
             return comment;
@@ -167,14 +308,14 @@ static const char *get_arg_comment(const struct section *sec, dword end_ip,
          * relocated address. mingw-w64 does this. */
 
         if (tsec && rel_value < tsec->address + tsec->length
-                && read_word(addr2offset(rel_value, pe)) == 0x25ff) /* absolute jmp */
+                && read_rva_word(pe, rel_value, 0) == 0x25ff) /* absolute jmp */
         {
-            rel_value = read_dword(addr2offset(rel_value, pe) + 2);
-            if (!pe_rel_addr) rel_value -= pe->imagebase;
+            rel_value = read_rva_dword(pe, rel_value, 2);
+            if (!pe->rel_addr) rel_value -= pe->imagebase;
             return get_imported_name(rel_value, pe);
         }
 
-        if ((comment = relocate_arg(instr, arg, pe)))
+        if ((comment = relocate_arg(instr, arg, pe, comment_str)))
             return comment;
 
         /* Don't print any comment for mundane relative jumps or calls. */
@@ -189,25 +330,28 @@ static const char *get_arg_comment(const struct section *sec, dword end_ip,
     return NULL;
 }
 
-static int print_pe_instr(const struct section *sec, dword ip, byte *p, const struct pe *pe) {
+static int print_pe_instr(struct output *out, const struct section *sec, dword ip, byte *p, const struct pe *pe) {
     struct instr instr = {0};
+    struct instr_text text = {0};
     unsigned len;
     const char *comment = NULL;
+    char comment_str[10];
     char ip_string[17];
     qword absip = ip;
     int bits = (pe->magic == 0x10b) ? 32 : 64;
 
-    if (!pe_rel_addr)
+    if (!pe->rel_addr)
         absip += pe->imagebase;
 
-    len = get_instr(ip, p, &instr, bits);
+    if (!(len = decode_cache_find(&sec->decoded, ip, &instr)))
+        len = get_instr(ip, p, &instr, bits);
 
     sprintf(ip_string, "%8lx", absip);
 
     /* We deal in relative addresses internally everywhere. That means we have
      * to fix up the values for relative jumps if we're not displaying relative
      * addresses. */
-    if ((instr.op.arg0 == REL8 || instr.op.arg0 == REL) && !pe_rel_addr) {
+    if ((instr.op.arg0 == REL8 || instr.op.arg0 == REL) && !pe->rel_addr) {
         instr.args[0].value += pe->imagebase;
     }
 
@@ -216,60 +360,75 @@ static int print_pe_instr(const struct section *sec, dword ip, byte *p, const st
      * relocated, and relocations proper are scattered throughout code sections
      * and relocated according to the contents of .reloc. */
 
-    if (!(comment = get_arg_comment(sec, ip + len, &instr, &instr.args[0], pe)))
-        comment = get_arg_comment(sec, ip + len, &instr, &instr.args[1], pe);
+    if (!(comment = get_arg_comment(sec, ip + len, &instr, &instr.args[0], pe, comment_str)))
+        comment = get_arg_comment(sec, ip + len, &instr, &instr.args[1], pe, comment_str);
 
-    print_instr(ip_string, p, len, sec->instr_flags[ip - sec->address], &instr, comment, bits);
+    print_instr(out, ip_string, p, len, get_instr_flags(sec->instr_flags, ip - sec->address), &instr, &text, comment, bits);
 
     return len;
 }
 
-static void print_disassembly(const struct section *sec, const struct pe *pe) {
-    dword relip = 0, ip;
+struct sweep_section {
+    const struct section *sec;
+    const struct pe *pe;
+};
+
+/* Print the instruction at relip, or skip what can't be printed. */
+static dword print_step(dword relip, struct output *out, void *ctx) {
+    const struct sweep_section *sweep_sec = ctx;
+    const struct section *sec = sweep_sec->sec;
+    const struct pe *pe = sweep_sec->pe;
+    dword length = min(sec->length, sec->min_alloc);
+    dword ip;
     qword absip;
 
     byte buffer[MAX_INSTR];
 
-    while (relip < sec->length && relip < sec->min_alloc) {
-        /* find a valid instruction */
-        if (!(sec->instr_flags[relip] & INSTR_VALID)) {
-            if (opts & DISASSEMBLE_ALL) {
-                /* still skip zeroes */
-                if (read_byte(sec->offset + relip) == 0) {
-                    printf("     ...\n");
-                    relip++;
-                    while (read_byte(sec->offset + relip) == 0) relip++;
-                }
-            } else {
-                printf("     ...\n");
-                while ((relip < sec->length) && (relip < sec->min_alloc) && !(sec->instr_flags[relip] & INSTR_VALID)) relip++;
+    /* find a valid instruction */
+    if (!has_instr_flag(sec->instr_flags, relip, INSTR_VALID)) {
+        if (opts & DISASSEMBLE_ALL) {
+            /* still skip zeroes */
+            if (read_byte(pe->image, sec->offset + relip) == 0) {
+                out_printf(out, "     ...\n");
+                relip++;
+                while (relip < length && read_byte(pe->image, sec->offset + relip) == 0) relip++;
+                return (relip < length) ? relip : SWEEP_END;
             }
+        } else {
+            out_printf(out, "     ...\n");
+            relip = find_instr_flag(sec->instr_flags, relip, length, INSTR_VALID);
+            return (relip < length) ? relip : SWEEP_END;
         }
+    }
 
-        ip = relip + sec->address;
-        if (relip >= sec->length || relip >= sec->min_alloc) return;
-
-        /* Instructions can "hang over" the end of a segment.
-         * Zero should be supplied. */
-        memset(buffer, 0, sizeof(buffer));
-        memcpy(buffer, read_data(sec->offset + relip), min(sizeof(buffer), sec->length - relip));
+    ip = relip + sec->address;
 
-        absip = ip;
-        if (!pe_rel_addr)
-            absip += pe->imagebase;
+    /* Instructions can "hang over" the end of a segment.
+     * Zero should be supplied. */
+    memset(buffer, 0, sizeof(buffer));
+    memcpy(buffer, read_bytes(pe->image, sec->offset + relip, sizeof(buffer)), min(sizeof(buffer), sec->length - relip));
 
-        if (sec->instr_flags[relip] & INSTR_FUNC) {
-            const char *name = get_export_name(ip, pe);
-            printf("\n");
-            printf("%lx <%s>:\n", absip, name ? name : "no name");
-        }
+    absip = ip;
+    if (!pe->rel_addr)
+        absip += pe->imagebase;
 
-        relip += print_pe_instr(sec, ip, buffer, pe);
+    if (has_instr_flag(sec->instr_flags, relip, INSTR_FUNC)) {
+        const char *name = get_export_name(ip, pe);
+        out_printf(out, "\n");
+        out_printf(out, "%lx <%s>:\n", absip, name ? name : "no name");
     }
-    putchar('\n');
+
+    return relip + print_pe_instr(out, sec, ip, buffer, pe);
 }
 
-static void print_data(const struct section *sec, struct pe *pe) {
+static void print_disassembly(const struct section *sec, const struct pe *pe, struct output *out) {
+    struct sweep_section ctx = {sec, pe};
+
+    if (sweep(pe->image, 0, min(sec->length, sec->min_alloc), print_step, out, &ctx) != SWEEP_END)
+        out_putc(out, '\n');
+}
+
+static void print_data(const struct section *sec, const struct pe *pe, struct output *out) {
     dword relip = 0;
     qword absip;
 
@@ -277,67 +436,75 @@ static void print_data(const struct section *sec, struct pe *pe) {
      * a bunch of annoying zeroes. So don't read past the minimum allocation. */
     dword length = min(sec->length, sec->min_alloc);
 
+    if (image_clamp(pe->image, sec->offset, length) < length) {
+        warn("Section %s extends past the end of the file.\n", sec->name);
+        length = image_clamp(pe->image, sec->offset, length);
+    }
+
     for (relip = 0; relip < length; relip += 16) {
         int len = min(length-relip, 16);
-        int i;
 
         absip = relip + sec->address;
-        if (!pe_rel_addr)
+        if (!pe->rel_addr)
             absip += pe->imagebase;
 
-        printf("%8lx", absip);
-        for (i=0; i<16; i++) {
-            if (i < len)
-                printf(" %02x", read_byte(sec->offset + relip + i));
-            else
-                printf("   ");
-        }
-        printf("  ");
-        for (i = 0; i < len; ++i)
-        {
-            char c = read_byte(sec->offset + relip + i);
-            putchar(isprint(c) ? c : '.');
-        }
-        putchar('\n');
+        out_printf(out, "%8lx", absip);
+        out_hex_line(out, read_bytes(pe->image, sec->offset + relip, len), len);
     }
 }
 
-static void scan_segment(dword ip, struct pe *pe) {
-    struct section *sec = addr2section(ip, pe);
+/* Scan one run of code, queueing the targets of any branches we find. A
+ * resumed run stays in the section it started in, which is recorded in cs. */
+static void scan_run(const struct scan_item *item, struct worklist *wl, void *ctx) {
+    struct pe *pe = ctx;
+    dword ip = item->ip;
+    struct section *sec;
     dword relip;
 
     byte buffer[MAX_INSTR];
     struct instr instr;
+    struct scan_item targets[2];
     int instr_length;
     int i;
 
 //    fprintf(stderr, "scanning at %x, in section %s\n", ip, sec ? sec->name : "<none>");
 
-    if (!sec) {
-        warn_at("Attempt to scan byte not in image.\n");
-        return;
-    }
+    if (item->resume) {
+        sec = &pe->sections[item->cs];
+        relip = ip - sec->address;
+    } else {
+        sec = addr2section(ip, pe);
 
-    relip = ip - sec->address;
+        if (!sec) {
+            warn_at("Attempt to scan byte not in image.\n");
+            return;
+        }
 
-    if ((sec->instr_flags[relip] & (INSTR_VALID|INSTR_SCANNED)) == INSTR_SCANNED)
-        warn_at("Attempt to scan byte that does not begin instruction.\n");
+        relip = ip - sec->address;
+
+        if ((get_instr_flags(sec->instr_flags, relip) & (INSTR_VALID|INSTR_SCANNED)) == INSTR_SCANNED)
+            warn_at("Attempt to scan byte that does not begin instruction.\n");
+    }
 
     /* This code assumes that one stretch of code won't span multiple sections.
      * Is this a valid assumption? */
 
     while (relip < sec->length) {
-        /* check if we've already read from here */
-        if (sec->instr_flags[relip] & INSTR_SCANNED) return;
+        unsigned count = 0;
+
+        /* check if we've already read from here, or if another thread is */
+        if (has_instr_flag(sec->instr_flags, relip, INSTR_SCANNED)) return;
+        if (set_instr_flags(sec->instr_flags, relip, INSTR_VALID) & INSTR_VALID) return;
 
         /* read the instruction */
         memset(buffer, 0, sizeof(buffer));
-        memcpy(buffer, read_data(sec->offset + relip), min(sizeof(buffer), sec->length-relip));
+        memcpy(buffer, read_bytes(pe->image, sec->offset + relip, sizeof(buffer)), min(sizeof(buffer), sec->length-relip));
         instr_length = get_instr(ip, buffer, &instr, (pe->magic == 0x10b) ? 32 : 64);
+        decode_cache_add(&sec->decoded, ip, &instr, instr_length);
 
         /* mark the bytes */
-        sec->instr_flags[relip] |= INSTR_VALID;
-        for (i = relip; i < relip+instr_length && i < sec->min_alloc; i++) sec->instr_flags[i] |= INSTR_SCANNED;
+        i = (relip < sec->min_alloc) ? min(relip + instr_length, sec->min_alloc) : relip;
+        set_instr_flag_range(sec->instr_flags, relip, i, INSTR_SCANNED);
 
         /* instruction which hangs over the minimum allocation */
         if (i < relip+instr_length && i == sec->min_alloc) break;
@@ -354,12 +521,13 @@ static void scan_segment(dword ip, struct pe *pe) {
                     dword trelip = instr.args[0].value - tsec->address;
 
                     if (!strcmp(instr.op.name, "call"))
-                        tsec->instr_flags[trelip] |= INSTR_FUNC;
+                        set_instr_flags(tsec->instr_flags, trelip, INSTR_FUNC);
                     else
-                        tsec->instr_flags[trelip] |= INSTR_JUMP;
+                        set_instr_flags(tsec->instr_flags, trelip, INSTR_JUMP);
 
                     /* scan it */
-                    scan_segment(instr.args[0].value, pe);
+                    targets[count].cs = 0;
+                    targets[count++].ip = instr.args[0].value;
                 }
                 else
                     warn_at("Branch '%s' to byte %lx in non-code section %s.\n",
@@ -369,7 +537,7 @@ static void scan_segment(dword ip, struct pe *pe) {
         }
 
         for (i = relip; i < relip+instr_length; i++) {
-            if (sec->instr_flags[i] & INSTR_RELOC) {
+            if (has_instr_flag(sec->instr_flags, i, INSTR_RELOC)) {
                 const struct reloc_pe *r = get_reloc(i + sec->address, pe);
                 struct section *tsec;
                 dword taddr;
@@ -382,20 +550,21 @@ static void scan_segment(dword ip, struct pe *pe) {
                 case 3: /* HIGHLOW */
                     if (pe->magic != 0x10b)
                         warn_at("HIGHLOW relocation in 64-bit image?\n");
-                    taddr = read_dword(sec->offset + i) - pe->imagebase;
+                    taddr = read_dword(pe->image, sec->offset + i) - pe->imagebase;
                     tsec = addr2section(taddr, pe);
 
                     if (!tsec)
                     {
-                        warn_at("Relocation to %#x isn't in a section?\n", read_dword(sec->offset + i));
+                        warn_at("Relocation to %#x isn't in a section?\n", read_dword(pe->image, sec->offset + i));
                         continue;
                     }
 
                     /* Only try to scan it if it's an immediate address. If someone is
                      * dereferencing an address inside a code section, it's data. */
                     if (tsec->flags & 0x20 && (instr.op.arg0 == IMM || instr.op.arg1 == IMM)) {
-                        tsec->instr_flags[taddr - tsec->address] |= INSTR_FUNC;
-                        scan_segment(taddr, pe);
+                        set_instr_flags(tsec->instr_flags, taddr - tsec->address, INSTR_FUNC);
+                        targets[count].cs = 0;
+                        targets[count++].ip = taddr;
                     }
                     break;
                 default:
@@ -406,7 +575,7 @@ static void scan_segment(dword ip, struct pe *pe) {
             }
         }
 
-        if (instr.op.flags & OP_STOP)
+        if (worklist_branch(wl, targets, count, sec - pe->sections, ip + instr_length, instr.op.flags & OP_STOP))
             return;
 
         ip += instr_length;
@@ -416,7 +585,14 @@ static void scan_segment(dword ip, struct pe *pe) {
     warn_at("Scan reached the end of section.\n");
 }
 
-static void print_section_flags(dword flags) {
+static void scan_segment(struct worklist *wl, dword ip, struct pe *pe, int parallel) {
+    worklist_push(wl, 0, ip);
+    /* on several threads, the seeds are all queued first */
+    if (!parallel)
+        scan_worklist(wl, scan_run, pe);
+}
+
+static void print_section_flags(dword flags, struct output *out) {
     char buffer[1024] = "";
     int alignment = (flags & 0x00f00000) / 0x100000;
 
@@ -452,8 +628,8 @@ static void print_section_flags(dword flags) {
     if (flags & 0x40000000) strcat(buffer, ", readable");
     if (flags & 0x80000000) strcat(buffer, ", writable");
 
-    printf("    Flags: 0x%08x (%s)\n", flags, buffer+2);
-    printf("    Alignment: %d (2**%d)\n", 1 << alignment, alignment);
+    out_printf(out, "    Flags: 0x%08x (%s)\n", flags, buffer+2);
+    out_printf(out, "    Alignment: %d (2**%d)\n", 1 << alignment, alignment);
 }
 
 /* We don't actually know what sections contain code. In theory it could be any
@@ -461,6 +637,9 @@ static void print_section_flags(dword flags) {
 
 void read_sections(struct pe *pe) {
     dword entry_point = (pe->magic == 0x10b) ? pe->opt32->AddressOfEntryPoint : pe->opt64->AddressOfEntryPoint;
+    struct flag_cache cache;
+    struct worklist wl;
+    int parallel;
     int i;
 
     /* We already read the section header (unlike NE, we had to in order to read
@@ -481,7 +660,7 @@ void read_sections(struct pe *pe) {
                 break;
             case 3: /* HIGHLOW */
                 /* scanning is done in scan_segment() */
-                sec->instr_flags[address - sec->address] |= INSTR_RELOC;
+                set_instr_flags(sec->instr_flags, address - sec->address, INSTR_RELOC);
                 break;
             default:
                 warn("%#x: Don't know how to handle relocation type %d\n",
@@ -491,6 +670,23 @@ void read_sections(struct pe *pe) {
         }
     }
 
+    if (cache_dir) {
+        flag_cache_init(&cache, pe->header->NumberOfSections);
+        for (i = 0; i < pe->header->NumberOfSections; i++) {
+            cache.flags[i] = (byte *)pe->sections[i].instr_flags;
+            cache.lengths[i] = pe->sections[i].instr_flags ? instr_flags_size(pe->sections[i].min_alloc) : 0;
+        }
+        if (flag_cache_load(pe->image, &cache)) {
+            flag_cache_free(&cache);
+            return;
+        }
+    }
+
+    /* Windows into files that can't be mapped whole can't be shared between
+     * threads; see sweep(). */
+    parallel = (scan_threads > 1 && pe->image->map);
+
+    worklist_init(&wl, SCAN_LIFO);
     for (i = 0; i < pe->export_count; i++)
     {
         dword address = pe->exports[i].address;
@@ -504,8 +700,8 @@ void read_sections(struct pe *pe) {
         }
         if (sec->flags & 0x20 && !(address >= pe->dirs[0].address &&
             address < (pe->dirs[0].address + pe->dirs[0].size))) {
-            sec->instr_flags[address - sec->address] |= INSTR_FUNC;
-            scan_segment(pe->exports[i].address, pe);
+            set_instr_flags(sec->instr_flags, address - sec->address, INSTR_FUNC);
+            scan_segment(&wl, pe->exports[i].address, pe, parallel);
         }
     }
 
@@ -514,44 +710,67 @@ void read_sections(struct pe *pe) {
         if (!sec)
             warn("Entry point %#x isn't in a section?\n", entry_point);
         else if (sec->flags & 0x20) {
-            sec->instr_flags[entry_point - sec->address] |= INSTR_FUNC;
-            scan_segment(entry_point, pe);
+            set_instr_flags(sec->instr_flags, entry_point - sec->address, INSTR_FUNC);
+            scan_segment(&wl, entry_point, pe, parallel);
         }
     }
-}
 
-void print_sections(struct pe *pe) {
-    int i;
-    struct section *sec;
+    if (parallel)
+        scan_worklist_parallel(&wl, scan_run, pe);
+    worklist_free(&wl);
+    for (i = 0; i < pe->header->NumberOfSections; i++)
+        decode_cache_finish(&pe->sections[i].decoded);
+
+    if (cache_dir) {
+        /* what a parallel scan finds can depend on timing, so don't keep it */
+        if (!parallel)
+            flag_cache_store(pe->image, &cache);
+        flag_cache_free(&cache);
+    }
+}
 
-    for (i = 0; i < pe->header->NumberOfSections; i++) {
-        sec = &pe->sections[i];
+static void print_section(unsigned i, struct output *out, void *ctx) {
+    const struct pe *pe = ctx;
+    const struct section *sec = &pe->sections[i];
+
+    out_putc(out, '\n');
+    out_printf(out, "Section %s (start = 0x%x, length = 0x%x, minimum allocation = 0x%x):\n",
+        sec->name, sec->offset, sec->length, sec->min_alloc);
+    out_printf(out, "    Address: %x\n", sec->address);
+    print_section_flags(sec->flags, out);
+
+    /* These fields should only be populated for object files (I think). */
+    if (sec->reloc_offset || sec->reloc_count)
+        warn("Section %s has relocation data: offset = %x, count = %d\n",
+            sec->name, sec->reloc_offset, sec->reloc_count);
+
+    /* Sometimes the .text section is marked as both code and data. I've
+     * seen mingw-w64 do this. (Because there's data stored in it?) */
+    if (sec->flags & 0x20) {
+        if (opts & FULL_CONTENTS)
+            print_data(sec, pe, out);
+        print_disassembly(sec, pe, out);
+    } else if (sec->flags & 0x40) {
+        /* see the appropriate FIXMEs on the NE side */
+        /* Don't print .rsrc by default. Some others should probably be
+         * excluded, too, but .rsrc is a particularly bad offender since
+         * large binaries might be put into it. */
+        if ((strcmp(sec->name, ".rsrc") && strcmp(sec->name, ".reloc"))
+            || (opts & FULL_CONTENTS))
+            print_data(sec, pe, out);
+    }
+}
 
-        putchar('\n');
-        printf("Section %s (start = 0x%x, length = 0x%x, minimum allocation = 0x%x):\n",
-            sec->name, sec->offset, sec->length, sec->min_alloc);
-        printf("    Address: %x\n", sec->address);
-        print_section_flags(sec->flags);
+static dword disassembly_size(unsigned i, void *ctx) {
+    const struct pe *pe = ctx;
+    const struct section *sec = &pe->sections[i];
 
-        /* These fields should only be populated for object files (I think). */
-        if (sec->reloc_offset || sec->reloc_count)
-            warn("Section %s has relocation data: offset = %x, count = %d\n",
-                sec->name, sec->reloc_offset, sec->reloc_count);
+    return (sec->flags & 0x20) ? min(sec->length, sec->min_alloc) : 0;
+}
 
-        /* Sometimes the .text section is marked as both code and data. I've
-         * seen mingw-w64 do this. (Because there's data stored in it?) */
-        if (sec->flags & 0x20) {
-            if (opts & FULL_CONTENTS)
-                print_data(sec, pe);
-            print_disassembly(sec, pe);
-        } else if (sec->flags & 0x40) {
-            /* see the appropriate FIXMEs on the NE side */
-            /* Don't print .rsrc by default. Some others should probably be
-             * excluded, too, but .rsrc is a particularly bad offender since
-             * large binaries might be put into it. */
-            if ((strcmp(sec->name, ".rsrc") && strcmp(sec->name, ".reloc"))
-                || (opts & FULL_CONTENTS))
-                print_data(sec, pe);
-        }
-    }
+/* Sections are independent once scanned, so with -j they're printed on
+ * several threads (see sweep.c). */
+void print_sections(struct pe *pe) {
+    print_in_order(pe->image, pe->header->NumberOfSections, print_section,
+        disassembly_size, pe->image->out, pe);
 }
@@ -0,0 +1,428 @@
+/*
+ * Worklist used to drive code discovery
+ *
+ * Copyright 2020 Zebediah Figura
+ *
+ * This file is part of Semblance.
+ *
+ * Semblance is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Semblance is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Semblance; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "semblance.h"
+#include "scan.h"
+
+/* We used to scan branch targets by recursing, which could run out of stack
+ * on large images. Instead, each backend scans one straight run of code at a
+ * time, and queues the targets of any branches it finds here.
+ *
+ * Every instruction is scanned only once, and each one queues at most a
+ * couple of items, so the list never grows past a small multiple of the
+ * number of instructions in the image. */
+
+void worklist_init(struct worklist *wl, enum scan_order order)
+{
+    wl->capacity = 64;
+    wl->items = malloc(wl->capacity * sizeof(*wl->items));
+    wl->head = wl->count = 0;
+    wl->order = order;
+}
+
+void worklist_free(struct worklist *wl)
+{
+    free(wl->items);
+    wl->items = NULL;
+}
+
+static void worklist_add(struct worklist *wl, word cs, dword ip, byte resume)
+{
+    struct scan_item *item;
+
+    if (wl->count == wl->capacity) {
+        /* unwrap the ring into a buffer twice the size */
+        struct scan_item *items = malloc(wl->capacity * 2 * sizeof(*items));
+        size_t first = wl->capacity - wl->head;
+
+        memcpy(items, wl->items + wl->head, first * sizeof(*items));
+        memcpy(items + first, wl->items, wl->head * sizeof(*items));
+        free(wl->items);
+        wl->items = items;
+        wl->head = 0;
+        wl->capacity *= 2;
+    }
+
+    item = &wl->items[(wl->head + wl->count++) & (wl->capacity - 1)];
+    item->cs = cs;
+    item->ip = ip;
+    item->resume = resume;
+}
+
+void worklist_push(struct worklist *wl, word cs, dword ip)
+{
+    worklist_add(wl, cs, ip, 0);
+}
+
+/* Queue the branch targets found in one instruction, in the order they
+ * should be scanned. next is the address following the instruction, and
+ * stop is nonzero if execution can't fall through to it.
+ *
+ * In depth-first order, the rest of the current run is queued underneath the
+ * targets, so they get scanned first, exactly as if we had recursed into
+ * them. Returns nonzero if the caller should end the current run. */
+int worklist_branch(struct worklist *wl, const struct scan_item *targets,
+        unsigned count, word cs, dword next, int stop)
+{
+    unsigned i;
+
+    if (!count)
+        return stop;
+
+    if (wl->order == SCAN_FIFO) {
+        for (i = 0; i < count; i++)
+            worklist_add(wl, targets[i].cs, targets[i].ip, 0);
+        return stop;
+    }
+
+    if (!stop)
+        worklist_add(wl, cs, next, 1);
+    for (i = count; i > 0; i--)
+        worklist_add(wl, targets[i-1].cs, targets[i-1].ip, 0);
+    return 1;
+}
+
+static void worklist_pop(struct worklist *wl, struct scan_item *item)
+{
+    if (wl->order == SCAN_FIFO) {
+        *item = wl->items[wl->head];
+        wl->head = (wl->head + 1) & (wl->capacity - 1);
+    } else
+        *item = wl->items[(wl->head + wl->count - 1) & (wl->capacity - 1)];
+    wl->count--;
+}
+
+void scan_worklist(struct worklist *wl, scan_func scan, void *ctx)
+{
+    struct scan_item item;
+
+    while (wl->count) {
+        worklist_pop(wl, &item);
+        scan(&item, wl, ctx);
+    }
+}
+
+/* With --parallel-scan, code is discovered on several threads. Each thread
+ * scans from its own worklist, exactly as scan_worklist() does, and takes
+ * more work from a shared list when it runs out. The shared list starts with
+ * the seeds (exports and the entry point); whenever some thread is waiting
+ * for work, whoever is scanning hands over the older half of its own list.
+ *
+ * The flags are only ever set, never cleared, and always atomically (see
+ * set_instr_flags()), so the threads can share them. Only one thread decodes
+ * any given instruction, since it claims INSTR_VALID first. But where two
+ * runs decode the same bytes differently, which one gets there first depends
+ * on timing, so the listing of such code may differ from a serial scan. */
+
+int scan_threads = 1;
+
+struct scan_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct worklist *shared;
+    scan_func scan;
+    void *ctx;
+    unsigned busy;      /* threads with work in hand */
+    unsigned waiting;   /* threads waiting for work */
+};
+
+static void share_work(struct scan_pool *pool, struct worklist *wl)
+{
+    size_t count = wl->count / 2;
+
+    pthread_mutex_lock(&pool->lock);
+    while (count--) {
+        struct scan_item *item = &wl->items[wl->head];
+
+        worklist_add(pool->shared, item->cs, item->ip, item->resume);
+        wl->head = (wl->head + 1) & (wl->capacity - 1);
+        wl->count--;
+    }
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void *scan_thread(void *arg)
+{
+    struct scan_pool *pool = arg;
+    struct scan_item item;
+    struct worklist wl;
+
+    worklist_init(&wl, pool->shared->order);
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->shared->count && pool->busy) {
+            __atomic_add_fetch(&pool->waiting, 1, __ATOMIC_RELAXED);
+            pthread_cond_wait(&pool->cond, &pool->lock);
+            __atomic_sub_fetch(&pool->waiting, 1, __ATOMIC_RELAXED);
+        }
+        if (!pool->shared->count)
+            break;  /* nobody is scanning, so nothing more can turn up */
+
+        worklist_pop(pool->shared, &item);
+        pool->busy++;
+        pthread_mutex_unlock(&pool->lock);
+
+        worklist_add(&wl, item.cs, item.ip, item.resume);
+        while (wl.count) {
+            worklist_pop(&wl, &item);
+            pool->scan(&item, &wl, pool->ctx);
+            if (wl.count > 1 && __atomic_load_n(&pool->waiting, __ATOMIC_RELAXED))
+                share_work(pool, &wl);
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        if (!--pool->busy)
+            pthread_cond_broadcast(&pool->cond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    worklist_free(&wl);
+    return NULL;
+}
+
+/* Scan everything queued in wl, and everything found from it, on
+ * scan_threads threads. */
+void scan_worklist_parallel(struct worklist *wl, scan_func scan, void *ctx)
+{
+    struct scan_pool pool = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, wl, scan, ctx};
+    unsigned started, i;
+    pthread_t *threads;
+
+    threads = malloc(scan_threads * sizeof(*threads));
+    for (started = 0; started < scan_threads; started++) {
+        if ((errno = pthread_create(&threads[started], NULL, scan_thread, &pool))) {
+            perror("Cannot create thread");
+            break;
+        }
+    }
+
+    for (i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+
+    /* if no threads could be started, do it ourselves */
+    scan_worklist(wl, scan, ctx);
+}
+
+size_t instr_flags_size(dword length)
+{
+    return (((size_t)length + 63) / 64) * INSTR_FLAG_BITS * sizeof(qword);
+}
+
+qword *alloc_instr_flags(dword length)
+{
+    return calloc(1, instr_flags_size(length));
+}
+
+void decode_cache_init(struct decode_cache *cache, dword base, dword length)
+{
+    memset(cache, 0, sizeof(*cache));
+    cache->base = base;
+    cache->length = length;
+    pthread_mutex_init(&cache->lock, NULL);
+}
+
+STATIC_ASSERT(sizeof(struct op) == 4 * sizeof(qword));
+
+static unsigned hash_op(const struct op *op)
+{
+    qword w[4], h = 0;
+    int i;
+
+    memcpy(w, op, sizeof(w));
+    for (i = 0; i < 4; i++)
+        h = (h ^ w[i]) * 0x9e3779b97f4a7c15ull;
+    return h >> 32;
+}
+
+/* Returns the index of op in the cache's table, adding it if need be, or -1
+ * if the table is full. */
+static int intern_op(struct decode_cache *cache, const struct op *op)
+{
+    unsigned mask, h, i;
+
+    if (cache->op_count * 2 >= cache->op_capacity) {
+        unsigned capacity = cache->op_capacity ? cache->op_capacity * 2 : 64;
+        struct op *ops = realloc(cache->ops, (capacity / 2) * sizeof(*ops));
+        word *op_hash = calloc(capacity, sizeof(*op_hash));
+
+        if (ops)
+            cache->ops = ops;
+        if (!ops || !op_hash || capacity / 2 > 0xffff) {
+            free(op_hash);
+            return -1;
+        }
+        for (i = 0; i < cache->op_count; i++) {
+            h = hash_op(&cache->ops[i]) & (capacity - 1);
+            while (op_hash[h])
+                h = (h + 1) & (capacity - 1);
+            op_hash[h] = i + 1;
+        }
+        free(cache->op_hash);
+        cache->op_hash = op_hash;
+        cache->op_capacity = capacity;
+    }
+
+    mask = cache->op_capacity - 1;
+    for (h = hash_op(op) & mask; cache->op_hash[h]; h = (h + 1) & mask) {
+        if (!memcmp(&cache->ops[cache->op_hash[h] - 1], op, sizeof(*op)))
+            return cache->op_hash[h] - 1;
+    }
+    cache->ops[cache->op_count] = *op;
+    cache->op_hash[h] = ++cache->op_count;
+    return cache->op_count - 1;
+}
+
+void decode_cache_add(struct decode_cache *cache, dword ip, const struct instr *instr, int len)
+{
+    dword offset = ip - cache->base;
+    int op;
+
+    if (offset >= cache->length)
+        return;
+
+    if (scan_threads > 1)
+        pthread_mutex_lock(&cache->lock);
+
+    if (cache->count == cache->capacity) {
+        size_t capacity = cache->capacity ? cache->capacity * 2 : 256;
+        struct instr_record *entries = realloc(cache->entries, capacity * sizeof(*entries));
+        dword *offsets = realloc(cache->offsets, capacity * sizeof(*offsets));
+
+        if (entries)
+            cache->entries = entries;
+        if (offsets)
+            cache->offsets = offsets;
+        if (!entries || !offsets)
+            goto out;
+        cache->capacity = capacity;
+    }
+
+    /* an instruction that can't be cached is just decoded again */
+    if ((op = intern_op(cache, &instr->op)) < 0)
+        goto out;
+    pack_instr(&cache->entries[cache->count], instr, ip, len, op);
+    cache->offsets[cache->count++] = offset;
+
+out:
+    if (scan_threads > 1)
+        pthread_mutex_unlock(&cache->lock);
+}
+
+static inline dword decode_cache_rank(const struct decode_cache *cache, dword offset)
+{
+    return cache->ranks[offset / 64] + __builtin_popcountll(cache->starts[offset / 64] & ((1ull << (offset % 64)) - 1));
+}
+
+/* Sort the records by address and index them. Called once scanning is done. */
+void decode_cache_finish(struct decode_cache *cache)
+{
+    size_t words = ((size_t)cache->length + 63) / 64, i;
+    struct instr_record *entries;
+    dword total = 0;
+
+    if (cache->count) {
+        cache->starts = calloc(words, sizeof(*cache->starts));
+        cache->ranks = malloc(words * sizeof(*cache->ranks));
+    }
+    if (!cache->starts || !cache->ranks) {
+        decode_cache_free(cache);
+        decode_cache_init(cache, cache->base, cache->length);
+        return;
+    }
+
+    for (i = 0; i < cache->count; i++)
+        cache->starts[cache->offsets[i] / 64] |= 1ull << (cache->offsets[i] % 64);
+    for (i = 0; i < words; i++) {
+        cache->ranks[i] = total;
+        total += __builtin_popcountll(cache->starts[i]);
+    }
+
+    /* Move each record into place, in place. An instruction that was scanned
+     * twice only needs one record; the other is left past the end. */
+    for (i = 0; i < cache->count; i++) {
+        while (cache->offsets[i] != ~0u) {
+            dword offset = cache->offsets[i], dest = decode_cache_rank(cache, offset);
+            struct instr_record entry;
+
+            if (dest == i)
+                break;
+            if (cache->offsets[dest] == offset) {
+                cache->offsets[i] = ~0u;
+                break;
+            }
+            entry = cache->entries[dest];
+            cache->entries[dest] = cache->entries[i];
+            cache->entries[i] = entry;
+            cache->offsets[i] = cache->offsets[dest];
+            cache->offsets[dest] = offset;
+        }
+    }
+
+    if ((entries = realloc(cache->entries, total * sizeof(*entries))))
+        cache->entries = entries;
+    free(cache->offsets);
+    cache->offsets = NULL;
+    cache->count = cache->capacity = total;
+}
+
+/* Fills in the instruction decoded at ip and returns its length, or returns 0
+ * if we never scanned there. */
+int decode_cache_find(const struct decode_cache *cache, dword ip, struct instr *instr)
+{
+    dword offset = ip - cache->base;
+    const struct instr_record *entry;
+
+    if (!cache->starts || offset >= cache->length ||
+        !(cache->starts[offset / 64] & (1ull << (offset % 64))))
+        return 0;
+
+    entry = &cache->entries[decode_cache_rank(cache, offset)];
+    return unpack_instr(instr, entry, ip, &cache->ops[entry->op]);
+}
+
+void decode_cache_free(struct decode_cache *cache)
+{
+    free(cache->entries);
+    free(cache->offsets);
+    free(cache->starts);
+    free(cache->ranks);
+    free(cache->ops);
+    free(cache->op_hash);
+    cache->entries = NULL;
+    cache->offsets = NULL;
+    cache->starts = NULL;
+    cache->ranks = NULL;
+    cache->ops = NULL;
+    cache->op_hash = NULL;
+    cache->count = cache->capacity = 0;
+    cache->op_count = cache->op_capacity = 0;
+    pthread_mutex_destroy(&cache->lock);
+}
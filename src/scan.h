@@ -0,0 +1,145 @@
+#ifndef __SCAN_H
+#define __SCAN_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include "semblance.h"
+#include "x86_instr.h"
+
+/* A place to start scanning code, or to pick a scan back up. */
+struct scan_item {
+    dword ip;
+    word cs;        /* segment (NE) or section index (PE) */
+    byte resume;    /* continuing a run, rather than a new branch target */
+};
+
+enum scan_order {
+    SCAN_LIFO,      /* depth-first, in the same order the recursive scanner used */
+    SCAN_FIFO,      /* breadth-first; runs are scanned without being split */
+};
+
+struct worklist {
+    struct scan_item *items;    /* ring buffer */
+    size_t head, count, capacity;
+    enum scan_order order;
+};
+
+/* Scans one run of code starting at item, queueing any branch targets. */
+typedef void (*scan_func)(const struct scan_item *item, struct worklist *wl, void *ctx);
+
+extern void worklist_init(struct worklist *wl, enum scan_order order);
+extern void worklist_free(struct worklist *wl);
+extern void worklist_push(struct worklist *wl, word cs, dword ip);
+extern int worklist_branch(struct worklist *wl, const struct scan_item *targets,
+        unsigned count, word cs, dword next, int stop);
+extern void scan_worklist(struct worklist *wl, scan_func scan, void *ctx);
+
+/* number of threads to discover code with (--parallel-scan) */
+extern int scan_threads;
+
+extern void scan_worklist_parallel(struct worklist *wl, scan_func scan, void *ctx);
+
+/* The flags found by scanning (INSTR_SCANNED and so on) are kept as one bitmap
+ * per flag, interleaved so that each group of 64 bytes of code has one word for
+ * each flag, next to each other. That way runs of bytes without a given flag
+ * can be skipped a word at a time.
+ *
+ * Flags are only ever set, and atomically, since scanning may be done on
+ * several threads. */
+#define INSTR_FLAG_BITS     6   /* INSTR_SCANNED through INSTR_RELOC */
+
+extern qword *alloc_instr_flags(dword length);
+extern size_t instr_flags_size(dword length);
+
+static inline qword *instr_flag_word(const qword *flags, dword i, byte flag)
+{
+    return (qword *)&flags[(i / 64) * INSTR_FLAG_BITS + __builtin_ctz(flag)];
+}
+
+static inline int has_instr_flag(const qword *flags, dword i, byte flag)
+{
+    return (__atomic_load_n(instr_flag_word(flags, i, flag), __ATOMIC_RELAXED) >> (i % 64)) & 1;
+}
+
+static inline byte get_instr_flags(const qword *flags, dword i)
+{
+    const qword *words = &flags[(i / 64) * INSTR_FLAG_BITS];
+    byte ret = 0;
+    int bit;
+
+    for (bit = 0; bit < INSTR_FLAG_BITS; bit++)
+        ret |= ((__atomic_load_n(&words[bit], __ATOMIC_RELAXED) >> (i % 64)) & 1) << bit;
+    return ret;
+}
+
+/* Sets flags on byte i, and returns which of them were already set. */
+static inline byte set_instr_flags(qword *flags, dword i, byte set)
+{
+    qword *words = &flags[(i / 64) * INSTR_FLAG_BITS];
+    qword mask = 1ull << (i % 64);
+    byte ret = 0;
+    int bit;
+
+    for (bit = 0; bit < INSTR_FLAG_BITS; bit++) {
+        if ((set & (1 << bit)) && (__atomic_fetch_or(&words[bit], mask, __ATOMIC_RELAXED) & mask))
+            ret |= 1 << bit;
+    }
+    return ret;
+}
+
+/* Sets one flag on bytes start through end - 1. */
+static inline void set_instr_flag_range(qword *flags, dword start, dword end, byte flag)
+{
+    while (start < end) {
+        dword count = min(end - start, 64 - start % 64);
+        qword mask = (count == 64 ? ~0ull : ((1ull << count) - 1)) << (start % 64);
+
+        __atomic_fetch_or(instr_flag_word(flags, start, flag), mask, __ATOMIC_RELAXED);
+        start += count;
+    }
+}
+
+/* Returns the first byte from i up to end that has flag, or end if none do. */
+static inline dword find_instr_flag(const qword *flags, dword i, dword end, byte flag)
+{
+    qword word;
+
+    if (i >= end)
+        return end;
+    word = __atomic_load_n(instr_flag_word(flags, i, flag), __ATOMIC_RELAXED) & (~0ull << (i % 64));
+    i &= ~63;
+    while (!word) {
+        if (end - i <= 64)
+            return end;
+        i += 64;
+        word = __atomic_load_n(instr_flag_word(flags, i, flag), __ATOMIC_RELAXED);
+    }
+    return min(i + __builtin_ctzll(word), end);
+}
+
+/* Instructions decoded while scanning, kept so that printing doesn't have to
+ * decode them again. While scanning, records are appended in scan order along
+ * with their offsets. decode_cache_finish() then sorts them by address, so
+ * that the record of the instruction at an offset can be found by counting
+ * the bits set before it in a bitmap of instruction starts. The distinct ops
+ * are kept once, in a table of their own. */
+struct decode_cache {
+    struct instr_record *entries;
+    size_t count, capacity;
+    dword *offsets;     /* offset of each record, until finished */
+    qword *starts;      /* bitmap of offsets which have a record */
+    dword *ranks;       /* number of records before each word of starts */
+    struct op *ops;
+    word *op_hash;      /* index into ops + 1, or 0 */
+    unsigned op_count, op_capacity;
+    dword base, length;
+    pthread_mutex_t lock;   /* taken while adding, if scanning on several threads */
+};
+
+extern void decode_cache_init(struct decode_cache *cache, dword base, dword length);
+extern void decode_cache_add(struct decode_cache *cache, dword ip, const struct instr *instr, int len);
+extern void decode_cache_finish(struct decode_cache *cache);
+extern int decode_cache_find(const struct decode_cache *cache, dword ip, struct instr *instr);
+extern void decode_cache_free(struct decode_cache *cache);
+
+#endif /* __SCAN_H */
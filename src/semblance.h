@@ -3,8 +3,11 @@
 
 /* Common functions */
 
+#include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
 #include "config.h"
 
 #define STATIC_ASSERT(e) extern void STATIC_ASSERT_(int [(e)?1:-1])
@@ -14,37 +17,147 @@ typedef uint16_t word;
 typedef uint32_t dword;
 typedef uint64_t qword;
 
-extern byte *map;
+/* Output. Everything we print is formatted into a buffer owned by the caller,
+ * and written out with one write() when it fills up. If fd is -1, the buffer
+ * is allocated by us and grows instead, and the caller frees it. */
+struct output {
+    char *buf;
+    size_t len, size;
+    int fd;
+};
+
+extern void output_init(struct output *out, char *buf, size_t size, int fd);
+extern void output_flush(struct output *out);
+extern void output_reserve(struct output *out, size_t len);
+extern void out_write(struct output *out, const char *s, size_t len);
+extern void out_printf(struct output *out, const char *format, ...);
+extern void out_vprintf(struct output *out, const char *format, va_list args);
+extern void out_hex(struct output *out, qword value, int width);
+extern void out_dec(struct output *out, long value);
+extern char *fmt_hex(char *p, qword value, int width, int upper);
+extern char *fmt_hex_line(char *p, const byte *data, int len);
+extern void out_hex_line(struct output *out, const byte *data, int len);
+
+static inline void out_putc(struct output *out, char c)
+{
+    if (out->len == out->size)
+        output_reserve(out, 1);
+    out->buf[out->len++] = c;
+}
+
+static inline void out_puts(struct output *out, const char *s)
+{
+    out_write(out, s, strlen(s));
+}
 
-static inline const void *read_data(off_t offset)
+/* A file being dumped: its contents, and where its output goes. Everything we
+ * read from the file or print about it goes through one of these, so several
+ * files can be dumped at once. */
+struct image {
+    const byte *map;    /* the whole file, or NULL if it's read in windows */
+    off_t size;
+    struct output *out;
+    struct image_file *file;
+};
+
+/* Reads are checked, so that a corrupt file can't crash us. Any offset in the
+ * file can be read from, and at least IMAGE_SLACK bytes after it; anything
+ * past the end of the file reads as zeroes. Reading at an offset outside the
+ * file gives zeroes too, and marks the image as corrupt (see image_error()).
+ * Checking is just one well-predicted comparison, so it's always on. */
+#define IMAGE_SLACK     (128 * 1024)
+
+extern int image_open(struct image *image, const char *name, struct output *out);
+extern void image_close(struct image *image);
+extern int image_error(const struct image *image);
+extern const byte *image_window(const struct image *image, off_t offset, size_t len, int pin);
+
+/* length bytes of the file at offset, to be placed at address */
+struct image_extent {
+    off_t offset;
+    dword address;
+    dword length;
+};
+
+extern const byte *image_map_virtual(const struct image *image, const struct image_extent *extents,
+        unsigned count, dword size);
+extern void image_unmap_virtual(const byte *view, dword size);
+
+static inline int in_image(const struct image *image, off_t offset)
 {
-    return map + offset;
+    return (qword)offset < (qword)image->size;
 }
 
-static inline byte read_byte(off_t offset)
+/* How much of length bytes at offset is actually in the file. Lengths read
+ * from the file are clamped with this before being walked, so that a corrupt
+ * one can't have us print zeroes for gigabytes. */
+static inline qword image_clamp(const struct image *image, off_t offset, qword length)
 {
-    return map[offset];
+    if (!in_image(image, offset))
+        return 0;
+    return (length < (qword)(image->size - offset)) ? length : (qword)(image->size - offset);
 }
 
-static inline word read_word(off_t offset)
+/* Returns a pointer to len bytes of the file, which is only good until the
+ * next read. */
+static inline const byte *read_bytes(const struct image *image, off_t offset, size_t len)
 {
-    return *(word *)(map + offset);
+    if (image->map && in_image(image, offset))
+        return image->map + offset;
+    return image_window(image, offset, len, 0);
 }
 
-static inline dword read_dword(off_t offset)
+/* Returns a pointer into the file that lasts as long as the image does. */
+static inline const void *read_data(const struct image *image, off_t offset)
 {
-    return *(dword *)(map + offset);
+    if (image->map && in_image(image, offset))
+        return image->map + offset;
+    return image_window(image, offset, IMAGE_SLACK, 1);
 }
 
-static inline qword read_qword(off_t offset)
+static inline byte read_byte(const struct image *image, off_t offset)
+{
+    return *read_bytes(image, offset, sizeof(byte));
+}
+
+/* These may be unaligned; memcpy() compiles to a plain load where that's
+ * allowed. */
+
+static inline word read_word(const struct image *image, off_t offset)
 {
-    return *(qword *)(map + offset);
+    word value;
+    memcpy(&value, read_bytes(image, offset, sizeof(value)), sizeof(value));
+    return value;
+}
+
+static inline dword read_dword(const struct image *image, off_t offset)
+{
+    dword value;
+    memcpy(&value, read_bytes(image, offset, sizeof(value)), sizeof(value));
+    return value;
+}
+
+static inline qword read_qword(const struct image *image, off_t offset)
+{
+    qword value;
+    memcpy(&value, read_bytes(image, offset, sizeof(value)), sizeof(value));
+    return value;
 }
 
 #define min(a,b) (((a)<(b))?(a):(b))
+#define max(a,b) (((a)>(b))?(a):(b))
+
+/* Warnings go to stderr, unless this thread is collecting them in
+ * warn_output (see sweep.c). Before a warning goes to stderr, the complete
+ * lines in this thread's warn_stdout (if any) are written out, so that the
+ * warning shows up next to the output it's about. */
+extern __thread struct output *warn_output;
+extern __thread struct output *warn_stdout;
+extern void warn_printf(const char *format, ...);
+extern void warn_write(const char *s, size_t len);
 
 #ifdef USE_WARN
-#define warn(...)       fprintf(stderr, "Warning: " __VA_ARGS__)
+#define warn(...)       warn_printf("Warning: " __VA_ARGS__)
 #else
 #define warn(...)
 #endif
@@ -80,12 +193,16 @@ extern const size_t rsrc_types_count;
 extern char **resource_filters;
 extern unsigned resource_filters_count;
 
-/* Whether to print addresses relative to the image base for PE files. */
+/* Whether to print addresses relative to the image base for PE files, or -1
+ * to decide for each file. */
 extern int pe_rel_addr;
 
+/* Whether to lay PE sections out by address, as a loader would. */
+extern int pe_map_sections;
+
 /* Entry points */
-void dumpmz(void);
-void dumpne(off_t offset_ne);
-void dumppe(off_t offset_pe);
+void dumpmz(const struct image *image);
+void dumpne(const struct image *image, off_t offset_ne);
+void dumppe(const struct image *image, off_t offset_pe);
 
 #endif /* SEMBLANCE_H */
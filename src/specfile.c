@@ -0,0 +1,147 @@
+/*
+ * Loading specfiles of imported modules
+ *
+ * Copyright 2017-2020 Zebediah Figura
+ *
+ * This file is part of Semblance.
+ *
+ * Semblance is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Semblance is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Semblance; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "semblance.h"
+#include "ne.h"
+#include "specfile.h"
+
+/* Every module we've looked for, whether or not its specfile was found. */
+static struct specfile *specfiles;
+static pthread_mutex_t specfile_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void grow_names(struct specfile *spec, unsigned count)
+{
+    spec->names = realloc(spec->names, count * sizeof(*spec->names));
+    memset(spec->names + spec->count, 0, (count - spec->count) * sizeof(*spec->names));
+    spec->count = count;
+}
+
+static void set_name(struct specfile *spec, unsigned ordinal, const char *name, int copy)
+{
+    /* if an ordinal is listed twice, the first one wins */
+    if (spec->names[ordinal])
+        return;
+
+    if ((opts & DEMANGLE) && name[0] == '?')
+        spec->names[ordinal] = demangle(strdup(name));
+    else
+        spec->names[ordinal] = copy ? strdup(name) : name;
+}
+
+/* Read each "ordinal<tab>name" line straight into the ordinal's slot. */
+static void read_specfile(struct specfile *spec, FILE *f)
+{
+    char line[300], *p;
+    unsigned long ordinal;
+
+    while (fgets(line, sizeof(line), f)) {
+        if (line[0] == '#' || line[0] == '\n') continue;
+        if ((p = strchr(line, '\n'))) *p = 0;   /* kill final newline */
+
+        ordinal = strtoul(line, &p, 10);
+        if (p == line || ordinal > 0xffff) {
+            fprintf(stderr, "Error reading specfile near line: `%s'\n", line);
+            continue;
+        }
+
+        if (ordinal >= spec->count)
+            grow_names(spec, ordinal + 1 > spec->count * 2 ? ordinal + 1 : spec->count * 2);
+        if ((p = strchr(line, '\t')))
+            set_name(spec, ordinal, p + 1, 1);
+    }
+}
+
+static int compare_module_name(const void *key, const void *entry)
+{
+    return strcmp(key, specdb_names + ((const struct specdb_module *)entry)->name);
+}
+
+/* Fill in a module from the built-in database. The names point straight into
+ * it, except for those that have to be demangled. */
+static int read_specdb(struct specfile *spec, const char *module)
+{
+    const struct specdb_module *m;
+    const struct specdb_export *e;
+    dword i;
+
+    if (!(m = bsearch(module, specdb_modules, specdb_module_count, sizeof(*m), compare_module_name)))
+        return 0;
+
+    e = &specdb_exports[m->first];
+    grow_names(spec, m->count ? e[m->count - 1].ordinal + 1 : 0);
+    for (i = 0; i < m->count; i++) {
+        if (e[i].name != SPECDB_NO_NAME)
+            set_name(spec, e[i].ordinal, specdb_names + e[i].name, 0);
+    }
+    return 1;
+}
+
+/* Returns the specfile for a module, loading it if this is the first time it's
+ * been asked for, or NULL if there is none.
+ *
+ * A specfile in the current directory (as written by -o) takes precedence over
+ * the database built from spec/. spec/ in the current directory is still read
+ * for modules that the database doesn't have. */
+const struct specfile *get_specfile(const char *module)
+{
+    char spec_name[300];
+    struct specfile *spec;
+    FILE *f;
+
+    pthread_mutex_lock(&specfile_lock);
+
+    for (spec = specfiles; spec; spec = spec->next) {
+        if (!strcmp(spec->module, module))
+            break;
+    }
+
+    if (!spec) {
+        spec = calloc(1, sizeof(*spec));
+        spec->module = strdup(module);
+        spec->next = specfiles;
+        specfiles = spec;
+
+        snprintf(spec_name, sizeof(spec_name), "%s.ORD", module);
+        if (!(f = fopen(spec_name, "r")) && !read_specdb(spec, module)) {
+            snprintf(spec_name, sizeof(spec_name), "spec/%s.ORD", module);
+            f = fopen(spec_name, "r");
+            if (!f) {
+                fprintf(stderr, "Note: couldn't find specfile for module %s; exported names won't be given.\n", module);
+                fprintf(stderr, "      To create a specfile, run `dump -o <module.dll>'.\n");
+            }
+        }
+
+        if (f) {
+            read_specfile(spec, f);
+            fclose(f);
+        }
+    }
+
+    pthread_mutex_unlock(&specfile_lock);
+
+    return spec->names ? spec : NULL;
+}
@@ -0,0 +1,44 @@
+#ifndef __SPECFILE_H
+#define __SPECFILE_H
+
+#include "semblance.h"
+
+/* The exported names of a module, as listed in its specfile, indexed by
+ * ordinal. Specfiles are loaded at most once per run and kept until exit, so
+ * these may be shared freely between files and threads. */
+struct specfile {
+    struct specfile *next;
+    char *module;
+    const char **names; /* NULL for ordinals not listed */
+    unsigned count;     /* size of names */
+};
+
+/* The specfiles in spec/, compiled into the program by mkspecdb. Names are
+ * offsets into specdb_names. Modules are sorted by name, and each module's
+ * exports by ordinal. */
+#define SPECDB_NO_NAME  0xffffffff
+
+struct specdb_export {
+    word ordinal;
+    dword name;         /* or SPECDB_NO_NAME */
+};
+
+struct specdb_module {
+    dword name;
+    dword first;        /* index into specdb_exports */
+    dword count;
+};
+
+extern const char specdb_names[];
+extern const struct specdb_export specdb_exports[];
+extern const struct specdb_module specdb_modules[];
+extern const unsigned specdb_module_count;
+
+extern const struct specfile *get_specfile(const char *module);
+
+static inline const char *specfile_name(const struct specfile *spec, unsigned ordinal)
+{
+    return (spec && ordinal < spec->count) ? spec->names[ordinal] : NULL;
+}
+
+#endif /* __SPECFILE_H */
@@ -0,0 +1,349 @@
+/*
+ * Printing sections and sweeping code on several threads
+ *
+ * Copyright 2017-2020 Zebediah Figura
+ *
+ * This file is part of Semblance.
+ *
+ * Semblance is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Semblance is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Semblance; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "semblance.h"
+#include "sweep.h"
+
+/* A large segment is split into chunks, and each chunk is swept on a worker
+ * thread, starting from its first byte. That may well be in the middle of an
+ * instruction, so each chunk records where every step it printed started, and
+ * where its output and warnings for that step start.
+ *
+ * The chunks are then stitched together in order. The true sweep enters each
+ * chunk at some position; since a step depends only on where it starts, once
+ * the true sweep lands on a step that the chunk's worker also took, the rest of
+ * the chunk's output is exactly what the true sweep would print. Until then
+ * (usually only a few bytes, as x86 code resynchronizes quickly), the stitcher
+ * sweeps serially. The output is therefore the same as a serial sweep's.
+ *
+ * Workers may only run a limited distance ahead of the stitcher, so that we
+ * don't end up holding the output of the whole segment at once. */
+
+#define CHUNK_SIZE      0x10000
+
+int sweep_threads = 1;
+
+struct step {
+    dword pos;
+    size_t out, warn;   /* offsets of this step's output and warnings */
+};
+
+struct chunk {
+    dword start, end;
+    struct output out, warnings;
+    struct step *steps;
+    size_t count, capacity;
+    dword exit;         /* where the worker's last step ended */
+    int done;
+};
+
+struct sweep_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    sweep_func step;
+    void *ctx;
+    struct chunk *chunks;
+    unsigned count;
+    unsigned next;      /* next chunk to hand out */
+    unsigned stitched;  /* number of chunks the stitcher is done with */
+    unsigned window;    /* how far ahead of stitched a chunk may be started */
+};
+
+static void sweep_chunk(struct sweep_pool *pool, struct chunk *chunk)
+{
+    dword pos = chunk->start;
+
+    output_init(&chunk->out, NULL, 0, -1);
+    output_init(&chunk->warnings, NULL, 0, -1);
+    warn_output = &chunk->warnings;
+
+    while (pos < chunk->end) {
+        if (chunk->count == chunk->capacity) {
+            chunk->capacity = chunk->capacity ? chunk->capacity * 2 : 4096;
+            chunk->steps = realloc(chunk->steps, chunk->capacity * sizeof(*chunk->steps));
+        }
+        chunk->steps[chunk->count].pos = pos;
+        chunk->steps[chunk->count].out = chunk->out.len;
+        chunk->steps[chunk->count].warn = chunk->warnings.len;
+        chunk->count++;
+
+        pos = pool->step(pos, &chunk->out, pool->ctx);
+    }
+    chunk->exit = pos;
+
+    warn_output = NULL;
+}
+
+static void *sweep_thread(void *arg)
+{
+    struct sweep_pool *pool = arg;
+    struct chunk *chunk;
+
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->next < pool->count && pool->next >= pool->stitched + pool->window)
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        if (pool->next == pool->count) {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        chunk = &pool->chunks[pool->next++];
+        pthread_mutex_unlock(&pool->lock);
+
+        sweep_chunk(pool, chunk);
+
+        pthread_mutex_lock(&pool->lock);
+        chunk->done = 1;
+        pthread_cond_broadcast(&pool->cond);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+/* Continue the true sweep, at pos, through a chunk. */
+static dword stitch_chunk(struct sweep_pool *pool, struct chunk *chunk, dword pos, struct output *out)
+{
+    size_t i = 0;
+
+    while (pos < chunk->end) {
+        while (i < chunk->count && chunk->steps[i].pos < pos)
+            i++;
+        if (i < chunk->count && chunk->steps[i].pos == pos) {
+            out_write(out, chunk->out.buf + chunk->steps[i].out, chunk->out.len - chunk->steps[i].out);
+            warn_write(chunk->warnings.buf + chunk->steps[i].warn, chunk->warnings.len - chunk->steps[i].warn);
+            return chunk->exit;
+        }
+        pos = pool->step(pos, out, pool->ctx);
+    }
+    return pos;
+}
+
+static void free_chunk(struct chunk *chunk)
+{
+    free(chunk->out.buf);
+    free(chunk->warnings.buf);
+    free(chunk->steps);
+}
+
+/* Sweep from start to end, calling step for each step. Returns where the last
+ * step ended: at or past end, or SWEEP_END. */
+dword sweep(const struct image *image, dword start, dword end, sweep_func step, struct output *out, void *ctx)
+{
+    struct sweep_pool pool = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, step, ctx};
+    unsigned nthreads = sweep_threads, started, i;
+    pthread_t *threads;
+    dword pos = start;
+
+    /* Windows into files that can't be mapped whole may be unmapped by one
+     * thread while another is reading them, so those are swept serially. */
+    if (nthreads <= 1 || !image->map || end - start < 2 * CHUNK_SIZE) {
+        while (pos < end)
+            pos = step(pos, out, ctx);
+        return pos;
+    }
+
+    pool.count = (end - start + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    pool.chunks = calloc(pool.count, sizeof(*pool.chunks));
+    for (i = 0; i < pool.count; i++) {
+        pool.chunks[i].start = start + i * CHUNK_SIZE;
+        pool.chunks[i].end = min(end, pool.chunks[i].start + CHUNK_SIZE);
+    }
+    pool.window = nthreads * 2;
+
+    threads = malloc(nthreads * sizeof(*threads));
+    for (started = 0; started < nthreads; started++) {
+        if ((errno = pthread_create(&threads[started], NULL, sweep_thread, &pool))) {
+            perror("Cannot create thread");
+            break;
+        }
+    }
+
+    for (i = 0; i < pool.count; i++) {
+        struct chunk *chunk = &pool.chunks[i];
+
+        if (started) {
+            pthread_mutex_lock(&pool.lock);
+            while (!chunk->done)
+                pthread_cond_wait(&pool.cond, &pool.lock);
+            pthread_mutex_unlock(&pool.lock);
+        }
+
+        /* A skipped run of bytes may have carried us past this chunk. */
+        if (pos < chunk->end) {
+            if (chunk->done)
+                pos = stitch_chunk(&pool, chunk, pos, out);
+            else {
+                while (pos < chunk->end)
+                    pos = step(pos, out, ctx);
+            }
+        }
+        free_chunk(chunk);
+
+        pthread_mutex_lock(&pool.lock);
+        pool.stitched = i + 1;
+        if (pos == SWEEP_END)
+            pool.count = pool.next;     /* don't start any more */
+        pthread_cond_broadcast(&pool.cond);
+        pthread_mutex_unlock(&pool.lock);
+
+        if (pos == SWEEP_END)
+            break;
+    }
+
+    for (i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+
+    /* free anything swept after the sweep ended */
+    for (i = 0; i < pool.next; i++) {
+        if (i >= pool.stitched)
+            free_chunk(&pool.chunks[i]);
+    }
+    free(pool.chunks);
+
+    return pos;
+}
+
+/* Sections (or segments) are printed on a pool of threads in much the same
+ * way that dump_files() prints files: each is formatted into memory, together
+ * with its warnings, and written out in order. Those big enough to be swept in
+ * chunks are instead printed on the calling thread when their turn comes, so
+ * that their chunks can use the threads. The pool's own threads wait until
+ * such a section has been written before starting anything after it, so that
+ * there are never more than N threads at work. */
+
+struct print_job {
+    struct output out, warnings;
+    int own;            /* printed by the calling thread */
+    int done;
+};
+
+struct print_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    print_func print;
+    void *ctx;
+    struct print_job *jobs;
+    unsigned count;
+    unsigned next;      /* next job to hand out */
+    unsigned written;   /* number of jobs whose output has been written */
+    unsigned window;    /* how far ahead of written a job may be started */
+    unsigned own_next;  /* one past the last own job handed out */
+};
+
+static void *print_thread(void *arg)
+{
+    struct print_pool *pool = arg;
+    struct print_job *job;
+    unsigned index;
+
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->next < pool->count && (pool->next >= pool->written + pool->window
+                || pool->own_next > pool->written))
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        if (pool->next == pool->count) {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        index = pool->next++;
+        job = &pool->jobs[index];
+        if (job->own)
+            pool->own_next = index + 1;
+        pthread_mutex_unlock(&pool->lock);
+
+        if (job->own)
+            continue;
+
+        output_init(&job->out, NULL, 0, -1);
+        output_init(&job->warnings, NULL, 0, -1);
+        warn_output = &job->warnings;
+        pool->print(index, &job->out, pool->ctx);
+        warn_output = NULL;
+
+        pthread_mutex_lock(&pool->lock);
+        job->done = 1;
+        pthread_cond_broadcast(&pool->cond);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+/* Print count sections, in order. size returns how much of each will be
+ * disassembled, which is what decides where it is printed. */
+void print_in_order(const struct image *image, unsigned count, print_func print,
+        dword (*size)(unsigned index, void *ctx), struct output *out, void *ctx)
+{
+    struct print_pool pool = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, print, ctx};
+    unsigned nthreads = sweep_threads, started, i;
+    pthread_t *threads;
+
+    if (nthreads <= 1 || !image->map || count < 2) {
+        for (i = 0; i < count; i++)
+            print(i, out, ctx);
+        return;
+    }
+
+    pool.jobs = calloc(count, sizeof(*pool.jobs));
+    for (i = 0; i < count; i++)
+        pool.jobs[i].own = (size(i, ctx) >= 2 * CHUNK_SIZE);
+    pool.count = count;
+    pool.window = nthreads * 2;
+
+    threads = malloc(nthreads * sizeof(*threads));
+    for (started = 0; started < nthreads; started++) {
+        if ((errno = pthread_create(&threads[started], NULL, print_thread, &pool))) {
+            perror("Cannot create thread");
+            break;
+        }
+    }
+
+    for (i = 0; i < count; i++) {
+        struct print_job *job = &pool.jobs[i];
+
+        if (job->own || !started)
+            print(i, out, ctx);
+        else {
+            pthread_mutex_lock(&pool.lock);
+            while (!job->done)
+                pthread_cond_wait(&pool.cond, &pool.lock);
+            pthread_mutex_unlock(&pool.lock);
+
+            out_write(out, job->out.buf, job->out.len);
+            warn_write(job->warnings.buf, job->warnings.len);
+            free(job->out.buf);
+            free(job->warnings.buf);
+        }
+
+        pthread_mutex_lock(&pool.lock);
+        pool.written = i + 1;
+        pthread_cond_broadcast(&pool.cond);
+        pthread_mutex_unlock(&pool.lock);
+    }
+
+    for (i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    free(pool.jobs);
+}
@@ -0,0 +1,24 @@
+#ifndef __SWEEP_H
+#define __SWEEP_H
+
+#include "semblance.h"
+
+/* Print one step of a linear sweep through a segment (an instruction, or a run
+ * of bytes being skipped) starting at pos, and return where the next step
+ * starts. This must depend only on pos, and not on any earlier steps.
+ * Returns SWEEP_END if the sweep should stop without reaching the end. */
+typedef dword (*sweep_func)(dword pos, struct output *out, void *ctx);
+
+#define SWEEP_END       0xffffffff
+
+/* Print one section or segment, by index, to out. */
+typedef void (*print_func)(unsigned index, struct output *out, void *ctx);
+
+/* number of threads to print a file with */
+extern int sweep_threads;
+
+extern dword sweep(const struct image *image, dword start, dword end, sweep_func step, struct output *out, void *ctx);
+extern void print_in_order(const struct image *image, unsigned count, print_func print,
+        dword (*size)(unsigned index, void *ctx), struct output *out, void *ctx);
+
+#endif /* __SWEEP_H */
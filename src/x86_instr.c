@@ -20,6 +20,7 @@
  * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
  */
 
+#include <pthread.h>
 #include <string.h>
 #include "x86_instr.h"
 
@@ -1476,30 +1477,79 @@ static word get_prefix(word opcode, int bits) {
     }
 }
 
-static int instr_matches(const byte opcode, const byte subcode, const struct op *op) {
-    return ((opcode == op->opcode) && ((op->subcode == 8) || (subcode == op->subcode)));
+/* Direct-indexed dispatch tables for the opcode tables above, so that looking
+ * up an instruction doesn't mean searching one of them. Each slot points to
+ * the entry a linear search of its table would have found first, so the order
+ * of the tables above still decides which entry wins. They're filled in the
+ * first time we decode something. */
+
+struct op_index {
+    const struct op *ops[256][8];   /* by opcode and reg field */
+};
+
+static struct op_index index_group, index_0F;
+static struct op_index index_sse, index_sse_op32, index_sse_repne, index_sse_repe;
+
+/* by opcode (0x38 or 0x3A) and the following byte */
+static const struct op *index_sse_single[2][256];
+static const struct op *index_sse_single_op32[2][256];
+
+static pthread_once_t index_once = PTHREAD_ONCE_INIT;
+
+/* A subcode of 8 matches any reg field. */
+static void fill_index(struct op_index *index, const struct op *ops, size_t count) {
+    size_t i;
+    unsigned reg;
+
+    for (i = 0; i < count; i++) {
+        for (reg = 0; reg < 8; reg++) {
+            const struct op **slot = &index->ops[ops[i].opcode & 0xff][reg];
+            if (!*slot && (ops[i].subcode == 8 || ops[i].subcode == reg))
+                *slot = &ops[i];
+        }
+    }
+}
+
+static void fill_single_index(const struct op *index[2][256], const struct op *ops, size_t count) {
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        const struct op **slot = &index[ops[i].opcode == 0x3A][ops[i].subcode];
+        if (!*slot)
+            *slot = &ops[i];
+    }
+}
+
+static void build_indices(void) {
+    fill_index(&index_group, instructions_group, sizeof(instructions_group)/sizeof(struct op));
+    fill_index(&index_0F, instructions_0F, sizeof(instructions_0F)/sizeof(struct op));
+    fill_index(&index_sse, instructions_sse, sizeof(instructions_sse)/sizeof(struct op));
+    fill_index(&index_sse_op32, instructions_sse_op32, sizeof(instructions_sse_op32)/sizeof(struct op));
+    fill_index(&index_sse_repne, instructions_sse_repne, sizeof(instructions_sse_repne)/sizeof(struct op));
+    fill_index(&index_sse_repe, instructions_sse_repe, sizeof(instructions_sse_repe)/sizeof(struct op));
+    fill_single_index(index_sse_single, instructions_sse_single,
+        sizeof(instructions_sse_single)/sizeof(struct op));
+    fill_single_index(index_sse_single_op32, instructions_sse_single_op32,
+        sizeof(instructions_sse_single_op32)/sizeof(struct op));
 }
 
 /* aka 3 byte opcode */
 static int get_sse_single(byte opcode, byte subcode, struct instr *instr) {
-    int i;
+    const struct op *op;
+
+    if (opcode != 0x38 && opcode != 0x3A)
+        return 0;
 
     if (instr->prefix & PREFIX_OP32) {
-        for (i = 0; i < sizeof(instructions_sse_single_op32)/sizeof(struct op); i++) {
-            if (instructions_sse_single_op32[i].opcode == opcode &&
-                instructions_sse_single_op32[i].subcode == subcode) {
-                instr->op = instructions_sse_single_op32[i];
-                instr->prefix &= ~PREFIX_OP32;
-                return 1;
-            }
+        if ((op = index_sse_single_op32[opcode == 0x3A][subcode])) {
+            instr->op = *op;
+            instr->prefix &= ~PREFIX_OP32;
+            return 1;
         }
     } else {
-        for (i = 0; i < sizeof(instructions_sse_single)/sizeof(struct op); i++) {
-            if (instructions_sse_single[i].opcode == opcode &&
-                instructions_sse_single[i].subcode == subcode) {
-                instr->op = instructions_sse_single[i];
-                return 1;
-            }
+        if ((op = index_sse_single[opcode == 0x3A][subcode])) {
+            instr->op = *op;
+            return 1;
         }
     }
 
@@ -1508,42 +1558,34 @@ static int get_sse_single(byte opcode, byte subcode, struct instr *instr) {
 
 static int get_sse_instr(const byte *p, struct instr *instr) {
     byte subcode = REGOF(p[1]);
-    unsigned i;
+    const struct op *op;
 
     /* Clear the prefix if it matches. This makes the disassembler work right,
      * but it might break things later if we want to interpret these. The
      * solution in that case is probably to modify the size/name instead. */
 
     if (instr->prefix & PREFIX_OP32) {
-        for (i = 0; i < sizeof(instructions_sse_op32)/sizeof(struct op); i++) {
-            if (instr_matches(p[0], subcode, &instructions_sse_op32[i])) {
-                instr->op = instructions_sse_op32[i];
-                instr->prefix &= ~PREFIX_OP32;
-                return 0;
-            }
+        if ((op = index_sse_op32.ops[p[0]][subcode])) {
+            instr->op = *op;
+            instr->prefix &= ~PREFIX_OP32;
+            return 0;
         }
     } else if (instr->prefix & PREFIX_REPNE) {
-        for (i = 0; i < sizeof(instructions_sse_repne)/sizeof(struct op); i++) {
-            if (instr_matches(p[0], subcode, &instructions_sse_repne[i])) {
-                instr->op = instructions_sse_repne[i];
-                instr->prefix &= ~PREFIX_REPNE;
-                return 0;
-            }
+        if ((op = index_sse_repne.ops[p[0]][subcode])) {
+            instr->op = *op;
+            instr->prefix &= ~PREFIX_REPNE;
+            return 0;
         }
     } else if (instr->prefix & PREFIX_REPE) {
-        for (i = 0; i < sizeof(instructions_sse_repe)/sizeof(struct op); i++) {
-            if (instr_matches(p[0], subcode, &instructions_sse_repe[i])) {
-                instr->op = instructions_sse_repe[i];
-                instr->prefix &= ~PREFIX_REPE;
-                return 0;
-            }
+        if ((op = index_sse_repe.ops[p[0]][subcode])) {
+            instr->op = *op;
+            instr->prefix &= ~PREFIX_REPE;
+            return 0;
         }
     } else {
-        for (i = 0; i < sizeof(instructions_sse)/sizeof(struct op); i++) {
-            if (instr_matches(p[0], subcode, &instructions_sse[i])) {
-                instr->op = instructions_sse[i];
-                return 0;
-            }
+        if ((op = index_sse.ops[p[0]][subcode])) {
+            instr->op = *op;
+            return 0;
         }
     }
 
@@ -1552,7 +1594,7 @@ static int get_sse_instr(const byte *p, struct instr *instr) {
 
 static int get_0f_instr(const byte *p, struct instr *instr) {
     byte subcode = REGOF(p[1]);
-    unsigned i;
+    const struct op *op;
     int len;
 
     /* a couple of special (read: annoying) cases first */
@@ -1580,12 +1622,9 @@ static int get_0f_instr(const byte *p, struct instr *instr) {
         return 1;
     }
 
-    for (i = 0; i < sizeof(instructions_0F)/sizeof(struct op); i++) {
-        if (instr_matches(p[0], subcode, &instructions_0F[i])) {
-            instr->op = instructions_0F[i];
-            len = 0;
-            break;
-        }
+    if ((op = index_0F.ops[p[0]][subcode])) {
+        instr->op = *op;
+        len = 0;
     }
     if (!instr->op.name[0])
         len = get_sse_instr(p, instr);
@@ -1855,20 +1894,51 @@ static int is_reg(enum argtype arg) {
 
 #ifdef USE_WARN
 #define warn_at(...) \
-    do { fprintf(stderr, "Warning: %s: ", ip); \
-        fprintf(stderr, __VA_ARGS__); } while(0)
+    do { warn_printf("Warning: %s: ", ip); \
+        warn_printf(__VA_ARGS__); } while(0)
 #else
 #define warn_at(...)
 #endif
 
 /* With MASM/NASM, use capital letters to help disambiguate them from the following 'h'. */
 
-static void print_arg(char *ip, struct instr *instr, int i, int bits) {
+/* Append value to out in hex, zero-padded to width digits. These replace
+ * sprintf(), which was a noticeable part of the cost of formatting. */
+static void cat_hex(char *out, qword value, int width, int upper) {
+    *fmt_hex(out + strlen(out), value, width, upper) = 0;
+}
+
+/* Append an immediate: $0x<hex> for GAS, <HEX>h otherwise. */
+static void cat_imm(char *out, qword value, int width) {
+    if (asm_syntax == GAS) {
+        strcat(out, "$0x");
+        cat_hex(out, value, width, 0);
+    } else {
+        cat_hex(out, value, width, 1);
+        strcat(out, "h");
+    }
+}
+
+/* As above, but MASM and NASM also get an explicit size. */
+static void cat_sized_imm(char *out, const char *size, qword value, int width) {
+    if (asm_syntax != GAS)
+        strcat(out, size);
+    cat_imm(out, value, width);
+}
+
+/* Append a displacement; the suffix decides the case, as with immediates. */
+static void cat_disp(char *out, const char *prefix, qword value, int width, const char *suffix) {
+    strcat(out, prefix);
+    cat_hex(out, value, width, suffix[0] != 0);
+    strcat(out, suffix);
+}
+
+static void print_arg(char *ip, struct instr *instr, struct instr_text *text, int i, int bits) {
     struct arg *arg = &instr->args[i];
-    char *out = arg->string;
+    char *out = text->args[i];
     qword value = arg->value;
 
-    if (arg->string[0]) return; /* someone wants to print something special */
+    if (out[0]) return; /* someone wants to print something special */
 
     if (arg->type >= AL && arg->type <= BH)
         get_reg8(out, arg->type-AL, 0);
@@ -1883,40 +1953,47 @@ static void print_arg(char *ip, struct instr *instr, int i, int bits) {
         break;
     case IMM8:
         if (instr->op.flags & OP_STACK) { /* 6a */
-            if (instr->op.size == 64)
-                sprintf(out, (asm_syntax == GAS) ? "$0x%016lx" : "qword %016lxh", (qword) (int8_t) value);
-            else if (instr->op.size == 32)
-                sprintf(out, (asm_syntax == GAS) ? "$0x%08x" : "dword %08Xh", (dword) (int8_t) value);
+            if (instr->op.size == 64) {
+                /* sic: this one has always been printed in lowercase */
+                if (asm_syntax == GAS)
+                    cat_imm(out, (qword) (int8_t) value, 16);
+                else {
+                    strcat(out, "qword ");
+                    cat_hex(out, (qword) (int8_t) value, 16, 0);
+                    strcat(out, "h");
+                }
+            } else if (instr->op.size == 32)
+                cat_sized_imm(out, "dword ", (dword) (int8_t) value, 8);
             else
-                sprintf(out, (asm_syntax == GAS) ? "$0x%04x" : "word %04Xh", (word) (int8_t) value);
+                cat_sized_imm(out, "word ", (word) (int8_t) value, 4);
         } else
-            sprintf(out, (asm_syntax == GAS) ? "$0x%02lx" : "%02lXh", value);
+            cat_imm(out, value, 2);
         break;
     case IMM16:
-        sprintf(out, (asm_syntax == GAS) ? "$0x%04lx" : "%04lXh", value);
+        cat_imm(out, value, 4);
         break;
     case IMM:
         if (instr->op.flags & OP_STACK) {
             if (instr->op.size == 64)
-                sprintf(out, (asm_syntax == GAS) ? "$0x%016lx" : "qword %016lXh", value);
+                cat_sized_imm(out, "qword ", value, 16);
             else if (instr->op.size == 32)
-                sprintf(out, (asm_syntax == GAS) ? "$0x%08lx" : "dword %08lXh", value);
+                cat_sized_imm(out, "dword ", value, 8);
             else
-                sprintf(out, (asm_syntax == GAS) ? "$0x%04lx" : "word %04lXh", value);
+                cat_sized_imm(out, "word ", value, 4);
         } else {
             if (instr->op.size == 8)
-                sprintf(out, (asm_syntax == GAS) ? "$0x%02lx" : "%02lXh", value);
+                cat_imm(out, value, 2);
             else if (instr->op.size == 16)
-                sprintf(out, (asm_syntax == GAS) ? "$0x%04lx" : "%04lXh", value);
+                cat_imm(out, value, 4);
             else if (instr->op.size == 64 && (instr->op.flags & OP_IMM64))
-                sprintf(out, (asm_syntax == GAS) ? "$0x%016lx" : "%016lXh", value);
+                cat_imm(out, value, 16);
             else
-                sprintf(out, (asm_syntax == GAS) ? "$0x%08lx" : "%08lXh", value);
+                cat_imm(out, value, 8);
         }
         break;
     case REL8:
     case REL:
-        sprintf(out, "%04lx", value);
+        cat_hex(out, value, 4, 0);
         break;
     case SEGPTR:
         /* should always be relocated */
@@ -1927,14 +2004,16 @@ static void print_arg(char *ip, struct instr *instr, int i, int bits) {
                 get_seg16(out, (instr->prefix & PREFIX_SEG_MASK)-1);
                 strcat(out, ":");
             }
-            sprintf(out+strlen(out), "0x%04lx", value);
+            strcat(out, "0x");
+            cat_hex(out, value, 4, 0);
         } else {
             out[0] = '[';
             if (instr->prefix & PREFIX_SEG_MASK) {
                 get_seg16(out, (instr->prefix & PREFIX_SEG_MASK)-1);
                 strcat(out, ":");
             }
-            sprintf(out+strlen(out), "%04lXh]", value);
+            cat_hex(out, value, 4, 1);
+            strcat(out, "h]");
         }
         instr->usedmem = 1;
         break;
@@ -2023,29 +2102,29 @@ static void print_arg(char *ip, struct instr *instr, int i, int bits) {
             if (instr->modrm_disp == DISP_8) {
                 int8_t svalue = (int8_t) value;
                 if (svalue < 0)
-                    sprintf(out+strlen(out), "-0x%02x", -svalue);
+                    cat_disp(out, "-0x", -svalue, 2, "");
                 else
-                    sprintf(out+strlen(out), "0x%02x", svalue);
+                    cat_disp(out, "0x", svalue, 2, "");
             } else if (instr->modrm_disp == DISP_16 && instr->addrsize == 16) {
                 int16_t svalue = (int16_t) value;
                 if (instr->modrm_reg == -1) {
-                    sprintf(out+strlen(out), "0x%04lx", value);  /* absolute memory is unsigned */
+                    cat_disp(out, "0x", value, 4, "");  /* absolute memory is unsigned */
                     return;
                 }
                 if (svalue < 0)
-                    sprintf(out+strlen(out), "-0x%04x", -svalue);
+                    cat_disp(out, "-0x", -svalue, 4, "");
                 else
-                    sprintf(out+strlen(out), "0x%04x", svalue);
+                    cat_disp(out, "0x", svalue, 4, "");
             } else if (instr->modrm_disp == DISP_16) {
                 int32_t svalue = (int32_t) value;
                 if (instr->modrm_reg == -1) {
-                    sprintf(out+strlen(out), "0x%08lx", value);  /* absolute memory is unsigned */
+                    cat_disp(out, "0x", value, 8, "");  /* absolute memory is unsigned */
                     return;
                 }
                 if (svalue < 0)
-                    sprintf(out+strlen(out), "-0x%08x", -svalue);
+                    cat_disp(out, "-0x", -(dword) svalue, 8, "");
                 else
-                    sprintf(out+strlen(out), "0x%08x", svalue);
+                    cat_disp(out, "0x", svalue, 8, "");
             }
 
             strcat(out, "(");
@@ -2116,25 +2195,25 @@ static void print_arg(char *ip, struct instr *instr, int i, int bits) {
             if (instr->modrm_disp == DISP_8) {
                 int8_t svalue = (int8_t) value;
                 if (svalue < 0)
-                    sprintf(out+strlen(out), "-%02Xh", -svalue);
+                    cat_disp(out, "-", -svalue, 2, "h");
                 else
-                    sprintf(out+strlen(out), "+%02Xh", svalue);
+                    cat_disp(out, "+", svalue, 2, "h");
             } else if (instr->modrm_disp == DISP_16 && instr->addrsize == 16) {
                 int16_t svalue = (int16_t) value;
                 if (instr->modrm_reg == -1 && !has_sib)
-                    sprintf(out+strlen(out), "%04lXh", value);   /* absolute memory is unsigned */
+                    cat_disp(out, "", value, 4, "h");   /* absolute memory is unsigned */
                 else if (svalue < 0)
-                    sprintf(out+strlen(out), "-%04Xh", -svalue);
+                    cat_disp(out, "-", -svalue, 4, "h");
                 else
-                    sprintf(out+strlen(out), "+%04Xh", svalue);
+                    cat_disp(out, "+", svalue, 4, "h");
             } else if (instr->modrm_disp == DISP_16) {
                 int32_t svalue = (int32_t) value;
                 if (instr->modrm_reg == -1 && !has_sib)
-                    sprintf(out+strlen(out), "%08lXh", value);   /* absolute memory is unsigned */
+                    cat_disp(out, "", value, 8, "h");   /* absolute memory is unsigned */
                 else if (svalue < 0)
-                    sprintf(out+strlen(out), "-%08Xh", -svalue);
+                    cat_disp(out, "-", -(dword) svalue, 8, "h");
                 else
-                    sprintf(out+strlen(out), "+%08Xh", svalue);
+                    cat_disp(out, "+", svalue, 8, "h");
             }
             strcat(out, "]");
         }
@@ -2259,6 +2338,7 @@ int get_instr(dword ip, const byte *p, struct instr *instr, int bits) {
     word prefix;
 
     memset(instr, 0, sizeof(*instr));
+    pthread_once(&index_once, build_indices);
 
     while ((prefix = get_prefix(p[len], bits))) {
         if ((instr->prefix & PREFIX_SEG_MASK) && (prefix & PREFIX_SEG_MASK)) {
@@ -2316,15 +2396,8 @@ int get_instr(dword ip, const byte *p, struct instr *instr, int bits) {
             len += get_0f_instr(p+len, instr);
         } else if (opcode >= 0xD8 && opcode <= 0xDF) {
             len += get_fpu_instr(p+len, &instr->op);
-        } else {
-            unsigned i;
-            for (i=0; i<sizeof(instructions_group)/sizeof(struct op); i++) {
-                if (opcode == instructions_group[i].opcode &&
-                    subcode == instructions_group[i].subcode) {
-                    instr->op = instructions_group[i];
-                    break;
-                }
-            }
+        } else if (index_group.ops[opcode][subcode]) {
+            instr->op = *index_group.ops[opcode][subcode];
         }
 
         /* if we get here and we haven't found a suitable instruction,
@@ -2441,16 +2514,63 @@ int get_instr(dword ip, const byte *p, struct instr *instr, int bits) {
     return len;
 }
 
-void print_instr(char *ip, const byte *p, int len, byte flags, struct instr *instr, const char *comment, int bits) {
+STATIC_ASSERT(STX <= 0xff);
+
+void pack_instr(struct instr_record *record, const struct instr *instr, dword ip, int len, word op) {
     int i;
 
+    record->op = op;
+    record->len = len;
+    for (i = 0; i < 3; i++) {
+        record->values[i] = instr->args[i].value;
+        record->types[i] = instr->args[i].type;
+        /* unused arguments have an address of zero */
+        record->arg_ips[i] = instr->args[i].ip ? instr->args[i].ip - ip : 0xff;
+    }
+    record->prefix = instr->prefix;
+    record->addrsize = instr->addrsize;
+    record->modrm_disp = instr->modrm_disp;
+    record->modrm_reg = instr->modrm_reg;
+    record->sib_scale = instr->sib_scale;
+    record->sib_index = instr->sib_index;
+    record->usedmem = instr->usedmem;
+    record->vex = instr->vex;
+    record->vex_reg = instr->vex_reg;
+    record->vex_256 = instr->vex_256;
+}
+
+/* Returns the length of the instruction. */
+int unpack_instr(struct instr *instr, const struct instr_record *record, dword ip, const struct op *op) {
+    int i;
+
+    instr->op = *op;
+    for (i = 0; i < 3; i++) {
+        instr->args[i].value = record->values[i];
+        instr->args[i].type = record->types[i];
+        instr->args[i].ip = (record->arg_ips[i] == 0xff) ? 0 : ip + record->arg_ips[i];
+    }
+    instr->prefix = record->prefix;
+    instr->addrsize = record->addrsize;
+    instr->modrm_disp = record->modrm_disp;
+    instr->modrm_reg = record->modrm_reg;
+    instr->sib_scale = record->sib_scale;
+    instr->sib_index = record->sib_index;
+    instr->usedmem = record->usedmem;
+    instr->vex = record->vex;
+    instr->vex_reg = record->vex_reg;
+    instr->vex_256 = record->vex_256;
+    return record->len;
+}
+
+/* Fill in the argument strings, and check the prefixes. */
+void format_instr(char *ip, struct instr *instr, struct instr_text *text, int bits) {
     /* FIXME: now that we've had to add bits to this function, get rid of ip_string */
 
     /* get the arguments */
 
-    print_arg(ip, instr, 0, bits);
-    print_arg(ip, instr, 1, bits);
-    print_arg(ip, instr, 2, bits);
+    print_arg(ip, instr, text, 0, bits);
+    print_arg(ip, instr, text, 1, bits);
+    print_arg(ip, instr, text, 2, bits);
 
     /* did we find too many prefixes? */
     if (get_prefix(instr->op.opcode, bits)) {
@@ -2465,111 +2585,132 @@ void print_instr(char *ip, const byte *p, int len, byte flags, struct instr *ins
     /* check that the instruction exists */
     if (instr->op.name[0] == '?')
         warn_at("Unknown opcode 0x%02x (extension %d)\n", instr->op.opcode, instr->op.subcode);
+}
+
+/* Print an instruction that has already been through format_instr(). */
+void write_instr(struct output *out, char *ip, const byte *p, int len, byte flags, const struct instr *instr, const struct instr_text *text, const char *comment) {
+    int i;
 
     /* okay, now we begin dumping */
     if ((flags & INSTR_JUMP) && (opts & COMPILABLE)) {
         /* output a label, which is like an address but without the segment prefix */
         /* FIXME: check masm */
         if (asm_syntax == NASM)
-            printf(".");
-        printf("%s:", ip);
+            out_putc(out, '.');
+        out_puts(out, ip);
+        out_putc(out, ':');
     }
 
-    if (!(opts & NO_SHOW_ADDRESSES))
-        printf("%s:", ip);
-    printf("\t");
+    if (!(opts & NO_SHOW_ADDRESSES)) {
+        out_puts(out, ip);
+        out_putc(out, ':');
+    }
+    out_putc(out, '\t');
 
     if (!(opts & NO_SHOW_RAW_INSN)) {
-        for (i=0; i<len && i<7; i++)
-            printf("%02x ", p[i]);
+        for (i=0; i<len && i<7; i++) {
+            out_hex(out, p[i], 2);
+            out_putc(out, ' ');
+        }
         for (; i<8; i++)
-            printf("   ");
+            out_puts(out, "   ");
     }
 
     /* mark instructions that are jumped to */
     if ((flags & INSTR_JUMP) && !(opts & COMPILABLE))
-        printf((flags & INSTR_FAR) ? ">>" : " >");
+        out_puts(out, (flags & INSTR_FAR) ? ">>" : " >");
     else
-        printf("  ");
+        out_puts(out, "  ");
 
     /* print prefixes, including (fake) prefixes if ours are invalid */
     if (instr->prefix & PREFIX_SEG_MASK) {
         /* note: is it valid to use overrides with lods and outs? */
         if (!instr->usedmem || (instr->op.arg0 == ESDI || (instr->op.arg1 == ESDI && instr->op.arg0 != DSSI))) {  /* can't be overridden */
             warn_at("Segment prefix %s used with opcode 0x%02x %s\n", seg16[(instr->prefix & PREFIX_SEG_MASK)-1], instr->op.opcode, instr->op.name);
-            printf("%s ", seg16[(instr->prefix & PREFIX_SEG_MASK)-1]);
+            out_printf(out, "%s ", seg16[(instr->prefix & PREFIX_SEG_MASK)-1]);
         }
     }
     if ((instr->prefix & PREFIX_OP32) && instr->op.size != 16 && instr->op.size != 32) {
         warn_at("Operand-size override used with opcode 0x%02x %s\n", instr->op.opcode, instr->op.name);
-        printf((asm_syntax == GAS) ? "data32 " : "o32 "); /* fixme: how should MASM print it? */
+        out_puts(out, (asm_syntax == GAS) ? "data32 " : "o32 "); /* fixme: how should MASM print it? */
     }
     if ((instr->prefix & PREFIX_ADDR32) && (asm_syntax == NASM) && (instr->op.flags & OP_STRING)) {
-        printf("a32 ");
+        out_puts(out, "a32 ");
     } else if ((instr->prefix & PREFIX_ADDR32) && !instr->usedmem && instr->op.opcode != 0xE3) { /* jecxz */
         warn_at("Address-size prefix used with opcode 0x%02x %s\n", instr->op.opcode, instr->op.name);
-        printf((asm_syntax == GAS) ? "addr32 " : "a32 "); /* fixme: how should MASM print it? */
+        out_puts(out, (asm_syntax == GAS) ? "addr32 " : "a32 "); /* fixme: how should MASM print it? */
     }
     if (instr->prefix & PREFIX_LOCK) {
         if(!(instr->op.flags & OP_LOCK))
             warn_at("lock prefix used with opcode 0x%02x %s\n", instr->op.opcode, instr->op.name);
-        printf("lock ");
+        out_puts(out, "lock ");
     }
     if (instr->prefix & PREFIX_REPNE) {
         if(!(instr->op.flags & OP_REPNE))
             warn_at("repne prefix used with opcode 0x%02x %s\n", instr->op.opcode, instr->op.name);
-        printf("repne ");
+        out_puts(out, "repne ");
     }
     if (instr->prefix & PREFIX_REPE) {
         if(!(instr->op.flags & OP_REPE))
             warn_at("repe prefix used with opcode 0x%02x %s\n", instr->op.opcode, instr->op.name);
-        printf((instr->op.flags & OP_REPNE) ? "repe ": "rep ");
+        out_puts(out, (instr->op.flags & OP_REPNE) ? "repe ": "rep ");
     }
     if (instr->prefix & PREFIX_WAIT) {
-        printf("wait ");
+        out_puts(out, "wait ");
     }
 
     if (instr->vex)
-        printf("v");
-    printf("%s", instr->op.name);
+        out_puts(out, "v");
+    out_puts(out, instr->op.name);
 
-    if (instr->args[0].string[0] || instr->args[1].string[0])
-        printf("\t");
+    if (text->args[0][0] || text->args[1][0])
+        out_puts(out, "\t");
 
     if (asm_syntax == GAS) {
         /* fixme: are all of these orderings correct? */
-        if (instr->args[1].string[0])
-            printf("%s,", instr->args[1].string);
+        if (text->args[1][0]) {
+            out_puts(out, text->args[1]);
+            out_putc(out, ',');
+        }
         if (instr->vex_reg)
-            printf("%%ymm%d, ", instr->vex_reg);
-        if (instr->args[0].string[0])
-            printf("%s", instr->args[0].string);
-        if (instr->args[2].string[0])
-            printf(",%s", instr->args[2].string);
+            out_printf(out, "%%ymm%d, ", instr->vex_reg);
+        if (text->args[0][0])
+            out_puts(out, text->args[0]);
+        if (text->args[2][0]) {
+            out_putc(out, ',');
+            out_puts(out, text->args[2]);
+        }
     } else {
-        if (instr->args[0].string[0])
-            printf("%s", instr->args[0].string);
-        if (instr->args[1].string[0])
-            printf(", ");
+        if (text->args[0][0])
+            out_puts(out, text->args[0]);
+        if (text->args[1][0])
+            out_puts(out, ", ");
         if (instr->vex_reg)
-            printf("ymm%d, ", instr->vex_reg);
-        if (instr->args[1].string[0])
-            printf("%s", instr->args[1].string);
-        if (instr->args[2].string[0])
-            printf(", %s", instr->args[2].string);
+            out_printf(out, "ymm%d, ", instr->vex_reg);
+        if (text->args[1][0])
+            out_puts(out, text->args[1]);
+        if (text->args[2][0]) {
+            out_puts(out, ", ");
+            out_puts(out, text->args[2]);
+        }
     }
     if (comment) {
-        printf(asm_syntax == GAS ? "\t// " : "\t;");
-        printf(" <%s>", comment);
+        out_puts(out, asm_syntax == GAS ? "\t// " : "\t;");
+        out_printf(out, " <%s>", comment);
     }
 
     /* if we have more than 7 bytes on this line, wrap around */
     if (len > 7 && !(opts & NO_SHOW_RAW_INSN)) {
-        printf("\n\t\t");
+        out_puts(out, "\n\t\t");
         for (i=7; i<len; i++) {
-            printf("%02x", p[i]);
-            if (i < len) printf(" ");
+            out_hex(out, p[i], 2);
+            if (i < len) out_puts(out, " ");
         }
     }
-    printf("\n");
+    out_puts(out, "\n");
+}
+
+void print_instr(struct output *out, char *ip, const byte *p, int len, byte flags, struct instr *instr, struct instr_text *text, const char *comment, int bits) {
+    format_instr(ip, instr, text, bits);
+    write_instr(out, ip, p, len, flags, instr, text, comment);
 }
@@ -114,22 +114,24 @@ enum disptype {
 
 extern const char seg16[6][3];
 
+/* A decoded instruction. This holds no text besides the mnemonic, so that it
+ * stays small enough to decode into and store in bulk; the arguments are only
+ * turned into strings (in a struct instr_text) when printing. */
 struct arg {
-    char string[32];
-    dword ip;
     qword value;
+    dword ip;
     enum argtype type;
 };
 
 struct instr {
-    word prefix;
     struct op op;
     struct arg args[3];
+    word prefix;
     byte addrsize;
-    enum disptype modrm_disp;
     int8_t modrm_reg; /* This is a little ugly, but 16 is IP and -1 is none (aka IZ). */
     byte sib_scale;
     char sib_index;
+    enum disptype modrm_disp;
     int usedmem:1;  /* used for error checking */
 
     int vex:1;
@@ -137,8 +139,42 @@ struct instr {
     int vex_256:1;
 };
 
+#define ARG_STRING_MAX  32
+
+/* The arguments of an instruction as they'll be printed. Backends may fill
+ * some in themselves (e.g. for relocations); format_instr() fills in the rest,
+ * so the others must start out empty. */
+struct instr_text {
+    char args[3][ARG_STRING_MAX];
+};
+
+/* The same, packed for storing many instructions at once. The op is kept
+ * elsewhere and referred to by index, and argument addresses are kept as
+ * offsets from the instruction. */
+struct instr_record {
+    qword values[3];
+    word op;
+    word prefix;
+    byte len;
+    byte types[3];
+    byte arg_ips[3];
+    byte addrsize;
+    byte modrm_disp;
+    int8_t modrm_reg;
+    byte sib_scale;
+    char sib_index;
+    byte usedmem:1;
+    byte vex:1;
+    byte vex_reg:3;
+    byte vex_256:1;
+};
+
 extern int get_instr(dword ip, const byte *p, struct instr *instr, int bits);
-extern void print_instr(char *ip, const byte *p, int len, byte flags, struct instr *instr, const char *comment, int bits);
+extern void pack_instr(struct instr_record *record, const struct instr *instr, dword ip, int len, word op);
+extern int unpack_instr(struct instr *instr, const struct instr_record *record, dword ip, const struct op *op);
+extern void format_instr(char *ip, struct instr *instr, struct instr_text *text, int bits);
+extern void write_instr(struct output *out, char *ip, const byte *p, int len, byte flags, const struct instr *instr, const struct instr_text *text, const char *comment);
+extern void print_instr(struct output *out, char *ip, const byte *p, int len, byte flags, struct instr *instr, struct instr_text *text, const char *comment, int bits);
 
 /* 66 + 67 + seg + lock/rep + 2 bytes opcode + modrm + sib + 4 bytes displacement + 4 bytes immediate */
 #define MAX_INSTR       16
@@ -0,0 +1,9 @@
+#!/bin/sh
+# The import directory of import-tail.exe starts 16 bytes before the end of
+# .text, so its table runs past the end of the section. dump used to read the
+# MZ header there and crash.
+
+exe="$srcdir/tests/import-tail.exe"
+
+./dump -i "$exe" > /dev/null || exit 1
+./dump --map-sections -i "$exe" > /dev/null || exit 1